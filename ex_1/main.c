@@ -4,11 +4,12 @@
 #include <string.h>
 #include <ctype.h>
 #include "fs/operations.h"
-#include <sys/time.h>
+#include <time.h>
 #include <pthread.h>
 
-#define MAX_COMMANDS 150000
-#define MAX_INPUT_SIZE 100
+#define ARENA_INITIAL_SIZE 4096   //initial size in bytes of the command arena, it doubles whenever it gets full
+#define INDEX_INITIAL_SIZE 256    //initial number of slots in the command index, it also doubles when full
+#define COMMAND_BATCH 32          //number of consecutive commands a thread claims from the index at once
 #define NOSYNC 0
 #define MUTEX 1
 #define RWLOCK 2
@@ -26,12 +27,17 @@ char* outputFilename = NULL;    //file to which you write the file system's outp
 int maxThreads = 0;             //maximum number of threads is stored here
 int synchstrategy = NOSYNC;     //there are three possible synchronization strategies (nosync, mutex ou rwlock)
 
-pthread_mutex_t queue_lock;
 lock_t fs_lock;
 
-char inputCommands[MAX_COMMANDS][MAX_INPUT_SIZE];
+/*the commands are stored back to back in a growable arena, each one terminated by '\0',
+and the index keeps the offset of every command inside the arena*/
+char* commandArena = NULL;
+size_t arenaSize = 0;           //number of bytes of the arena in use
+size_t arenaCapacity = 0;       //number of bytes allocated for the arena
+size_t* commandIndex = NULL;
+int indexCapacity = 0;          //number of slots allocated for the index
 int numberCommands = 0;
-int headQueue = 0;
+int headQueue = 0;              //next command to be claimed, only advanced with an atomic fetch-add
 
 static void arguments(int argc, char* const argv[]) {   //this function parses the program's variables
     if(argc != 5) {                                     //the function only succeeds if you have exactly 5 arguments and if their typings are correct
@@ -62,20 +68,44 @@ static void arguments(int argc, char* const argv[]) {   //this function parses t
     }
 }
 
-int insertCommand(char* data) {
-    if(numberCommands != MAX_COMMANDS) {
-        strcpy(inputCommands[numberCommands++], data);
-        return 1;
+int insertCommand(char* data) {     //appends a command to the arena and records its offset in the index
+    size_t length = strlen(data) + 1;
+    if(arenaSize + length > arenaCapacity) {
+        size_t newCapacity = arenaCapacity == 0 ? ARENA_INITIAL_SIZE : arenaCapacity;
+        while(arenaSize + length > newCapacity)
+            newCapacity *= 2;
+        char* newArena = realloc(commandArena, newCapacity);
+        if(!newArena)
+            return 0;
+        commandArena = newArena;
+        arenaCapacity = newCapacity;
     }
-    return 0;
+    if(numberCommands == indexCapacity) {
+        int newCapacity = indexCapacity == 0 ? INDEX_INITIAL_SIZE : indexCapacity * 2;
+        size_t* newIndex = realloc(commandIndex, newCapacity * sizeof(size_t));
+        if(!newIndex)
+            return 0;
+        commandIndex = newIndex;
+        indexCapacity = newCapacity;
+    }
+    memcpy(commandArena + arenaSize, data, length);
+    commandIndex[numberCommands++] = arenaSize;
+    arenaSize += length;
+    return 1;
 }
 
-char* removeCommand() {
-    if(numberCommands > 0){
-        numberCommands--;
-        return inputCommands[headQueue++];  
-    }
-    return NULL;
+int claimCommands(int* first, int* last) {  //reserves the next batch of commands for the calling thread, returns 0 when there are none left
+    int start = __atomic_fetch_add(&headQueue, COMMAND_BATCH, __ATOMIC_RELAXED);
+    if(start >= numberCommands)
+        return 0;
+    *first = start;
+    *last = start + COMMAND_BATCH < numberCommands ? start + COMMAND_BATCH : numberCommands;
+    return 1;
+}
+
+void destroyCommands() {    //releases the memory used by the arena and the index
+    free(commandArena);
+    free(commandIndex);
 }
 
 void errorParse(){
@@ -83,6 +113,11 @@ void errorParse(){
     exit(EXIT_FAILURE);
 }
 
+void errorMemory(){     //the commands are kept in memory, none can be dropped
+    fprintf(stderr, "Error: not enough memory for the commands\n");
+    exit(EXIT_FAILURE);
+}
+
 void mutex_lock(pthread_mutex_t* mutex) {  //prevents other threads from reading from and writing to the locked content
     if(pthread_mutex_lock(mutex) != 0) {
         fprintf(stderr, "Couldn't lock mutex\n");
@@ -168,40 +203,42 @@ void processInput(){
         fprintf(stderr, "Input file not found\n");
         exit(EXIT_FAILURE);
     }
-    char line[MAX_INPUT_SIZE];
+    char* line = NULL;
+    size_t lineCapacity = 0;
 
     /* break loop with ^Z or ^D */
-    while (fgets(line, sizeof(line)/sizeof(char), inputFile)) { //the file is parsed line per line
+    while (getline(&line, &lineCapacity, inputFile) != -1) { //the file is parsed line per line, whatever its length
         char token, type;
-        char name[MAX_INPUT_SIZE];
+        char* name = NULL;      //allocated by sscanf, a name too long to be valid is rejected below
 
-        int numTokens = sscanf(line, "%c %s %c", &token, name, &type);
+        int numTokens = sscanf(line, "%c %ms %c", &token, &name, &type);
 
         /* perform minimal validation */
         if (numTokens < 1) {
+            free(name);
             continue;
         }
         switch (token) {
             case 'c':
-                if(numTokens != 3)
+                if(numTokens != 3 || strlen(name) >= MAX_FILE_NAME)
                     errorParse();
-                if(insertCommand(line))
-                    break;
-                return;
+                if(!insertCommand(line))
+                    errorMemory();
+                break;
             
             case 'l':
-                if(numTokens != 2)
+                if(numTokens != 2 || strlen(name) >= MAX_FILE_NAME)
                     errorParse();
-                if(insertCommand(line))
-                    break;
-                return;
+                if(!insertCommand(line))
+                    errorMemory();
+                break;
             
             case 'd':
-                if(numTokens != 2)
+                if(numTokens != 2 || strlen(name) >= MAX_FILE_NAME)
                     errorParse();
-                if(insertCommand(line))
-                    break;
-                return;
+                if(!insertCommand(line))
+                    errorMemory();
+                break;
             
             case '#':
                 break;
@@ -210,7 +247,9 @@ void processInput(){
                 errorParse();
             }
         }
+        free(name);
     }
+    free(line);
     fclose(inputFile);
 }
 
@@ -223,62 +262,63 @@ FILE* openOutput() {        //the output file is opened for writing only
     return outputFile;
 }
 
-void* applyCommands() {
-    while (numberCommands > 0) {
-        mutex_lock(&queue_lock);        //the command queue is locked to prevent command removal from other threads
-        const char* command = removeCommand();
-        mutex_unlock(&queue_lock);
-        if (command == NULL){
-            continue;
-        }
-        char token, type;
-        char name[MAX_INPUT_SIZE];
-        int numTokens = sscanf(command, "%c %s %c", &token, name, &type);
-        if (numTokens < 2) {
-            fprintf(stderr, "Error: invalid command in Queue\n");
+void applyCommand(const char* command) {      //parses a single command and applies it to the file system
+    char token, type;
+    char name[MAX_FILE_NAME];
+    int numTokens = sscanf(command, "%c %99s %c", &token, name, &type);      //names were checked to fit when the input was read
+    if (numTokens < 2) {
+        fprintf(stderr, "Error: invalid command in Queue\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int searchResult;
+    switch (token) {
+        case 'c':       //in case we want to create something, a writelock prevents other threads from doing the same before this one
+            switch (type) {
+                case 'f':
+                    writelock(&fs_lock);
+                    printf("Create file: %s\n", name);
+                    create(name, T_FILE);
+                    unlock(&fs_lock);
+                    break;
+                case 'd':
+                    writelock(&fs_lock);
+                    printf("Create directory: %s\n", name);
+                    create(name, T_DIRECTORY);
+                    unlock(&fs_lock);
+                    break;
+                default:
+                    fprintf(stderr, "Error: invalid node type\n");
+                    exit(EXIT_FAILURE);
+            }
+            break;
+        case 'l':       //in case we want to lookup something, a readlock prevents other threads from doing the same before this one
+            readlock(&fs_lock);
+            searchResult = lookup(name);
+            unlock(&fs_lock);
+            if (searchResult >= 0)
+                printf("Search: %s found\n", name);
+            else
+                printf("Search: %s not found\n", name);
+            break;
+        case 'd':       //in case we want to delete something, a writelock prevents other threads from doing the same before this one
+            writelock(&fs_lock);
+            printf("Delete: %s\n", name);
+            delete(name);
+            unlock(&fs_lock);
+            break;
+        default: { /* error */
+            fprintf(stderr, "Error: command to apply\n");
             exit(EXIT_FAILURE);
         }
+    }
+}
 
-        int searchResult;
-        switch (token) {
-            case 'c':       //in case we want to create something, a writelock prevents other threads from doing the same before this one
-                switch (type) {
-                    case 'f':
-                        writelock(&fs_lock);
-                        printf("Create file: %s\n", name);
-                        create(name, T_FILE);
-                        unlock(&fs_lock);
-                        break;
-                    case 'd':
-                        writelock(&fs_lock);
-                        printf("Create directory: %s\n", name);
-                        create(name, T_DIRECTORY);
-                        unlock(&fs_lock);
-                        break;
-                    default:
-                        fprintf(stderr, "Error: invalid node type\n");
-                        exit(EXIT_FAILURE);
-                }
-                break;
-            case 'l':       //in case we want to lookup something, a readlock prevents other threads from doing the same before this one
-                readlock(&fs_lock);
-                searchResult = lookup(name);
-                unlock(&fs_lock);
-                if (searchResult >= 0)
-                    printf("Search: %s found\n", name);
-                else
-                    printf("Search: %s not found\n", name);
-                break;
-            case 'd':       //in case we want to delete something, a writelock prevents other threads from doing the same before this one
-                writelock(&fs_lock);
-                printf("Delete: %s\n", name);
-                delete(name);
-                unlock(&fs_lock);
-                break;
-            default: { /* error */
-                fprintf(stderr, "Error: command to apply\n");
-                exit(EXIT_FAILURE);
-            }
+void* applyCommands() {
+    int first, last;
+    while (claimCommands(&first, &last)) {     //no lock is needed, each thread works on its own range of the index
+        for (int i = first; i < last; i++) {
+            applyCommand(commandArena + commandIndex[i]);
         }
     }
     return NULL;
@@ -308,33 +348,33 @@ void runThreads(){      //this function creates and manages the various threads
 
 int main(int argc, char* argv[]) {
     double elapsedTime;     //number of seconds the program ran for
-    struct timeval startTime;
-    struct timeval stopTime;
+    struct timespec startTime;
+    struct timespec stopTime;
     FILE* outputFile;
     arguments(argc, argv);
     outputFile = openOutput();
     /* init filesystem */
     init_fs();
-    if(gettimeofday(&startTime, NULL) != 0) {   //the program obtains its starting time from the pc's clock
+    if(clock_gettime(CLOCK_MONOTONIC, &startTime) != 0) {   //the program obtains its starting time from a monotonic clock
         fprintf(stderr, "Couldn't get time\n");
         exit(EXIT_FAILURE);
     }
-    mutex_init(&queue_lock);
     init_lock(&fs_lock);
 
     /* process input and print tree */
     processInput();
     runThreads();
-    if(gettimeofday(&stopTime, NULL) != 0) {    //the program obtains its stopping time from the pc's clock
+    if(clock_gettime(CLOCK_MONOTONIC, &stopTime) != 0) {    //the program obtains its stopping time from the same clock
         fprintf(stderr, "Couldn't get time\n");
         exit(EXIT_FAILURE);
     }
-    elapsedTime = (double) (stopTime.tv_usec - startTime.tv_usec) / CLOCKS_PER_SEC;
-    printf("The program ended in %.4f seconds.\n", elapsedTime);
+    elapsedTime = (stopTime.tv_sec - startTime.tv_sec) + (stopTime.tv_nsec - startTime.tv_nsec) / 1e9;
+    printf("The program ended in %.6f seconds.\n", elapsedTime);
     print_tecnicofs_tree(outputFile);
     fclose(outputFile);
 
     /* release allocated memory */
+    destroyCommands();
     destroy_fs();
     exit(EXIT_SUCCESS);
 }
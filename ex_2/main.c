@@ -4,7 +4,7 @@
 #include <string.h>
 #include <ctype.h>
 #include "fs/operations.h"
-#include <sys/time.h>
+#include <time.h>
 #include <pthread.h>
 
 #define MAX_COMMANDS 10
@@ -298,27 +298,27 @@ void initBuffer() {
 
 int main(int argc, char* argv[]) {
     double elapsedTime;     //number of seconds the program ran for
-    struct timeval startTime;
-    struct timeval stopTime;
+    struct timespec startTime;
+    struct timespec stopTime;
     FILE* outputFile;
     initBuffer();
     arguments(argc, argv);
     outputFile = openOutput();
     /* init filesystem */
     init_fs();
-    if(gettimeofday(&startTime, NULL) != 0) {   //the program obtains its starting time from the pc's clock
+    if(clock_gettime(CLOCK_MONOTONIC, &startTime) != 0) {   //the program obtains its starting time from a monotonic clock
         fprintf(stderr, "Couldn't get time\n");
         exit(EXIT_FAILURE);
     }
 
     /* process input and print tree */
     runThreads();
-    if(gettimeofday(&stopTime, NULL) != 0) {    //the program obtains its stopping time from the pc's clock
+    if(clock_gettime(CLOCK_MONOTONIC, &stopTime) != 0) {    //the program obtains its stopping time from the same clock
         fprintf(stderr, "Couldn't get time\n");
         exit(EXIT_FAILURE);
     }
-    elapsedTime = (double) (stopTime.tv_usec - startTime.tv_usec) / CLOCKS_PER_SEC;
-    printf("The program ended in %.4f seconds.\n", elapsedTime);
+    elapsedTime = (stopTime.tv_sec - startTime.tv_sec) + (stopTime.tv_nsec - startTime.tv_nsec) / 1e9;
+    printf("The program ended in %.6f seconds.\n", elapsedTime);
     print_tecnicofs_tree(outputFile);
     fclose(outputFile);
 
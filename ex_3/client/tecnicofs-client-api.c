@@ -1,4 +1,6 @@
+#define _GNU_SOURCE     //memfd_create
 #include "tecnicofs-client-api.h"
+#include "../tecnicofs-protocol.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,27 +9,480 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 
 int sockfd;
+int socketType;     //SOCK_STREAM or SOCK_SEQPACKET when connected to a connection-oriented server, SOCK_DGRAM otherwise
 int messageSize = sizeof(char) * 100; 
 struct sockaddr_un local, remote;
 socklen_t clilen, servlen;
 
+int binaryProtocol = 1;     //requests use the binary protocol unless TECNICOFS_PROTOCOL=text when mounting
+uint32_t nextRequestId = 0;
+
+tfs_shm_ring* ring = NULL;  //shared with the server when mounted with TECNICOFS_TRANSPORT=shm, see tecnicofs-protocol.h
+uint32_t ringTail = 0;      //requests submitted to the ring, only this client writes it
+uint32_t ringHead = 0;      //replies taken from the ring
+int doorbell = -1;          //wakes the server
+int wakeup = -1;            //written by the server to wake this client
+int ringSpin = TFS_SHM_SPIN;    //polls before yielding, none on a single processor where the server can't answer meanwhile
+
+char* batch = NULL;         //commands added since tfsBatchBegin, sent as one request by tfsBatchSubmit
+size_t batchLength = 0;
+size_t batchCapacity = 0;
+int batchCount = 0;
+
+typedef struct pendingRequest {     //a binary request waiting for its reply, found by its id
+  int busy;
+  int done;                 //the reply arrived and waits for the blocking call that sent the request
+  int ring;                 //sent through the ring, not the socket
+  uint32_t id;
+  tfsCallback callback;     //NULL for blocking calls, which get the reply copied instead
+  void* context;
+  void* reply;
+  size_t replySize;
+  ssize_t replyLength;
+} pendingRequest;
+
+pendingRequest pendingRequests[MAX_IN_FLIGHT];
+int inFlight = 0;
+int socketInFlight = 0;     //in flight through the socket, the only ones a ring client reads the socket for
+char streamBuffer[TFS_MAX_REPLY_SIZE];      //part of a reply read from a stream
+size_t streamLength = 0;
+
+#define REOPEN -100         //the server refused an opened file, see fileCall
+
+typedef struct openFile {   //a file opened by tfsOpen, named to the server by its i-node so its path isn't looked up again
+  int busy;
+  permission mode;
+  int32_t inumber;
+  uint32_t generation;      //tells the file from a later one reusing its i-node
+  uint32_t epoch;           //clones the server had made, it refuses the i-node after the next one
+  char* path;
+} openFile;
+
+openFile openFiles[MAX_OPEN_FILES];     //indexed by the descriptors tfsOpen returns
+
+static int completeReplies(int block);
+static int statCall(char *path, openFile* file, int opening, size_t *size);
+
+/*
+ * Sends a message to the server, whole even if the socket is a stream.
+ * Returns: number of bytes sent, or -1 on failure
+ */
+static ssize_t sendBytes(const char* message, size_t length) {
+  if(socketType == SOCK_DGRAM) {    //never blocks, the server's workers may be waiting for this client to read their replies
+    ssize_t sent;
+    while((sent = sendto(sockfd, message, length, MSG_DONTWAIT, (struct sockaddr *) &remote, servlen)) < 0
+          && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      struct pollfd readable = { sockfd, POLLIN, 0 };
+      if(inFlight == 0 || completeReplies(0) == 0)
+        poll(&readable, 1, 1);    //a reply frees room in the server's queue as well
+    }
+    return sent;
+  }
+
+  size_t sent = 0;
+  while(sent < length) {
+    ssize_t written = send(sockfd, message + sent, length - sent, MSG_NOSIGNAL);
+    if(written < 0) {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+    sent += written;
+  }
+  return sent;
+}
+
+/*
+ * Sends a text request to the server. On connections the request is
+ * NUL-terminated, so the server can split a byte stream into requests.
+ * Returns: number of bytes sent, or -1 on failure
+ */
+static ssize_t sendMessage(char* message) {
+  return sendBytes(message, strlen(message) + 1);
+}
+
+/*
+ * Writes a binary request (header and paths) to buffer, which must have room
+ * for sizeof(tfs_request) plus the length of both paths.
+ * Returns: size of the request, or 0 if a path is too long for the protocol
+ */
+static size_t encodeRequest(char* buffer, uint8_t opcode, uint8_t flags, uint32_t id, char* path, char* path2) {
+  size_t length1 = strlen(path), length2 = path2 ? strlen(path2) : 0;
+  if(length1 > UINT16_MAX || length2 > UINT16_MAX || sizeof(tfs_request) + length1 + length2 > TFS_MAX_MESSAGE_SIZE)
+    return 0;
+  tfs_request header = { TFS_PROTOCOL_BYTE, opcode, flags, 0, id, length1, length2 };
+  memcpy(buffer, &header, sizeof(header));
+  memcpy(buffer + sizeof(header), path, length1);
+  if(path2)
+    memcpy(buffer + sizeof(header) + length1, path2, length2);
+  return sizeof(header) + length1 + length2;
+}
+
+/*
+ * Receives one binary reply from the socket. A stream may have delivered only
+ * part of it, which is kept until the rest arrives.
+ * Returns: size of the reply, 0 if none arrived and block is 0, or -1 on failure
+ */
+static ssize_t receiveMessage(char* buffer, size_t size, int block) {
+  int flags = block ? 0 : MSG_DONTWAIT;
+  ssize_t count;
+  if(socketType != SOCK_STREAM) {
+    while((count = recv(sockfd, buffer, size, flags)) < 0 && errno == EINTR);
+    if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    return count > 0 ? count : -1;
+  }
+
+  while(1) {    //the header tells how many results follow it
+    size_t expected = sizeof(tfs_reply);
+    if(streamLength >= sizeof(tfs_reply)) {
+      tfs_reply header;
+      memcpy(&header, streamBuffer, sizeof(header));
+      if(header.opcode == TFS_OP_BATCH && header.flags == 0 && header.result > 0)
+        expected += header.result * sizeof(int32_t);
+      else if((header.opcode == TFS_OP_STATS || header.opcode == TFS_OP_READ) && header.flags == 0 && header.result > 0)
+        expected += header.result;
+      else if(header.opcode == TFS_OP_DUMP && !(header.flags & TFS_REPLY_ERROR) && header.result >= 0)
+        expected += sizeof(tfs_dump_args) + header.result;
+      else if(header.opcode == TFS_OP_READDIR && !(header.flags & TFS_REPLY_ERROR) && header.result >= 0) {
+        if(streamLength < sizeof(tfs_reply) + sizeof(tfs_readdir_args))
+          expected += sizeof(tfs_readdir_args);     //which tells how long the entries are
+        else {
+          tfs_readdir_args args;
+          memcpy(&args, streamBuffer + sizeof(tfs_reply), sizeof(args));
+          expected += sizeof(tfs_readdir_args) + args.count;
+        }
+      }
+      else if(header.opcode == TFS_OP_STAT && header.flags == 0 && header.result >= 0)
+        expected += sizeof(tfs_stat);
+      if(expected > sizeof(streamBuffer) || expected > size)
+        return -1;
+      if(streamLength == expected) {
+        memcpy(buffer, streamBuffer, expected);
+        streamLength = 0;
+        return expected;
+      }
+    }
+    count = recv(sockfd, streamBuffer + streamLength, expected - streamLength, flags);
+    if(count < 0 && errno == EINTR)
+      continue;
+    if(count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if(count <= 0)
+      return -1;
+    streamLength += count;
+  }
+}
+
+/*
+ * Hands a reply to the request it answers: runs the callback of an
+ * asynchronous request, or copies the reply for the blocking call waiting for it.
+ */
+static void deliverReply(const char* message, size_t length) {
+  tfs_reply header;
+  if(length < sizeof(header))
+    return;
+  memcpy(&header, message, sizeof(header));
+  pendingRequest* request = &pendingRequests[header.id % MAX_IN_FLIGHT];
+  if(!request->busy || request->done || request->id != header.id)
+    return;     //a reply nobody waits for
+  inFlight--;
+  if(!request->ring)
+    socketInFlight--;
+  if(request->callback) {
+    request->busy = 0;      //freed first, the callback may submit another request
+    request->callback(header.flags ? TECNICOFS_ERROR_OTHER : header.result, request->context);
+    return;
+  }
+  request->replyLength = length <= request->replySize ? length : -1;
+  if(request->replyLength > 0)
+    memcpy(request->reply, message, length);
+  request->done = 1;
+}
+
+/*
+ * Completes every request whose reply has arrived, from the ring or from the
+ * socket. When block is set and none has, waits for one: on a ring it polls
+ * first, then gives the processor away, and only then sleeps on the eventfd
+ * after telling the server to ring it.
+ * Returns: number of requests completed, or -1 if the connection failed
+ */
+static int completeReplies(int block) {
+  char reply[TFS_MAX_REPLY_SIZE];
+  int completed = 0;
+  for(int polls = 0; ; polls++) {
+    ssize_t received = 0;
+    if(ring) {
+      for(; ringHead != __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE); ringHead++, completed++) {
+        tfs_shm_slot* slot = &ring->slots[ringHead % TFS_SHM_SLOTS];
+        deliverReply(slot->data, slot->length <= sizeof(slot->data) ? slot->length : 0);
+      }
+    }
+    while((!ring || socketInFlight > 0) && (received = receiveMessage(reply, sizeof(reply), 0)) > 0) {    //an idle ring costs no system call
+      deliverReply(reply, received);
+      completed++;
+    }
+    if(received < 0)
+      return -1;
+    if(completed || !block || inFlight == 0)
+      return completed;
+    if(!ring) {
+      if((received = receiveMessage(reply, sizeof(reply), 1)) < 0)
+        return -1;
+      deliverReply(reply, received);
+      return 1;
+    }
+    if(polls < ringSpin) {
+      tfs_cpu_relax();
+      continue;
+    }
+    if(polls < ringSpin + TFS_SHM_YIELDS) {
+      sched_yield();
+      continue;
+    }
+    __atomic_store_n(&ring->client_waiting, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->cq_tail, __ATOMIC_SEQ_CST) == ringHead) {   //looked at again, the server may have answered meanwhile
+      struct pollfd events[2] = { { wakeup, POLLIN, 0 }, { sockfd, POLLIN, 0 } };
+      uint64_t value;
+      if(poll(events, 2, -1) < 0 && errno != EINTR)
+        return -1;
+      if((events[0].revents & POLLIN) && read(wakeup, &value, sizeof(value)) < 0)
+        return -1;
+      if(events[1].revents & (POLLHUP | POLLERR))
+        return -1;
+    }
+    __atomic_store_n(&ring->client_waiting, 0, __ATOMIC_RELAXED);
+    polls = 0;
+  }
+}
+
+/*
+ * Sends a binary request without waiting for its reply: through the ring if it
+ * fits a slot, through the socket otherwise. Its reply goes to callback, or is
+ * kept for awaitReply when callback is NULL.
+ * Returns: 0, or -1 if it couldn't be sent
+ */
+static int submitRequest(const char* message, size_t length, uint32_t id, tfsCallback callback, void* context, void* reply, size_t replySize) {
+  pendingRequest* request = &pendingRequests[id % MAX_IN_FLIGHT];
+  int viaRing = ring && length <= sizeof(ring->slots[0].data) && message[1] != TFS_OP_STATS && message[1] != TFS_OP_READ
+                && message[1] != TFS_OP_DUMP && message[1] != TFS_OP_READDIR;   //their replies don't fit a slot
+  while(request->busy || (viaRing && ringTail - ringHead == TFS_SHM_SLOTS))    //waits for room, completing older requests
+    if(completeReplies(1) < 0)
+      return -1;
+  *request = (pendingRequest) { 1, 0, viaRing, id, callback, context, reply, replySize, 0 };
+  inFlight++;
+  if(viaRing) {
+    tfs_shm_slot* slot = &ring->slots[ringTail % TFS_SHM_SLOTS];
+    uint64_t one = 1;
+    memcpy(slot->data, message, length);
+    slot->length = length;
+    __atomic_store_n(&ring->sq_tail, ++ringTail, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->server_idle, __ATOMIC_SEQ_CST) && write(doorbell, &one, sizeof(one)) < 0)
+      return -1;
+    return 0;
+  }
+  socketInFlight++;
+  if(sendBytes(message, length) < 0) {
+    request->busy = 0;
+    inFlight--;
+    socketInFlight--;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Waits for the reply of a request submitted without a callback, completing
+ * any other request whose reply arrives first.
+ * Returns: size of the reply, or -1 on failure
+ */
+static ssize_t awaitReply(uint32_t id) {
+  pendingRequest* request = &pendingRequests[id % MAX_IN_FLIGHT];
+  while(!request->done)
+    if(completeReplies(1) < 0)
+      return -1;
+  request->busy = 0;
+  return request->replyLength;
+}
+
+/*
+ * Tells whether a text command with these paths, its letter and its node
+ * type or snapshot mark fits messageSize, the most the server reads.
+ */
+static int textFits(char* path, char* path2) {
+  size_t length = strlen(path) + (path2 ? strlen(path2) + 1 : 0);
+  if(length + sizeof("c  f") > (size_t) messageSize) {
+    fprintf(stderr, "Send Error: path too long\n");
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Sends a binary request and waits for its reply.
+ * Returns: 0 if the server applied it, -1 or -2 if sending or receiving failed,
+ * -3 if the server rejected it
+ */
+static int binaryCall(uint8_t opcode, uint8_t flags, char* path, char* path2) {
+  size_t pathsLength = strlen(path) + (path2 ? strlen(path2) : 0);
+  if(sizeof(tfs_request) + pathsLength > TFS_MAX_MESSAGE_SIZE) {    //checked before the message is put on the stack
+    fprintf(stderr, "Send Error: path too long\n");
+    return -1;
+  }
+  char message[sizeof(tfs_request) + pathsLength];
+  uint32_t id = nextRequestId++;
+  tfs_reply reply;
+  size_t length = encodeRequest(message, opcode, flags, id, path, path2);
+  if(length == 0) {
+    fprintf(stderr, "Send Error: path too long\n");
+    return -1;
+  }
+  if(submitRequest(message, length, id, NULL, NULL, &reply, sizeof(reply)) < 0) {
+    perror("Send Error");
+    return -1;
+  }
+  else if(awaitReply(id) < (ssize_t) sizeof(reply)) {
+    perror("Receive Error");
+    return -2;
+  }
+  else if(reply.flags != 0) {
+    fprintf(stderr, "Server Error\n");
+    return -3;
+  }
+  else if(reply.result < 0) {     //the server couldn't apply it: a missing path, a name in use, a snapshot...
+    return -3;
+  }
+  return 0;
+}
+
+/*
+ * Sends a binary request whose reply goes to callback. Without the binary
+ * protocol the request is sent as a blocking call and the callback runs
+ * before returning.
+ * Returns: 0, or -1 if it couldn't be sent
+ */
+static int asyncCall(uint8_t opcode, uint8_t flags, char* path, char* path2, tfsCallback callback, void* context) {
+  size_t pathsLength = strlen(path) + (path2 ? strlen(path2) : 0);
+  if(sizeof(tfs_request) + pathsLength > TFS_MAX_MESSAGE_SIZE)
+    return -1;
+  char message[sizeof(tfs_request) + pathsLength];
+  uint32_t id = nextRequestId++;
+  size_t length = encodeRequest(message, opcode, flags, id, path, path2);
+  if(length == 0 || !callback)
+    return -1;
+  return submitRequest(message, length, id, callback, context, NULL, 0);
+}
+
+/*
+ * Sends a read, write, truncate or stat of a file, named by its path or, when
+ * file isn't NULL, by the i-node it was opened as, and waits for its reply,
+ * which is copied to reply (the header, then the data of a read or the
+ * tfs_stat of a stat).
+ * Returns: the server's result, a TECNICOFS_ERROR code, or REOPEN if the
+ * reply says the file must be opened again
+ */
+static int fileRequest(uint8_t opcode, uint8_t flags, char* path, openFile* file, uint64_t offset, uint32_t length, const char* data, char* reply, size_t replySize) {
+  size_t pathLength = file ? 0 : strlen(path), dataLength = opcode == TFS_OP_WRITE ? length : 0;
+  size_t size = sizeof(tfs_request) + pathLength + sizeof(tfs_file_args) + dataLength;
+  tfs_request request = { TFS_PROTOCOL_BYTE, opcode, flags | (file ? TFS_FLAG_HANDLE : 0), 0, nextRequestId++, pathLength, sizeof(tfs_file_args) + dataLength };
+  tfs_file_args args = { offset, length, file ? file->inumber : 0, file ? file->generation : 0, file ? file->epoch : 0 };
+  tfs_reply header;
+  if(pathLength > UINT16_MAX || size > TFS_MAX_MESSAGE_SIZE)
+    return TECNICOFS_ERROR_OTHER;
+  char* message = malloc(size);
+  if(!message)
+    return TECNICOFS_ERROR_OTHER;
+  memcpy(message, &request, sizeof(request));
+  memcpy(message + sizeof(request), path, pathLength);
+  memcpy(message + sizeof(request) + pathLength, &args, sizeof(args));
+  memcpy(message + sizeof(request) + pathLength + sizeof(args), data, dataLength);
+  int sent = submitRequest(message, size, request.id, NULL, NULL, reply, replySize);
+  free(message);
+  if(sent < 0)
+    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  ssize_t received = awaitReply(request.id);
+  if(received < (ssize_t) sizeof(header))
+    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  memcpy(&header, reply, sizeof(header));
+  if(header.flags == TFS_REPLY_STALE && file)
+    return REOPEN;
+  if(header.flags != 0 || header.result < 0)
+    return TECNICOFS_ERROR_OTHER;
+  if((opcode == TFS_OP_READ && received != (ssize_t) sizeof(header) + header.result)
+     || (opcode == TFS_OP_STAT && received != (ssize_t) (sizeof(header) + sizeof(tfs_stat))))
+    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  return header.result;
+}
+
+/*
+ * Sends a file request as fileRequest does. An opened file the server
+ * refuses because a clone was made since it was opened is opened again by
+ * its path, which may name a copy of the i-node now, and the request is sent
+ * again, until no clone comes in between.
+ * Returns: the server's result, or a TECNICOFS_ERROR code
+ */
+static int fileCall(uint8_t opcode, uint8_t flags, char* path, openFile* file, uint64_t offset, uint32_t length, const char* data, char* reply, size_t replySize) {
+  int result;
+  while((result = fileRequest(opcode, flags, path, file, offset, length, data, reply, replySize)) == REOPEN) {
+    if((result = statCall(file->path, file, 1, NULL)) < 0)
+      return result;
+    if(result != T_FILE)
+      return TECNICOFS_ERROR_FILE_NOT_FOUND;
+  }
+  return result;
+}
+
+/*
+ * Receives the reply to the last request, which is NUL-terminated on connections.
+ * Returns: number of bytes received, or -1 on failure
+ */
+static ssize_t receiveReply(char* reply, size_t size) {
+  if(socketType != SOCK_STREAM)
+    return recv(sockfd, reply, size, 0);
+
+  size_t received = 0;
+  while(received < size) {
+    ssize_t count = recv(sockfd, reply + received, size - received, 0);
+    if(count < 0 && errno == EINTR)
+      continue;
+    if(count <= 0)
+      return -1;
+    received += count;
+    if(memchr(reply + received - count, '\0', count))
+      return received;
+  }
+  return -1;
+}
+
 int tfsCreate(char *filename, char nodeType) {    //sends request to the server to create a file or a directory in the specified path
+  if(binaryProtocol)
+    return binaryCall(TFS_OP_CREATE, nodeType == 'd' ? TFS_FLAG_DIRECTORY : 0, filename, NULL);
+  if(!textFits(filename, NULL))
+    return -1;
   char* message = malloc(messageSize);
-  char* node = malloc(sizeof(char));
+  char* node = malloc(sizeof(char) * 2);
   node[0] = nodeType;
+  node[1] = '\0';
   strcpy(message, "c ");
   strcat(message, filename);
   strcat(message, " ");
   strcat(message, node);
-  if(sendto(sockfd, message, messageSize, 0, (struct sockaddr *) &remote, servlen) < 0) {
+  if(sendMessage(message) < 0) {
     perror("Send Error");
     free(message);
     free(node);
     return -1;
   }
-  else if(recvfrom(sockfd, message, messageSize, 0, NULL, NULL) < 0) {
+  else if(receiveReply(message, messageSize) < 0) {
     perror("Receive Error");
     free(message);
     free(node);
@@ -45,15 +500,19 @@ int tfsCreate(char *filename, char nodeType) {    //sends request to the server
 }
 
 int tfsDelete(char *path) {   //sends a request to the server to delete a specific file
+  if(binaryProtocol)
+    return binaryCall(TFS_OP_DELETE, 0, path, NULL);
+  if(!textFits(path, NULL))
+    return -1;
   char* message = malloc(messageSize);
   strcpy(message, "d ");
   strcat(message, path);
-  if(sendto(sockfd, message, messageSize, 0, (struct sockaddr *) &remote, servlen) < 0) {
+  if(sendMessage(message) < 0) {
     perror("Send Error");
     free(message);
     return -1;
   }
-  else if(recvfrom(sockfd, message, messageSize, 0, NULL, NULL) < 0) {
+  else if(receiveReply(message, messageSize) < 0) {
     perror("Receive Error");
     free(message);
     return -2;
@@ -68,17 +527,78 @@ int tfsDelete(char *path) {   //sends a request to the server to delete a specif
 }
 
 int tfsMove(char *from, char *to) {   //sends a request to the server to move a file from one directory to another
+  if(binaryProtocol)
+    return binaryCall(TFS_OP_MOVE, 0, from, to);
+  if(!textFits(from, to))
+    return -1;
   char* message = malloc(messageSize);
   strcpy(message, "m ");
   strcat(message, from);
   strcat(message, " ");
   strcat(message, to);
-  if(sendto(sockfd, message, messageSize, 0, (struct sockaddr *) &remote, servlen) < 0) {
+  if(sendMessage(message) < 0) {
+    perror("Send Error");
+    free(message);
+    return -1;
+  }
+  else if(receiveReply(message, messageSize) < 0) {
+    perror("Receive Error");
+    free(message);
+    return -2;
+  }
+  else if(strcmp(message, "error") == 0) {
+    perror("Server Error");
+    free(message);
+    return -3;
+  }
+  free(message);
+  return 0;
+}
+
+static int textClone(char *from, char *to, int snapshot) {   //"k from to", followed by "s" for a snapshot
+  if(!textFits(from, to))
+    return -1;
+  char* message = malloc(messageSize);
+  strcpy(message, "k ");
+  strcat(message, from);
+  strcat(message, " ");
+  strcat(message, to);
+  if(snapshot)
+    strcat(message, " s");
+  if(sendMessage(message) < 0) {
+    perror("Send Error");
+    free(message);
+    return -1;
+  }
+  else if(receiveReply(message, messageSize) < 0) {
+    perror("Receive Error");
+    free(message);
+    return -2;
+  }
+  else if(strcmp(message, "error") == 0) {
+    perror("Server Error");
+    free(message);
+    return -3;
+  }
+  free(message);
+  return 0;
+}
+
+int tfsRemove(char *path) {   //deletes a file or a directory with everything below it, the server frees it in the background
+  if(binaryProtocol)
+    return binaryCall(TFS_OP_DELETE, TFS_FLAG_RECURSIVE, path, NULL);
+  if(!textFits(path, NULL))
+    return -1;
+  char* message = malloc(messageSize);
+  strcpy(message, "d ");
+  strcat(message, path);
+  strcat(message, " r");
+  if(sendMessage(message) < 0) {
     perror("Send Error");
     free(message);
     return -1;
   }
-  else if(recvfrom(sockfd, message, messageSize, 0, NULL, NULL) < 0) {
+  else if(receiveReply(message, messageSize) < 0) {
     perror("Receive Error");
     free(message);
     return -2;
@@ -92,16 +612,32 @@ int tfsMove(char *from, char *to) {   //sends a request to the server to move a
   return 0;
 }
 
+int tfsClone(char *from, char *to) {    //clones a file or directory, sharing what is below it until either side changes
+  if(!binaryProtocol)
+    return textClone(from, to, 0);
+  return binaryCall(TFS_OP_CLONE, 0, from, to);
+}
+
+int tfsSnapshot(char *from, char *to) {   //clones a file or directory into a snapshot, which can't be changed
+  if(!binaryProtocol)
+    return textClone(from, to, 1);
+  return binaryCall(TFS_OP_CLONE, TFS_FLAG_SNAPSHOT, from, to);
+}
+
 int tfsLookup(char *path) {   //sends to the server a request to look for a specific filepath
+  if(binaryProtocol)
+    return binaryCall(TFS_OP_LOOKUP, 0, path, NULL);
+  if(!textFits(path, NULL))
+    return -1;
   char* message = malloc(messageSize);
   strcpy(message, "l ");
   strcat(message, path);
-  if(sendto(sockfd, message, messageSize, 0, (struct sockaddr *) &remote, servlen) < 0) {
+  if(sendMessage(message) < 0) {
     perror("Send Error");
     free(message);
     return -1;
   }
-  else if(recvfrom(sockfd, message, messageSize, 0, NULL, NULL) < 0) {
+  else if(receiveReply(message, messageSize) < 0) {
     perror("Receive Error");
     free(message);
     return -2;
@@ -116,15 +652,19 @@ int tfsLookup(char *path) {   //sends to the server a request to look for a spec
 }
 
 int tfsPrint(char* filename) {  //sends to the server a request to print to a specific file
+  if(binaryProtocol)
+    return binaryCall(TFS_OP_PRINT, 0, filename, NULL);
+  if(!textFits(filename, NULL))
+    return -1;
   char* message = malloc(messageSize);
   strcpy(message, "p ");
   strcat(message, filename);
-  if(sendto(sockfd, message, messageSize, 0, (struct sockaddr *) &remote, servlen) < 0) {
+  if(sendMessage(message) < 0) {
     perror("Send Error");
     free(message);
     return -1;
   }
-  else if(recvfrom(sockfd, message, messageSize, 0, NULL, NULL) < 0) {
+  else if(receiveReply(message, messageSize) < 0) {
     perror("Receive Error");
     free(message);
     return -2;
@@ -138,17 +678,566 @@ int tfsPrint(char* filename) {  //sends to the server a request to print to a sp
   return 0;
 }
 
-int tfsMount(char * sockPath) { //server path is recieved and the function creates a socket
-  if((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
-      perror("Socket Error");
+/*
+ * Asks for the next bytes of a dump, or to close it when args->length is 0,
+ * and waits for them; args->cursor is set to the dump a request without one
+ * starts.
+ * Returns: number of bytes, copied after the reply's header and its
+ * tfs_dump_args, or a TECNICOFS_ERROR code; end is set once the dump ended
+ */
+static int dumpRequest(tfs_dump_args* args, char* reply, int* end) {
+  char message[sizeof(tfs_request) + sizeof(tfs_dump_args)];
+  tfs_request request = { TFS_PROTOCOL_BYTE, TFS_OP_DUMP, 0, 0, nextRequestId++, 0, sizeof(tfs_dump_args) };
+  tfs_reply header;
+  memcpy(message, &request, sizeof(request));
+  memcpy(message + sizeof(request), args, sizeof(*args));
+  if(submitRequest(message, sizeof(message), request.id, NULL, NULL, reply, TFS_MAX_REPLY_SIZE) < 0)
+    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  ssize_t received = awaitReply(request.id);
+  if(received < (ssize_t) sizeof(header))
+    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  memcpy(&header, reply, sizeof(header));
+  if((header.flags & ~TFS_REPLY_END) != 0 || header.result < 0)
+    return TECNICOFS_ERROR_OTHER;
+  if(received != (ssize_t) (sizeof(header) + sizeof(tfs_dump_args)) + header.result)
+    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  memcpy(&args->cursor, reply + sizeof(header), sizeof(args->cursor));
+  *end = header.flags & TFS_REPLY_END;
+  return header.result;
+}
+
+int tfsDump(tfsDumpCallback callback, void *context) {   //streams the tree, as a print writes it, to callback a piece at a time
+  tfs_dump_args args = { 0, TFS_MAX_DUMP_SIZE };
+  int end = 0, result = 0;
+  if(!binaryProtocol)
+    return TECNICOFS_ERROR_OTHER;
+  char* reply = malloc(TFS_MAX_REPLY_SIZE);
+  if(!reply)
+    return TECNICOFS_ERROR_OTHER;
+  while(!end) {     //the next piece is only asked for once this one is consumed
+    if((result = dumpRequest(&args, reply, &end)) < 0)
+      break;
+    if(result > 0 && callback(reply + sizeof(tfs_reply) + sizeof(tfs_dump_args), result, context) != 0) {
+      if(!end) {      //the server would keep its copy of the tree until the dump expires
+        args.length = 0;
+        dumpRequest(&args, reply, &end);
+      }
+      break;
+    }
+  }
+  free(reply);
+  return result < 0 ? result : 0;
+}
+
+/*
+ * Lists the next entries of a directory, from *cursor (0 for the first ones)
+ * on, at most max of them, and sets *cursor to where the next call goes on.
+ * Pages the server finds no entries in are skipped. An entry that is in the
+ * directory through the whole listing is listed exactly once.
+ * Returns: number of entries, 0 once every entry was listed, or a
+ * TECNICOFS_ERROR code
+ */
+int tfsReaddir(char *path, unsigned int *cursor, tfsDirEntry *entries, int max) {
+  size_t pathLength = strlen(path);
+  if(!binaryProtocol || max <= 0 || sizeof(tfs_request) + pathLength + sizeof(tfs_readdir_args) > TFS_MAX_MESSAGE_SIZE)
+    return TECNICOFS_ERROR_OTHER;
+  char message[sizeof(tfs_request) + pathLength + sizeof(tfs_readdir_args)];
+  tfs_readdir_args args = { *cursor, max < TFS_MAX_READDIR ? max : TFS_MAX_READDIR };
+  tfs_reply header;
+  char* reply = malloc(TFS_MAX_REPLY_SIZE);
+  if(!reply)
+    return TECNICOFS_ERROR_OTHER;
+  int result;
+  do {
+    tfs_request request = { TFS_PROTOCOL_BYTE, TFS_OP_READDIR, 0, 0, nextRequestId++, pathLength, sizeof(tfs_readdir_args) };
+    memcpy(message, &request, sizeof(request));
+    memcpy(message + sizeof(request), path, pathLength);
+    memcpy(message + sizeof(request) + pathLength, &args, sizeof(args));
+    if(submitRequest(message, sizeof(message), request.id, NULL, NULL, reply, TFS_MAX_REPLY_SIZE) < 0) {
+      result = TECNICOFS_ERROR_CONNECTION_ERROR;
+      break;
+    }
+    ssize_t received = awaitReply(request.id);
+    if(received < (ssize_t) sizeof(header)) {
+      result = TECNICOFS_ERROR_CONNECTION_ERROR;
+      break;
+    }
+    memcpy(&header, reply, sizeof(header));
+    if((header.flags & ~TFS_REPLY_END) != 0 || header.result < 0) {
+      result = header.flags == 0 ? TECNICOFS_ERROR_FILE_NOT_FOUND : TECNICOFS_ERROR_OTHER;
+      break;
+    }
+    if(received < (ssize_t) (sizeof(header) + sizeof(args))) {
+      result = TECNICOFS_ERROR_CONNECTION_ERROR;
+      break;
+    }
+    memcpy(&args, reply + sizeof(header), sizeof(args));
+    if(header.result > max || received != (ssize_t) (sizeof(header) + sizeof(args) + args.count)) {
+      result = TECNICOFS_ERROR_OTHER;
+      break;
+    }
+    const char* entry = reply + sizeof(header) + sizeof(args);
+    int listed;
+    for(listed = 0; listed < header.result; listed++) {
+      tfs_dirent dirent;
+      if(entry + sizeof(dirent) > reply + received)
+        break;
+      memcpy(&dirent, entry, sizeof(dirent));
+      if(dirent.length >= MAX_FILE_NAME || entry + sizeof(dirent) + dirent.length > reply + received)
+        break;
+      memcpy(entries[listed].name, entry + sizeof(dirent), dirent.length);
+      entries[listed].name[dirent.length] = '\0';
+      entries[listed].type = dirent.type == T_DIRECTORY ? 'd' : 'f';
+      entry += sizeof(dirent) + dirent.length;
+    }
+    if(listed < header.result) {
+      result = TECNICOFS_ERROR_OTHER;
+      break;
+    }
+    result = header.result;
+    *cursor = args.cursor;
+    args.count = max < TFS_MAX_READDIR ? max : TFS_MAX_READDIR;
+  } while(result == 0 && !(header.flags & TFS_REPLY_END));
+  free(reply);
+  return result;
+}
+
+int tfsCreateAsync(char *path, char nodeType, tfsCallback callback, void *context) {
+  if(!binaryProtocol) {
+    callback(tfsCreate(path, nodeType), context);
+    return 0;
+  }
+  return asyncCall(TFS_OP_CREATE, nodeType == 'd' ? TFS_FLAG_DIRECTORY : 0, path, NULL, callback, context);
+}
+
+int tfsDeleteAsync(char *path, tfsCallback callback, void *context) {
+  if(!binaryProtocol) {
+    callback(tfsDelete(path), context);
+    return 0;
+  }
+  return asyncCall(TFS_OP_DELETE, 0, path, NULL, callback, context);
+}
+
+int tfsLookupAsync(char *path, tfsCallback callback, void *context) {
+  if(!binaryProtocol) {
+    callback(tfsLookup(path), context);
+    return 0;
+  }
+  return asyncCall(TFS_OP_LOOKUP, 0, path, NULL, callback, context);
+}
+
+int tfsMoveAsync(char *from, char *to, tfsCallback callback, void *context) {
+  if(!binaryProtocol) {
+    callback(tfsMove(from, to), context);
+    return 0;
+  }
+  return asyncCall(TFS_OP_MOVE, 0, from, to, callback, context);
+}
+
+int tfsPoll() {   //runs the callbacks of the requests whose replies have arrived, without blocking
+  return completeReplies(0);
+}
+
+int tfsWait(int maxInFlight) {   //runs callbacks until at most maxInFlight requests are in flight, returns how many ran
+  int completed = 0;
+  while(inFlight > maxInFlight) {
+    int count = completeReplies(1);
+    if(count < 0)
+      return TECNICOFS_ERROR_CONNECTION_ERROR;
+    completed += count;
+  }
+  return completed;
+}
+
+int tfsStats(char *buffer, size_t size) {    //copies the server's counters to buffer as text, returns their length
+  char message[sizeof(tfs_request)], reply[TFS_MAX_REPLY_SIZE];
+  uint32_t id = nextRequestId++;
+  tfs_reply header;
+  if(!binaryProtocol || size == 0)
+    return TECNICOFS_ERROR_OTHER;
+  size_t length = encodeRequest(message, TFS_OP_STATS, 0, id, "", NULL);
+  if(submitRequest(message, length, id, NULL, NULL, reply, sizeof(reply)) < 0)
+    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  ssize_t received = awaitReply(id);
+  if(received < (ssize_t) sizeof(header))
+    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  memcpy(&header, reply, sizeof(header));
+  if(header.flags != 0 || header.result < 0 || received != (ssize_t) sizeof(header) + header.result)
+    return TECNICOFS_ERROR_OTHER;
+  size_t copied = (size_t) header.result < size ? (size_t) header.result : size - 1;
+  memcpy(buffer, reply + sizeof(header), copied);
+  buffer[copied] = '\0';
+  return copied;
+}
+
+/*
+ * Reads up to len bytes of a file from offset in requests of at most
+ * TFS_MAX_READ_SIZE bytes, the file is named by its path or opened.
+ * Returns: number of bytes read, or a TECNICOFS_ERROR code if nothing was
+ */
+static int readChunks(char *path, openFile* file, size_t offset, char *buffer, size_t len) {
+  size_t done = 0;
+  if(!binaryProtocol)
+    return TECNICOFS_ERROR_OTHER;
+  char* reply = malloc(sizeof(tfs_reply) + TFS_MAX_READ_SIZE);
+  if(!reply)
+    return TECNICOFS_ERROR_OTHER;
+  if(len > INT32_MAX)
+    len = INT32_MAX;
+  while(done < len) {     //a read returns at most TFS_MAX_READ_SIZE bytes, and fewer only at the end of the file
+    uint32_t chunk = len - done < TFS_MAX_READ_SIZE ? len - done : TFS_MAX_READ_SIZE;
+    int result = fileCall(TFS_OP_READ, 0, path, file, offset + done, chunk, NULL, reply, sizeof(tfs_reply) + TFS_MAX_READ_SIZE);
+    if(result < 0) {
+      free(reply);
+      return done ? (int) done : result;
+    }
+    memcpy(buffer + done, reply + sizeof(tfs_reply), result);
+    done += result;
+    if((uint32_t) result < chunk)
+      break;
+  }
+  free(reply);
+  return done;
+}
+
+int tfsRead(char *path, size_t offset, char *buffer, size_t len) {    //copies up to len bytes of a file from offset to buffer, returns how many
+  return readChunks(path, NULL, offset, buffer, len);
+}
+
+/*
+ * Writes len bytes of buffer to a file in requests of at most TFS_MAX_WRITE_SIZE
+ * bytes, at offset or, when appending, at the end of the file.
+ * Returns: number of bytes written, or a TECNICOFS_ERROR code if nothing was
+ */
+static int writeChunks(char *path, openFile* file, size_t offset, const char *buffer, size_t len, uint8_t flags) {
+  tfs_reply reply;
+  size_t done = 0;
+  if(!binaryProtocol)
+    return TECNICOFS_ERROR_OTHER;
+  if(len > INT32_MAX)
+    len = INT32_MAX;
+  do {
+    uint32_t chunk = len - done < TFS_MAX_WRITE_SIZE ? len - done : TFS_MAX_WRITE_SIZE;
+    int result = fileCall(TFS_OP_WRITE, flags, path, file, offset + done, chunk, buffer + done, (char*) &reply, sizeof(reply));
+    if(result < 0)
+      return done ? (int) done : result;
+    done += chunk;
+  } while(done < len);
+  return done;
+}
+
+int tfsWrite(char *path, size_t offset, const char *buffer, size_t len) {    //writes len bytes to a file from offset, returns how many
+  return writeChunks(path, NULL, offset, buffer, len, 0);
+}
+
+int tfsAppend(char *path, const char *buffer, size_t len) {    //writes len bytes at the end of a file, returns how many
+  return writeChunks(path, NULL, 0, buffer, len, TFS_FLAG_APPEND);
+}
+
+int tfsTruncate(char *path, size_t size) {    //sets the size of a file, dropping the bytes past it or adding zeros
+  tfs_reply reply;
+  if(!binaryProtocol)
+    return TECNICOFS_ERROR_OTHER;
+  return fileCall(TFS_OP_TRUNCATE, 0, path, NULL, size, 0, NULL, (char*) &reply, sizeof(reply));
+}
+
+/*
+ * Finds the type, size and i-node of a file or directory, named by its path
+ * or opened, and fills in the i-node, generation and epoch of file when it's
+ * opening; a file opened to be written gets an i-node no clone shares.
+ * Returns: the type, or a TECNICOFS_ERROR code
+ */
+static int statCall(char *path, openFile* file, int opening, size_t *size) {
+  char reply[sizeof(tfs_reply) + sizeof(tfs_stat)];
+  tfs_stat attributes;
+  if(!binaryProtocol)
+    return TECNICOFS_ERROR_OTHER;
+  uint8_t flags = opening && (file->mode & WRITE) ? TFS_FLAG_UNSHARE : 0;
+  int result = fileCall(TFS_OP_STAT, flags, path, opening ? NULL : file, 0, 0, NULL, reply, sizeof(reply));
+  if(result < 0)
+    return result == TECNICOFS_ERROR_OTHER ? TECNICOFS_ERROR_FILE_NOT_FOUND : result;
+  memcpy(&attributes, reply + sizeof(tfs_reply), sizeof(attributes));
+  if(opening) {
+    file->inumber = result;
+    file->generation = attributes.generation;
+    file->epoch = attributes.epoch;
+  }
+  if(size)
+    *size = attributes.size;
+  return attributes.type;
+}
+
+int tfsStat(char *path, size_t *size) {   //returns the type of a file or directory and, if size isn't NULL, stores the size of a file there
+  return statCall(path, NULL, 0, size);
+}
+
+/*
+ * Returns the open file of a descriptor if its mode allows the operation,
+ * or NULL with the TECNICOFS_ERROR code stored in error.
+ */
+static openFile* fileOf(int fd, permission needed, int* error) {
+  if(fd < 0 || fd >= MAX_OPEN_FILES || !openFiles[fd].busy) {
+    *error = TECNICOFS_ERROR_FILE_NOT_OPEN;
+    return NULL;
+  }
+  if((openFiles[fd].mode & needed) != needed) {
+    *error = TECNICOFS_ERROR_INVALID_MODE;
+    return NULL;
+  }
+  return &openFiles[fd];
+}
+
+int tfsOpen(char *path, permission mode) {  //opens a file for reading, writing or both, returns its descriptor
+  int fd = -1;
+  if(mode == NONE || (mode & RW) != mode)
+    return TECNICOFS_ERROR_INVALID_MODE;
+  for(int i = 0; i < MAX_OPEN_FILES; i++) {
+    if(!openFiles[i].busy && fd < 0)
+      fd = i;
+    else if(openFiles[i].busy && strcmp(openFiles[i].path, path) == 0)
+      return TECNICOFS_ERROR_FILE_IS_OPEN;
+  }
+  if(fd < 0)
+    return TECNICOFS_ERROR_MAXED_OPEN_FILES;
+  openFiles[fd].mode = mode;
+  int result = statCall(path, &openFiles[fd], 1, NULL);
+  if(result < 0)
+    return result;
+  if(result != T_FILE)
+    return TECNICOFS_ERROR_OTHER;
+  if(!(openFiles[fd].path = strdup(path)))
+    return TECNICOFS_ERROR_OTHER;
+  openFiles[fd].busy = 1;
+  return fd;
+}
+
+int tfsClose(int fd) {  //forgets an open file, the server keeps nothing for it
+  int error;
+  openFile* file = fileOf(fd, NONE, &error);
+  if(!file)
+    return error;
+  free(file->path);
+  file->busy = 0;
+  return 0;
+}
+
+int tfsPread(int fd, size_t offset, char *buffer, size_t len) {    //tfsRead on a file open for reading
+  int error;
+  openFile* file = fileOf(fd, READ, &error);
+  return file ? readChunks(NULL, file, offset, buffer, len) : error;
+}
+
+int tfsPwrite(int fd, size_t offset, const char *buffer, size_t len) {    //tfsWrite on a file open for writing
+  int error;
+  openFile* file = fileOf(fd, WRITE, &error);
+  return file ? writeChunks(NULL, file, offset, buffer, len, 0) : error;
+}
+
+int tfsFtruncate(int fd, size_t size) {    //tfsTruncate on a file open for writing
+  tfs_reply reply;
+  int error;
+  openFile* file = fileOf(fd, WRITE, &error);
+  if(!file)
+    return error;
+  return fileCall(TFS_OP_TRUNCATE, 0, NULL, file, size, 0, NULL, (char*) &reply, sizeof(reply));
+}
+
+int tfsFstat(int fd, size_t *size) {    //stores the size of an open file, fails once the file was deleted
+  int error;
+  openFile* file = fileOf(fd, NONE, &error);
+  return file ? statCall(NULL, file, 0, size) : error;
+}
+
+int tfsBatchBegin() {   //discards the commands of an unsubmitted batch and starts a new one
+  batchLength = 0;
+  batchCount = 0;
+  return 0;
+}
+
+int tfsBatchAdd(char op, char *path, char *arg) {    //adds a command to the batch ('D' removes a whole subtree): arg is the node type of a create and the destination of a move
+  size_t length = strlen(path) + (arg ? strlen(arg) : 0);
+  size_t needed = binaryProtocol ? (batchLength ? batchLength : sizeof(tfs_request)) + sizeof(tfs_request) + length    //a binary batch starts with its own header
+                                 : batchLength + length + 7;    //a text batch starts with "b" and ends with the NUL
+  if(batchCount == MAX_BATCH_SIZE || (op != 'c' && op != 'l' && op != 'd' && op != 'D' && op != 'm') || ((op == 'c' || op == 'm') && !arg))
+    return -1;
+  if(needed > TFS_MAX_MESSAGE_SIZE)
+    return -1;
+  if(needed > batchCapacity) {
+    size_t capacity = batchCapacity ? batchCapacity : 1024;
+    while(capacity < needed)
+      capacity *= 2;
+    char* buffer = realloc(batch, capacity);
+    if(!buffer)
       return -1;
+    batch = buffer;
+    batchCapacity = capacity;
   }
-  local.sun_family = AF_UNIX;
+  if(binaryProtocol) {    //the requests follow the header of the batch, written when it is submitted
+    uint8_t opcode = op == 'c' ? TFS_OP_CREATE : op == 'l' ? TFS_OP_LOOKUP : op == 'd' || op == 'D' ? TFS_OP_DELETE : TFS_OP_MOVE;
+    uint8_t flags = op == 'c' && arg[0] == 'd' ? TFS_FLAG_DIRECTORY : op == 'D' ? TFS_FLAG_RECURSIVE : 0;
+    size_t start = batchLength ? batchLength : sizeof(tfs_request);
+    size_t size = encodeRequest(batch + start, opcode, flags, batchCount, path, op == 'm' ? arg : NULL);
+    if(size == 0)
+      return -1;
+    batchLength = start + size;
+  }
+  else {
+    if(batchLength == 0)
+      batch[batchLength++] = 'b';
+    if(op == 'c' || op == 'm')
+      batchLength += snprintf(batch + batchLength, batchCapacity - batchLength, "\n%c %s %s", op, path, arg);
+    else if(op == 'D')
+      batchLength += snprintf(batch + batchLength, batchCapacity - batchLength, "\nd %s r", path);
+    else
+      batchLength += snprintf(batch + batchLength, batchCapacity - batchLength, "\n%c %s", op, path);
+  }
+  batchCount++;
+  return 0;
+}
+
+/*
+ * Sends the binary batch of count requests, length bytes long, and copies the result of each one.
+ * Returns: count, or -1, -2 or -3 as binaryCall
+ */
+static int submitBinaryBatch(int count, size_t length, int *results) {
+  char reply[sizeof(tfs_reply) + MAX_BATCH_SIZE * sizeof(int32_t)];
+  tfs_reply header;
+  tfs_request request = { TFS_PROTOCOL_BYTE, TFS_OP_BATCH, 0, 0, nextRequestId++, length - sizeof(tfs_request), count };
+  memcpy(batch, &request, sizeof(request));
+  size_t expected = sizeof(tfs_reply) + count * sizeof(int32_t);
+  if(submitRequest(batch, length, request.id, NULL, NULL, reply, sizeof(reply)) < 0) {
+    perror("Send Error");
+    return -1;
+  }
+  ssize_t received = awaitReply(request.id);
+  if(received < (ssize_t) sizeof(tfs_reply)) {
+    perror("Receive Error");
+    return -2;
+  }
+  memcpy(&header, reply, sizeof(header));
+  if(header.flags != 0 || header.result != count) {
+    fprintf(stderr, "Server Error\n");
+    return -3;
+  }
+  if(received != (ssize_t) expected) {
+    perror("Receive Error");
+    return -2;
+  }
+  for(int i = 0; i < count; i++) {
+    int32_t result;
+    memcpy(&result, reply + sizeof(tfs_reply) + i * sizeof(int32_t), sizeof(result));
+    results[i] = result;
+  }
+  return count;
+}
+
+int tfsBatchSubmit(int *results) {    //sends the batch to be executed in one dispatch, results receives the result of every command in order
+  int count = batchCount;
+  size_t length = batchLength;
+  char reply[MAX_BATCH_SIZE * 12 + 8];
+  char* savePtr;
+  tfsBatchBegin();
+  if(count == 0)
+    return 0;
+  if(binaryProtocol)
+    return submitBinaryBatch(count, length, results);
+  if(sendMessage(batch) < 0) {
+    perror("Send Error");
+    return -1;
+  }
+  else if(receiveReply(reply, sizeof(reply)) < 0) {
+    perror("Receive Error");
+    return -2;
+  }
+  int i = 0;
+  for(char* result = strtok_r(reply, " ", &savePtr); result && i < count; result = strtok_r(NULL, " ", &savePtr))
+    results[i++] = strcmp(result, "error") == 0 ? TECNICOFS_ERROR_OTHER : atoi(result);
+  if(i != count) {
+    fprintf(stderr, "Server Error: %d results for %d commands\n", i, count);
+    return -3;
+  }
+  return count;
+}
+
+/*
+ * Creates a shared-memory ring and the eventfds of both doorbells and hands
+ * them to the server over the connection. Requests that fit a slot go through
+ * the ring from then on.
+ * Returns: 0, or -1 if the server can't attach them
+ */
+static int attachRing() {
+  int fds[3] = { memfd_create("tecnicofs-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING), eventfd(0, EFD_CLOEXEC), eventfd(0, EFD_CLOEXEC) };
+  char control[CMSG_SPACE(sizeof(fds))];
+  tfs_request request = { TFS_PROTOCOL_BYTE, TFS_OP_ATTACH, 0, 0, nextRequestId++, 0, 0 };
+  tfs_reply reply;
+  struct iovec iov = { &request, sizeof(request) };
+  struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+  struct cmsghdr* rights = CMSG_FIRSTHDR(&message);
+  void* mapping = MAP_FAILED;
+
+  if(fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0 && ftruncate(fds[0], sizeof(tfs_shm_ring)) == 0
+     && fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0)   //the server checks the ring can't shrink under it
+    mapping = mmap(NULL, sizeof(tfs_shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  if(mapping != MAP_FAILED) {
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(rights), fds, sizeof(fds));
+    if(sendmsg(sockfd, &message, MSG_NOSIGNAL) == sizeof(request) && receiveMessage((char*) &reply, sizeof(reply), 1) == sizeof(reply)
+       && reply.id == request.id && reply.flags == 0) {
+      close(fds[0]);      //the mapping keeps the memory
+      ring = mapping;
+      ringTail = 0;
+      ringHead = 0;
+      ringSpin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? TFS_SHM_SPIN : 0;
+      doorbell = fds[1];
+      wakeup = fds[2];
+      return 0;
+    }
+    munmap(mapping, sizeof(tfs_shm_ring));
+  }
+  for(int i = 0; i < 3; i++)
+    if(fds[i] >= 0)
+      close(fds[i]);
+  return -1;
+}
+
+int tfsMount(char * sockPath) { //server path is recieved and the function connects to it, or creates a datagram socket if the server has no connections
+  int types[] = { SOCK_STREAM, SOCK_SEQPACKET };
   remote.sun_family = AF_UNIX;
-  strcpy(local.sun_path, "/tmp/client");
   strcpy(remote.sun_path, sockPath);
-  clilen = sizeof(struct sockaddr_un);
   servlen = sizeof(struct sockaddr_un);
+  char* protocol = getenv("TECNICOFS_PROTOCOL");
+  char* transport = getenv("TECNICOFS_TRANSPORT");
+  binaryProtocol = !protocol || strcmp(protocol, "text") != 0;
+
+  for(int i = 0; i < 2; i++) {    //connecting to a socket of another type fails with EPROTOTYPE
+    if((sockfd = socket(AF_UNIX, types[i], 0)) < 0) {
+      perror("Socket Error");
+      return -1;
+    }
+    if(connect(sockfd, (struct sockaddr *) &remote, servlen) == 0) {
+      socketType = types[i];
+      if(transport && strcmp(transport, "shm") == 0 && binaryProtocol && attachRing() < 0)
+        fprintf(stderr, "Couldn't attach a shared-memory ring, using the socket\n");
+      return 0;
+    }
+    int error = errno;
+    close(sockfd);
+    if(error != EPROTOTYPE) {
+      errno = error;
+      perror("Connect Error");
+      return -1;
+    }
+  }
+
+  if((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+      perror("Socket Error");
+      return -1;
+  }
+  socketType = SOCK_DGRAM;
+  local.sun_family = AF_UNIX;
+  clilen = sizeof(sa_family_t);   //binding only the family autobinds a unique abstract address, released when the socket is closed
   if(bind(sockfd, (struct sockaddr *) &local, clilen) < 0) {
     perror("Bind Error");
     return -2;
@@ -156,8 +1245,25 @@ int tfsMount(char * sockPath) { //server path is recieved and the function creat
   return 0;
 }
 
-int tfsUnmount() {  //closes the socket and unlinks the associated path
-  unlink(local.sun_path);
+int tfsUnmount() {  //closes the socket, which also releases its address, and the ring if there is one
+  for(int i = 0; i < MAX_IN_FLIGHT; i++) {    //requests still in flight never get their replies
+    if(pendingRequests[i].busy && pendingRequests[i].callback) {
+      pendingRequests[i].busy = 0;
+      pendingRequests[i].callback(TECNICOFS_ERROR_CONNECTION_ERROR, pendingRequests[i].context);
+    }
+    pendingRequests[i].busy = 0;
+  }
+  inFlight = socketInFlight = 0;
+  streamLength = 0;
+  for(int fd = 0; fd < MAX_OPEN_FILES; fd++)
+    if(openFiles[fd].busy)
+      tfsClose(fd);
+  if(ring) {
+    munmap(ring, sizeof(tfs_shm_ring));
+    close(doorbell);
+    close(wakeup);
+    ring = NULL;
+  }
   close(sockfd);
   return 0;
 }
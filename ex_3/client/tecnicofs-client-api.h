@@ -1,13 +1,52 @@
 #ifndef API_H
 #define API_H
 
+#include <stddef.h>
 #include "tecnicofs-api-constants.h"
 
+/* receives the result of an asynchronous request: the server's result, or a TECNICOFS_ERROR code */
+typedef void (*tfsCallback)(int result, void *context);
+
+/* an entry of a directory listed by tfsReaddir */
+typedef struct tfsDirEntry {
+  char name[MAX_FILE_NAME];
+  char type;      /* 'f' or 'd' */
+} tfsDirEntry;
+
+/* receives the next bytes of a dump, lines may be split between calls; returns non zero to stop the dump */
+typedef int (*tfsDumpCallback)(const char *data, size_t length, void *context);
+
 int tfsCreate(char *path, char nodeType);
 int tfsDelete(char *path);
+int tfsRemove(char *path);
 int tfsLookup(char *path);
 int tfsMove(char *from, char *to);
+int tfsClone(char *from, char *to);
+int tfsSnapshot(char *from, char *to);
 int tfsPrint(char *filename);
+int tfsDump(tfsDumpCallback callback, void *context);
+int tfsReaddir(char *path, unsigned int *cursor, tfsDirEntry *entries, int max);
+int tfsStats(char *buffer, size_t size);
+int tfsRead(char *path, size_t offset, char *buffer, size_t len);
+int tfsWrite(char *path, size_t offset, const char *buffer, size_t len);
+int tfsAppend(char *path, const char *buffer, size_t len);
+int tfsTruncate(char *path, size_t size);
+int tfsStat(char *path, size_t *size);
+int tfsOpen(char *path, permission mode);
+int tfsClose(int fd);
+int tfsPread(int fd, size_t offset, char *buffer, size_t len);
+int tfsPwrite(int fd, size_t offset, const char *buffer, size_t len);
+int tfsFtruncate(int fd, size_t size);
+int tfsFstat(int fd, size_t *size);
+int tfsCreateAsync(char *path, char nodeType, tfsCallback callback, void *context);
+int tfsDeleteAsync(char *path, tfsCallback callback, void *context);
+int tfsLookupAsync(char *path, tfsCallback callback, void *context);
+int tfsMoveAsync(char *from, char *to, tfsCallback callback, void *context);
+int tfsPoll();
+int tfsWait(int maxInFlight);
+int tfsBatchBegin();
+int tfsBatchAdd(char op, char *path, char *arg);
+int tfsBatchSubmit(int *results);
 int tfsMount(char* serverName);
 int tfsUnmount();
 
@@ -1,19 +1,31 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <string.h>
 #include "tecnicofs-client-api.h"
 #include "../tecnicofs-api-constants.h"
 
 FILE* inputFile;
 char* filename;
 char* serverName;
+int batchSize = 1;      /* commands sent together, 1 sends every command on its own */
+
+#define LIST_PAGE 256       /* entries of a directory asked for at once */
+
+struct pendingCommand {     /* a command in the batch, kept to report its result */
+    char op;
+    char* arg1;
+    char* arg2;
+} pending[MAX_BATCH_SIZE];
+int numberPending = 0;
 
 static void displayUsage (const char* appName) {
-    printf("Usage: %s inputfile server_socket_name\n", appName);
+    printf("Usage: %s inputfile server_socket_name [batch_size]\n", appName);
     exit(EXIT_FAILURE);
 }
 
 static void parseArgs (long argc, char* const argv[]) {
-    if (argc != 3) {
+    if (argc != 3 && argc != 4) {
         fprintf(stderr, "Invalid format:\n");
         displayUsage(argv[0]);
     }
@@ -26,6 +38,14 @@ static void parseArgs (long argc, char* const argv[]) {
         fprintf(stderr, "Error: cannot open input file\n");
         exit(EXIT_FAILURE);
     }
+
+    if (argc == 4) {
+        batchSize = atoi(argv[3]);
+        if (batchSize < 1 || batchSize > MAX_BATCH_SIZE) {
+            fprintf(stderr, "Error: the batch size must be between 1 and %d\n", MAX_BATCH_SIZE);
+            exit(EXIT_FAILURE);
+        }
+    }
 }
 
 void errorParse(){
@@ -33,91 +53,205 @@ void errorParse(){
     exit(EXIT_FAILURE);
 }
 
+void printResult(char op, char* arg1, char* arg2, int res) {   /* reports the result of a command */
+    switch (op) {
+        case 'c':
+            if (!res)
+              printf("Created %s: %s\n", arg2[0] == 'd' ? "directory" : "file", arg1);
+            else
+              printf("Unable to create %s: %s\n", arg2[0] == 'd' ? "directory" : "file", arg1);
+            break;
+        case 'l':
+            if (res >= 0)
+                printf("Search: %s found\n", arg1);
+            else
+                printf("Search: %s not found\n", arg1);
+            break;
+        case 'd':
+        case 'D':
+            if (!res)
+              printf("%s: %s\n", op == 'D' ? "Removed" : "Deleted", arg1);
+            else
+              printf("Unable to %s: %s\n", op == 'D' ? "remove" : "delete", arg1);
+            break;
+        case 'm':
+            if (!res)
+              printf("Moved: %s to %s\n", arg1, arg2);
+            else
+              printf("Unable to move: %s to %s\n", arg1, arg2);
+            break;
+        case 'k':
+        case 'K':
+            if (!res)
+              printf("%s: %s to %s\n", op == 'K' ? "Snapshot" : "Cloned", arg1, arg2);
+            else
+              printf("Unable to %s: %s to %s\n", op == 'K' ? "snapshot" : "clone", arg1, arg2);
+            break;
+        case 'p':
+            if (!res)
+              printf("Printed tecnicofs\n");
+            else
+              printf("Unable to print tecnicofs\n");
+            break;
+        case 'r':
+            if (res >= 0)
+              printf("Listed %s: %d entries\n", arg1, res);
+            else
+              printf("Unable to list: %s\n", arg1);
+            break;
+        case 'P':
+            if (!res)
+              printf("Dumped tecnicofs to %s\n", arg1);
+            else
+              printf("Unable to dump tecnicofs to %s\n", arg1);
+            break;
+    }
+}
+
+int writeDump(const char* data, size_t length, void* output) {     /* appends a piece of a dump to the file */
+    return fwrite(data, 1, length, output) != length;
+}
+
+void submitBatch() {    /* sends the pending commands in one request and reports their results */
+    int results[MAX_BATCH_SIZE];
+    int count = tfsBatchSubmit(results);
+    for (int i = 0; i < numberPending; i++) {
+        printResult(pending[i].op, pending[i].arg1, pending[i].arg2, count == numberPending ? results[i] : count);
+        free(pending[i].arg1);
+        free(pending[i].arg2);
+    }
+    numberPending = 0;
+}
+
 void *processInput() {
-    char line[MAX_INPUT_SIZE];
+    char* line = NULL;      /* lines have no length limit, paths can be as long as the protocol allows */
+    size_t lineCapacity = 0;
+    char* arg1 = NULL;      /* allocated by sscanf, freed when the next line is read */
+    char* arg2 = NULL;
 
-    while (fgets(line, sizeof(line)/sizeof(char), inputFile)) {
+    while (getline(&line, &lineCapacity, inputFile) != -1) {
         char op;
-        char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
-        int res;
+        int res = 0;
 
-        int numTokens = sscanf(line, "%c %s %s", &op, arg1, arg2);
+        free(arg1);
+        free(arg2);
+        arg1 = arg2 = NULL;
+        int numTokens = sscanf(line, "%c %ms %ms", &op, &arg1, &arg2);
 
         /* perform minimal validation */
-        if (numTokens < 1) {
+        if (numTokens < 1 || op == '#') {
             continue;
         }
         switch (op) {
             case 'c':
-                if(numTokens != 3) {
+            case 'm':
+            case 'k':
+            case 'K':
+                if(numTokens != 3)
                     errorParse();
-                    break;
-                }
-                switch (arg2[0]) {
-                    case 'f':
-                        res = tfsCreate(arg1, 'f');
-                        if (!res)
-                          printf("Created file: %s\n", arg1);
-                        else
-                          printf("Unable to create file: %s\n", arg1);
-                        break;
-                    case 'd':
-                        res = tfsCreate(arg1, 'd');
-                        if (!res)
-                          printf("Created directory: %s\n", arg1);
-                        else
-                          printf("Unable to create directory: %s\n", arg1);
-                        break;
-                    default:
-                        fprintf(stderr, "Error: invalid node type\n");
+                if(op == 'c' && arg2[0] != 'f' && arg2[0] != 'd') {
+                    fprintf(stderr, "Error: invalid node type\n");
+                    continue;
                 }
                 break;
             case 'l':
+            case 'd':
+            case 'D':
+            case 'r':
+            case 'p':
+            case 'P':
                 if(numTokens != 2)
                     errorParse();
+                break;
+            case 's':
+                break;
+            default: { /* error */
+                errorParse();
+            }
+        }
+
+        if (batchSize > 1 && op != 'p' && op != 'P' && op != 'r' && op != 's' && op != 'k' && op != 'K') {     /* the command waits in the batch, its result is reported when the batch is submitted */
+            if (tfsBatchAdd(op, arg1, op == 'c' || op == 'm' ? arg2 : NULL) != 0)
+                errorParse();
+            pending[numberPending].op = op;
+            pending[numberPending].arg1 = strdup(arg1);
+            pending[numberPending].arg2 = strdup(op == 'c' || op == 'm' ? arg2 : "");
+            if (++numberPending == batchSize)
+                submitBatch();
+            continue;
+        }
+        if (numberPending > 0)
+            submitBatch();      /* a print or clone sees every command before it */
+
+        switch (op) {
+            case 'c':
+                res = tfsCreate(arg1, arg2[0]);
+                break;
+            case 'l':
                 res = tfsLookup(arg1);
-                if (res >= 0)
-                    printf("Search: %s found\n", arg1);
-                else
-                    printf("Search: %s not found\n", arg1);
                 break;
             case 'd':
-                if(numTokens != 2)
-                    errorParse();
                 res = tfsDelete(arg1);
-                if (!res)
-                  printf("Deleted: %s\n", arg1);
-                else
-                  printf("Unable to delete: %s\n", arg1);
+                break;
+            case 'D':
+                res = tfsRemove(arg1);
                 break;
             case 'm':
-                if(numTokens != 3)
-                    errorParse();
                 res = tfsMove(arg1, arg2);
-                if (!res)
-                  printf("Moved: %s to %s\n", arg1, arg2);
-                else
-                  printf("Unable to move: %s to %s\n", arg1, arg2);
+                break;
+            case 'k':
+                res = tfsClone(arg1, arg2);
+                break;
+            case 'K':
+                res = tfsSnapshot(arg1, arg2);
                 break;
             case 'p':
                 res = tfsPrint(arg1);
-                if (!res)
-                  printf("Printed tecnicofs\n");
-                else
-                  printf("Unable to print tecnicofs\n");
                 break;
-            case '#':
+            case 'P': {     /* the dump is streamed to a file of the client's own */
+                FILE* output = fopen(arg1, "w");
+                res = output ? tfsDump(writeDump, output) : -1;
+                if (output && fclose(output) != 0)
+                    res = -1;
                 break;
-            default: { /* error */
-                errorParse();
+            }
+            case 'r': {     /* the entries are printed a page at a time, the result counts them */
+                tfsDirEntry entries[LIST_PAGE];
+                unsigned int cursor = 0;
+                int count;
+                while ((count = tfsReaddir(arg1, &cursor, entries, LIST_PAGE)) > 0) {
+                    for (int i = 0; i < count; i++)
+                        printf("%c %s\n", entries[i].type, entries[i].name);
+                    res += count;
+                }
+                if (count < 0)
+                    res = count;
+                break;
+            }
+            case 's': {     /* the server's counters are printed as they come */
+                char stats[MAX_STATS_SIZE];
+                if ((res = tfsStats(stats, sizeof(stats))) >= 0)
+                    printf("%s", stats);
+                else
+                    printf("Unable to get stats\n");
+                continue;
             }
         }
+        printResult(op, arg1, arg2, res);
     }
+    if (numberPending > 0)
+        submitBatch();
+    free(arg1);
+    free(arg2);
+    free(line);
     fclose(inputFile);
     return NULL;
 }
 
 int main(int argc, char* argv[]) {
+    double elapsedTime;     //number of seconds the client took to replay its input
+    struct timespec startTime;
+    struct timespec stopTime;
     parseArgs(argc, argv);
 
     if (tfsMount(serverName) == 0)
@@ -127,8 +261,20 @@ int main(int argc, char* argv[]) {
       exit(EXIT_FAILURE);
     }
 
+    if(clock_gettime(CLOCK_MONOTONIC, &startTime) != 0) {
+        fprintf(stderr, "Couldn't get time\n");
+        exit(EXIT_FAILURE);
+    }
+
     processInput();
 
+    if(clock_gettime(CLOCK_MONOTONIC, &stopTime) != 0) {
+        fprintf(stderr, "Couldn't get time\n");
+        exit(EXIT_FAILURE);
+    }
+    elapsedTime = (stopTime.tv_sec - startTime.tv_sec) + (stopTime.tv_nsec - startTime.tv_nsec) / 1e9;
+    printf("The client ended in %.6f seconds.\n", elapsedTime);
+
     tfsUnmount();
 
     exit(EXIT_SUCCESS);
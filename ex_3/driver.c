@@ -0,0 +1,626 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "fs/operations.h"
+#include "latency.h"
+#include "client/tecnicofs-client-api.h"
+#include "tecnicofs-protocol.h"
+
+#define INITIAL_COMMANDS 1024
+#define MAX_LOADS 32
+#define OPEN_LOOP_POLL 50000    //nanoseconds an open-loop client sleeps at most before looking for replies
+#define FILE_RUN_BYTES (64L << 20)  //bytes each thread writes and then reads for every file size, small files are rewritten until they add up
+#define MAX_FILE_DEPTH 1024
+
+/*
+ * One operation of the workload, parsed once before the run so that parsing
+ * is not part of what is measured.
+ */
+typedef struct command {
+    char op;            //c, l, d or m
+    char nodeType;      //f or d, for creates
+    char* arg1;
+    char* arg2;         //destination, for moves
+} command_t;
+
+/*
+ * State shared by every thread or process of a run. For the socket mode it is
+ * placed in shared memory, so the client processes claim commands from the
+ * same counter and leave their histograms where the driver can merge them.
+ */
+typedef struct run {
+    int nextCommand;            //only advanced with an atomic fetch-add
+    histogram_t latency[];      //one histogram per thread or process
+} run_t;
+
+/*global variables that are used when initializing the program:
+tecnicofs-driver [-t threads] [-k think_us] [-b batch | -a depth] [-s server_socket [-S] [-r rate,...]] inputfile
+tecnicofs-driver [-t threads] [-s server_socket [-S]] [-D depth] [-o] -f size,...*/
+
+int numThreads = 1;             //number of threads (core mode) and client processes (socket mode)
+long thinkTime = 0;             //microseconds each thread waits between two operations
+char* serverName = NULL;        //when set, the workload is also run through this server
+int batchSize = 1;              //commands each client process sends in one request
+int asyncDepth = 0;             //commands each client process keeps in flight with the asynchronous api, 0 uses the blocking one
+int socketOnly = 0;             //skips the run against the linked file system
+double offeredLoads[MAX_LOADS]; //operations per second sent to the server in each open-loop run, none runs a closed loop
+int numberLoads = 0;
+double offeredLoad = 0;         //of the run in progress, shared by every client process
+char* inputFilename = NULL;
+long fileSizes[MAX_LOADS];      //sizes of the files written and read instead of replaying a workload
+int numberSizes = 0;
+long fileSize = 0;              //of the run in progress
+char filePhase = 0;             //'w' while the files of a run are written, 'r' while they are read
+int fileDepth = 0;              //directories each thread's file is nested in
+int openHandles = 0;            //files are opened once and then named by their handle instead of their path
+
+command_t* commands = NULL;
+int numberCommands = 0;
+FILE* report;                   //the report goes to the original stdout, the file system's messages are discarded
+
+static void displayUsage(const char* appName) {
+    fprintf(stderr, "Usage: %s [-t threads] [-k think_us] [-b batch | -a depth] [-s server_socket [-S] [-r rate,...]] inputfile\n", appName);
+    fprintf(stderr, "       %s [-t threads] [-s server_socket [-S]] [-D depth] [-o] -f size[K|M|G],...\n", appName);
+    exit(EXIT_FAILURE);
+}
+
+static void arguments(int argc, char* const argv[]) {   //this function parses the program's variables
+    int opt;
+    char* savePtr;
+    while((opt = getopt(argc, argv, "t:k:b:a:s:Sr:f:D:o")) != -1) {
+        switch(opt) {
+            case 't':
+                numThreads = atoi(optarg);
+                break;
+            case 'k':
+                thinkTime = atol(optarg);
+                break;
+            case 'b':
+                batchSize = atoi(optarg);
+                break;
+            case 'a':
+                asyncDepth = atoi(optarg);
+                break;
+            case 's':
+                serverName = optarg;
+                break;
+            case 'S':
+                socketOnly = 1;
+                break;
+            case 'r':
+                for(char* rate = strtok_r(optarg, ",", &savePtr); rate; rate = strtok_r(NULL, ",", &savePtr)) {
+                    if(numberLoads == MAX_LOADS || (offeredLoads[numberLoads++] = atof(rate)) <= 0) {
+                        fprintf(stderr, "Please use up to %d positive rates\n", MAX_LOADS);
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                break;
+            case 'f':
+                for(char* size = strtok_r(optarg, ",", &savePtr); size; size = strtok_r(NULL, ",", &savePtr)) {
+                    char* unit;
+                    long bytes = strtol(size, &unit, 10);
+                    bytes <<= *unit == 'K' ? 10 : *unit == 'M' ? 20 : *unit == 'G' ? 30 : 0;
+                    if(numberSizes == MAX_LOADS || bytes <= 0 || (*unit && strchr("KMG", *unit) == NULL)) {
+                        fprintf(stderr, "Please use up to %d positive file sizes\n", MAX_LOADS);
+                        exit(EXIT_FAILURE);
+                    }
+                    fileSizes[numberSizes++] = bytes;
+                }
+                break;
+            case 'D':
+                fileDepth = atoi(optarg);
+                break;
+            case 'o':
+                openHandles = 1;
+                break;
+            default:
+                displayUsage(argv[0]);
+        }
+    }
+    if(numberSizes > 0) {   //the files replace the workload
+        if(optind != argc || numberLoads > 0 || batchSize > 1 || asyncDepth > 0 || (socketOnly && !serverName))
+            displayUsage(argv[0]);
+    }
+    else if(optind != argc - 1 || fileDepth > 0 || openHandles)
+        displayUsage(argv[0]);
+    if(fileDepth < 0 || fileDepth > MAX_FILE_DEPTH) {
+        fprintf(stderr, "Please use a depth between 0 and %d\n", MAX_FILE_DEPTH);
+        exit(EXIT_FAILURE);
+    }
+    inputFilename = argv[optind];
+    if((socketOnly || numberLoads > 0) && !serverName)
+        displayUsage(argv[0]);
+
+    if(numThreads <= 0 || thinkTime < 0) {
+        fprintf(stderr, "Please use a valid number of threads and think time\n");
+        exit(EXIT_FAILURE);
+    }
+    if(batchSize < 1 || batchSize > MAX_BATCH_SIZE) {
+        fprintf(stderr, "Please use a batch size between 1 and %d\n", MAX_BATCH_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    if(numberLoads > 0 && batchSize > 1) {
+        fprintf(stderr, "Open-loop runs send every command on its own\n");
+        exit(EXIT_FAILURE);
+    }
+    if(asyncDepth < 0 || asyncDepth > MAX_IN_FLIGHT || (asyncDepth > 0 && batchSize > 1)) {
+        fprintf(stderr, "Please use a depth between 1 and %d, without batches\n", MAX_IN_FLIGHT);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void errorParse(int lineNumber) {
+    fprintf(stderr, "Error: invalid command in line %d\n", lineNumber);
+    exit(EXIT_FAILURE);
+}
+
+void loadWorkload() {   //reads every create, lookup, delete and move of the input file, print commands are ignored
+    FILE* inputFile = fopen(inputFilename, "r");
+    if(!inputFile) {
+        fprintf(stderr, "Input file not found\n");
+        exit(EXIT_FAILURE);
+    }
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    int capacity = 0, lineNumber = 0;
+
+    while(getline(&line, &lineCapacity, inputFile) != -1) {
+        char token;
+        char arg1[strlen(line) + 1], arg2[strlen(line) + 1];
+        int numTokens = sscanf(line, "%c %s %s", &token, arg1, arg2);
+        lineNumber++;
+        if(numTokens < 1 || token == '#' || token == 'p' || token == '\n')
+            continue;
+        if((token == 'c' || token == 'm') ? numTokens != 3 : numTokens != 2)
+            errorParse(lineNumber);
+        if(token != 'c' && token != 'l' && token != 'd' && token != 'm')
+            errorParse(lineNumber);
+
+        if(numberCommands == capacity) {
+            capacity = capacity == 0 ? INITIAL_COMMANDS : capacity * 2;
+            commands = realloc(commands, capacity * sizeof(command_t));
+            if(!commands) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        command_t* command = &commands[numberCommands++];
+        command->op = token;
+        command->nodeType = token == 'c' ? arg2[0] : 0;
+        command->arg1 = strdup(arg1);
+        command->arg2 = token == 'm' ? strdup(arg2) : NULL;
+    }
+    free(line);
+    fclose(inputFile);
+}
+
+run_t* newRun(int shared) {     //allocates the state of a run, in memory shared with child processes if asked to
+    size_t size = sizeof(run_t) + numThreads * sizeof(histogram_t);
+    run_t* run;
+    if(shared) {
+        run = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        run = run == MAP_FAILED ? NULL : run;
+    }
+    else {
+        run = malloc(size);
+    }
+    if(!run) {
+        fprintf(stderr, "Couldn't allocate the run state\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(run, 0, size);
+    return run;
+}
+
+void think() {
+    if(thinkTime > 0) {
+        struct timespec pause = { thinkTime / 1000000, (thinkTime % 1000000) * 1000 };
+        nanosleep(&pause, NULL);
+    }
+}
+
+void applyCore(command_t* command) {    //calls the file system directly
+    switch(command->op) {
+        case 'c':
+            create(command->arg1, command->nodeType == 'd' ? T_DIRECTORY : T_FILE);
+            break;
+        case 'l':
+            lookup(command->arg1);
+            break;
+        case 'd':
+            delete(command->arg1);
+            break;
+        case 'm':
+            move(command->arg1, command->arg2);
+            break;
+    }
+}
+
+void applySocket(command_t* command) {  //sends the command to the server through the client api
+    switch(command->op) {
+        case 'c':
+            tfsCreate(command->arg1, command->nodeType);
+            break;
+        case 'l':
+            tfsLookup(command->arg1);
+            break;
+        case 'd':
+            tfsDelete(command->arg1);
+            break;
+        case 'm':
+            tfsMove(command->arg1, command->arg2);
+            break;
+    }
+}
+
+void runCommands(run_t* run, int id, void (*apply)(command_t*)) {     //claims commands one at a time until there are none left
+    int i;
+    while((i = __atomic_fetch_add(&run->nextCommand, 1, __ATOMIC_RELAXED)) < numberCommands) {
+        uint64_t start = now_ns();
+        apply(&commands[i]);
+        histogram_record(&run->latency[id], now_ns() - start);
+        think();
+    }
+}
+
+//claims batchSize commands at a time and sends them in one request, every command of a batch has its round trip as latency
+void runBatches(run_t* run, int id) {
+    int first, results[MAX_BATCH_SIZE];
+    while((first = __atomic_fetch_add(&run->nextCommand, batchSize, __ATOMIC_RELAXED)) < numberCommands) {
+        int last = first + batchSize < numberCommands ? first + batchSize : numberCommands;
+        uint64_t start = now_ns();
+        for(int i = first; i < last; i++) {
+            char type[2] = { commands[i].nodeType, '\0' };
+            tfsBatchAdd(commands[i].op, commands[i].arg1, commands[i].op == 'c' ? type : commands[i].arg2);
+        }
+        tfsBatchSubmit(results);
+        uint64_t latency = now_ns() - start;
+        for(int i = first; i < last; i++)
+            histogram_record(&run->latency[id], latency);
+        think();
+    }
+}
+
+typedef struct asyncCommand {   //a command in flight, its latency is recorded when its reply arrives
+    histogram_t* latency;
+    uint64_t start;
+} asyncCommand_t;
+
+void completeAsync(int result, void* context) {
+    asyncCommand_t* command = context;
+    histogram_record(command->latency, now_ns() - command->start);
+    free(command);
+}
+
+//sends a command once fewer than asyncDepth are in flight, its latency is measured from start
+void sendAsync(command_t* command, histogram_t* latency, uint64_t start) {
+    asyncCommand_t* context = malloc(sizeof(asyncCommand_t));
+    int sent = -1;
+    if(!context || tfsWait(asyncDepth - 1) < 0) {
+        fprintf(stderr, "Couldn't send command\n");
+        exit(EXIT_FAILURE);
+    }
+    context->latency = latency;
+    context->start = start;
+    switch(command->op) {
+        case 'c':
+            sent = tfsCreateAsync(command->arg1, command->nodeType, completeAsync, context);
+            break;
+        case 'l':
+            sent = tfsLookupAsync(command->arg1, completeAsync, context);
+            break;
+        case 'd':
+            sent = tfsDeleteAsync(command->arg1, completeAsync, context);
+            break;
+        case 'm':
+            sent = tfsMoveAsync(command->arg1, command->arg2, completeAsync, context);
+            break;
+    }
+    if(sent < 0) {
+        fprintf(stderr, "Couldn't send command\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+//keeps asyncDepth commands in flight, every command has the time until its reply as latency;
+//commands in flight together may be applied in any order
+void runAsync(run_t* run, int id) {
+    int i;
+    while((i = __atomic_fetch_add(&run->nextCommand, 1, __ATOMIC_RELAXED)) < numberCommands) {
+        sendAsync(&commands[i], &run->latency[id], now_ns());
+        think();
+    }
+    tfsWait(0);
+}
+
+void waitUntil(uint64_t time) {     //sleeps until time, running the callbacks of the replies that arrive meanwhile
+    uint64_t current;
+    while((current = now_ns()) < time) {
+        if(asyncDepth > 0 && tfsPoll() > 0)
+            continue;
+        uint64_t nap = time - current;
+        if(asyncDepth > 0 && nap > OPEN_LOOP_POLL)
+            nap = OPEN_LOOP_POLL;
+        struct timespec pause = { nap / 1000000000, nap % 1000000000 };
+        nanosleep(&pause, NULL);
+    }
+}
+
+//sends commands at the arrival times of a Poisson process of offeredLoad / numThreads per second, whether or not
+//the server keeps up; latencies count from the time a command was due, so the time it waited to be sent is included
+void runOpenLoop(run_t* run, int id) {
+    unsigned short seed[3] = { id, getpid(), now_ns() };
+    double interval = 1e9 * numThreads / offeredLoad;      //mean nanoseconds between two commands of this client
+    uint64_t due = now_ns();
+    int i;
+    while((i = __atomic_fetch_add(&run->nextCommand, 1, __ATOMIC_RELAXED)) < numberCommands) {
+        due += -log(1 - erand48(seed)) * interval;
+        waitUntil(due);
+        if(asyncDepth > 0) {
+            sendAsync(&commands[i], &run->latency[id], due);
+        }
+        else {
+            applySocket(&commands[i]);
+            histogram_record(&run->latency[id], now_ns() - due);
+        }
+    }
+    tfsWait(0);
+}
+
+//writes or reads the file of a thread over and over until FILE_RUN_BYTES have gone through, in requests of the
+//largest size the protocol allows; the latency of every whole file is recorded. The file is nested in fileDepth
+//directories and, with openHandles, opened once so that only the first request looks its path up
+void runFile(run_t* run, int id, int socket) {
+    char name[16 + 3 * MAX_FILE_DEPTH];
+    char* buffer = malloc(TFS_MAX_READ_SIZE);
+    long repetitions = fileSize < FILE_RUN_BYTES ? FILE_RUN_BYTES / fileSize : 1;
+    int fd = -1;
+    file_id file = { name, 0, 0, 0 };
+    if(!buffer) {
+        fprintf(stderr, "Couldn't allocate file buffer\n");
+        _exit(EXIT_FAILURE);
+    }
+    memset(buffer, 'x', TFS_MAX_READ_SIZE);
+    int length = 0;
+    for(int i = 0; i < fileDepth; i++) {      //directories left by a previous run are kept
+        length += i == 0 ? snprintf(name, sizeof(name), "/dir%d", id) : snprintf(name + length, sizeof(name) - length, "/d");
+        if(filePhase == 'w')
+            socket ? tfsCreate(name, 'd') : create(name, T_DIRECTORY);
+    }
+    snprintf(name + length, sizeof(name) - length, "/file%d", id);
+    if(filePhase == 'w')
+        socket ? tfsCreate(name, 'f') : create(name, T_FILE);   //a file left by a previous run is just rewritten
+    if(openHandles) {
+        type nType;
+        size_t size;
+        if(socket ? (fd = tfsOpen(name, RW)) < 0 : stat_file(&file, &nType, &size, 1) < 0) {
+            fprintf(stderr, "Couldn't open %s\n", name);
+            _exit(EXIT_FAILURE);
+        }
+        file.name = NULL;
+    }
+    for(long n = 0; n < repetitions; n++) {
+        uint64_t start = now_ns();
+        if(filePhase == 'w' && (socket ? (fd >= 0 ? tfsFtruncate(fd, 0) : tfsTruncate(name, 0)) : truncate_file(&file, 0)) < 0)
+            break;
+        for(long offset = 0; offset < fileSize; ) {
+            long limit = filePhase == 'w' ? TFS_MAX_WRITE_SIZE : TFS_MAX_READ_SIZE;
+            long chunk = fileSize - offset < limit ? fileSize - offset : limit;
+            int result;
+            if(filePhase == 'w' && socket)
+                result = fd >= 0 ? tfsPwrite(fd, offset, buffer, chunk) : tfsWrite(name, offset, buffer, chunk);
+            else if(filePhase == 'w')
+                result = write_file(&file, offset, buffer, chunk, 0) == SUCCESS ? chunk : FAIL;
+            else if(socket)
+                result = fd >= 0 ? tfsPread(fd, offset, buffer, chunk) : tfsRead(name, offset, buffer, chunk);
+            else
+                result = read_file(&file, offset, buffer, chunk);
+            if(result != chunk) {
+                fprintf(stderr, "Couldn't %s %s at %ld\n", filePhase == 'w' ? "write" : "read", name, offset);
+                _exit(EXIT_FAILURE);
+            }
+            offset += chunk;
+        }
+        histogram_record(&run->latency[id], now_ns() - start);
+    }
+    if(fd >= 0)
+        tfsClose(fd);
+    free(buffer);
+}
+
+
+run_t* coreRun;
+
+void* coreThread(void* arg) {
+    if(filePhase)
+        runFile(coreRun, (intptr_t) arg, 0);
+    else
+        runCommands(coreRun, (intptr_t) arg, applyCore);
+    return NULL;
+}
+
+double runCoreThreads() {   //runs a thread per numThreads against the file system linked into the driver
+    pthread_t* threads = malloc(numThreads * sizeof(pthread_t));
+    uint64_t start = now_ns();
+    for(int i = 0; i < numThreads; i++) {
+        if(pthread_create(&threads[i], NULL, coreThread, (void*) (intptr_t) i) != 0) {
+            fprintf(stderr, "Couldn't create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for(int i = 0; i < numThreads; i++) {
+        if(pthread_join(threads[i], NULL) != 0) {
+            fprintf(stderr, "Couldn't join thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    free(threads);
+    return elapsed;
+}
+
+double runCore() {      //runs the workload against the file system linked into the driver
+    init_fs(NULL);
+    double elapsed = runCoreThreads();
+    destroy_fs();
+    return elapsed;
+}
+
+double runSocket(run_t* run) {      //runs the workload through the server, from one client process per thread
+    uint64_t start = now_ns();
+    for(int i = 0; i < numThreads; i++) {
+        pid_t pid = fork();
+        if(pid < 0) {
+            fprintf(stderr, "Couldn't create client process\n");
+            exit(EXIT_FAILURE);
+        }
+        if(pid == 0) {
+            if(tfsMount(serverName) != 0) {
+                fprintf(stderr, "Unable to mount socket: %s\n", serverName);
+                _exit(EXIT_FAILURE);
+            }
+            if(filePhase)
+                runFile(run, i, 1);
+            else if(offeredLoad > 0)
+                runOpenLoop(run, i);
+            else if(asyncDepth > 0)
+                runAsync(run, i);
+            else if(batchSize > 1)
+                runBatches(run, i);
+            else
+                runCommands(run, i, applySocket);
+            tfsUnmount();
+            _exit(EXIT_SUCCESS);
+        }
+    }
+    int failed = 0, status;
+    while(wait(&status) > 0) {
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            failed++;
+    }
+    if(failed) {
+        fprintf(stderr, "%d client processes failed\n", failed);
+        exit(EXIT_FAILURE);
+    }
+    return (now_ns() - start) / 1e9;
+}
+
+double printRun(const char* mode, run_t* run, double elapsed) {    //prints one line of the report, returns the achieved throughput
+    histogram_t merged;
+    histogram_reset(&merged);
+    for(int i = 0; i < numThreads; i++)
+        histogram_merge(&merged, &run->latency[i]);
+    double throughput = numberCommands / (elapsed > 0 ? elapsed : 1e-9);
+    fprintf(report, "%-8s %8d %10d %10.4f %12.1f %10.1f %10.1f %10.1f %10.1f", mode, numThreads, numberCommands, elapsed,
+        throughput, histogram_percentile(&merged, 50) / 1000.0, histogram_percentile(&merged, 99) / 1000.0,
+        histogram_percentile(&merged, 99.9) / 1000.0, merged.max / 1000.0);
+    if(offeredLoad > 0)
+        fprintf(report, " %12.1f", offeredLoad);
+    fprintf(report, "\n");
+    return throughput;
+}
+
+//prints one line of the file report: the throughput of the writes and reads and the latency of reading a whole file
+void printFileRun(const char* mode, run_t* writes, double writeElapsed, run_t* reads, double readElapsed) {
+    histogram_t merged;
+    long repetitions = fileSize < FILE_RUN_BYTES ? FILE_RUN_BYTES / fileSize : 1;
+    double megabytes = (double) numThreads * repetitions * fileSize / 1e6;
+    histogram_reset(&merged);
+    for(int i = 0; i < numThreads; i++)
+        histogram_merge(&merged, &reads->latency[i]);
+    fprintf(report, "%-8s %10ld %8d %10ld %12.1f %12.1f %10.1f %10.1f\n", mode, fileSize, numThreads, repetitions,
+        megabytes / (writeElapsed > 0 ? writeElapsed : 1e-9), megabytes / (readElapsed > 0 ? readElapsed : 1e-9),
+        histogram_percentile(&merged, 50) / 1000.0, histogram_percentile(&merged, 99) / 1000.0);
+    fflush(report);
+}
+
+//every thread, or client process, writes a file of each size and reads it back; the server keeps the files between runs
+void runFiles() {
+    fprintf(report, "%-8s %10s %8s %10s %12s %12s %10s %10s\n", "mode", "bytes", "threads", "files", "write MB/s",
+        "read MB/s", "p50(us)", "p99(us)");
+    for(int i = 0; i < numberSizes; i++) {
+        double writeElapsed, readElapsed;
+        fileSize = fileSizes[i];
+        if(!socketOnly) {
+            run_t* writes = newRun(0);
+            run_t* reads = newRun(0);
+            init_fs(NULL);
+            coreRun = writes;
+            filePhase = 'w';
+            writeElapsed = runCoreThreads();
+            coreRun = reads;
+            filePhase = 'r';
+            readElapsed = runCoreThreads();
+            destroy_fs();
+            printFileRun("core", writes, writeElapsed, reads, readElapsed);
+            free(writes);
+            free(reads);
+        }
+        if(serverName) {
+            run_t* writes = newRun(1);
+            run_t* reads = newRun(1);
+            filePhase = 'w';
+            writeElapsed = runSocket(writes);
+            filePhase = 'r';
+            readElapsed = runSocket(reads);
+            printFileRun("socket", writes, writeElapsed, reads, readElapsed);
+            munmap(writes, sizeof(run_t) + numThreads * sizeof(histogram_t));
+            munmap(reads, sizeof(run_t) + numThreads * sizeof(histogram_t));
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    arguments(argc, argv);
+
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if(!report || !freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "Couldn't redirect the output\n");
+        exit(EXIT_FAILURE);
+    }
+    if(numberSizes > 0) {
+        runFiles();
+        fclose(report);
+        exit(EXIT_SUCCESS);
+    }
+    loadWorkload();
+    fprintf(report, "%-8s %8s %10s %10s %12s %10s %10s %10s %10s%s\n", "mode", "threads", "ops", "seconds",
+        "ops/s", "p50(us)", "p99(us)", "p99.9(us)", "max(us)", numberLoads > 0 ? "   offered/s" : "");
+
+    coreRun = newRun(0);
+    double coreThroughput = socketOnly ? 0 : printRun("core", coreRun, runCore());
+
+    for(int i = 0; i < numberLoads; i++) {    //one open-loop run per offered load, against the state the previous ones left
+        run_t* openRun = newRun(1);
+        offeredLoad = offeredLoads[i];
+        printRun("open", openRun, runSocket(openRun));
+        munmap(openRun, sizeof(run_t) + numThreads * sizeof(histogram_t));
+        fflush(report);
+    }
+    offeredLoad = 0;
+
+    if(serverName && numberLoads == 0) {
+        run_t* socketRun = newRun(1);
+        double socketThroughput = printRun("socket", socketRun, runSocket(socketRun));
+        if(coreThroughput > 0)
+            fprintf(report, "the socket transport delivers %.1f%% of the core throughput\n", 100 * socketThroughput / coreThroughput);
+        munmap(socketRun, sizeof(run_t) + numThreads * sizeof(histogram_t));
+    }
+
+    for(int i = 0; i < numberCommands; i++) {
+        free(commands[i].arg1);
+        free(commands[i].arg2);
+    }
+    free(commands);
+    free(coreRun);
+    fclose(report);
+    exit(EXIT_SUCCESS);
+}
@@ -1,8 +1,12 @@
 #include "operations.h"
+#include "wal.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
 
 /* Given a path, fills pointers with strings for the parent path and child
  * file name
@@ -11,11 +15,6 @@
  *  - parent: reference to a char*, to store parent path
  *  - child: reference to a char*, to store child file name
  */
-
-int inumbers[INODE_TABLE_SIZE];
-int count = 0;
-
-
 void split_parent_child_from_path(char * path, char ** parent, char ** child) {
 
 	int n_slashes = 0, last_slash_location = 0;
@@ -47,11 +46,137 @@ void split_parent_child_from_path(char * path, char ** parent, char ** child) {
 
 
 /*
- * Initializes tecnicofs and creates root node.
+ * I-nodes of removed subtrees waiting to be deleted. Each removal thread
+ * deletes one i-node at a time and queues the entries of a directory it
+ * deletes, so a large subtree is freed by every thread at once.
+ */
+static struct {
+	int *inumbers;
+	int count;
+	int capacity;
+	int pending;            /* queued or being deleted */
+	int threads;            /* started with the first removal */
+	int stopping;
+	pthread_t workers[REMOVE_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;    /* signaled when nothing is pending */
+} removals = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER };
+
+
+static void *removal_worker(void *arg);
+
+/*
+ * Queues an i-node to be deleted by the removal threads, starting them the
+ * first time. If it can't be queued it is deleted right away.
+ */
+static void removal_push(int inumber, void *context) {
+	pthread_mutex_lock(&removals.lock);
+	if (removals.threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		int threads = cpus > 0 && cpus < REMOVE_THREADS ? cpus : REMOVE_THREADS;
+		while (removals.threads < threads
+		       && pthread_create(&removals.workers[removals.threads], NULL, removal_worker, NULL) == 0)
+			removals.threads++;
+	}
+	if (removals.threads > 0 && removals.count == removals.capacity) {
+		int capacity = removals.capacity ? 2 * removals.capacity : 1024;
+		int *inumbers = realloc(removals.inumbers, capacity * sizeof(int));
+		if (inumbers) {
+			removals.inumbers = inumbers;
+			removals.capacity = capacity;
+		}
+	}
+	if (removals.threads == 0 || removals.count == removals.capacity) {
+		pthread_mutex_unlock(&removals.lock);
+		writelock(inumber);
+		inode_delete(inumber);
+		unlock(inumber);
+		return;
+	}
+	removals.inumbers[removals.count++] = inumber;
+	removals.pending++;
+	pthread_cond_signal(&removals.work);
+	pthread_mutex_unlock(&removals.lock);
+}
+
+/*
+ * Deletes the queued i-nodes, the last queued first so the queue stays
+ * short, until the file system is destroyed.
+ */
+static void *removal_worker(void *arg) {
+	pthread_mutex_lock(&removals.lock);
+	while (1) {
+		while (removals.count == 0 && !removals.stopping)
+			pthread_cond_wait(&removals.work, &removals.lock);
+		if (removals.count == 0)
+			break;
+		int inumber = removals.inumbers[--removals.count];
+		pthread_mutex_unlock(&removals.lock);
+
+		writelock(inumber);
+		inode_delete_deferred(inumber, removal_push, NULL);
+		unlock(inumber);
+
+		pthread_mutex_lock(&removals.lock);
+		if (--removals.pending == 0)
+			pthread_cond_broadcast(&removals.idle);
+	}
+	pthread_mutex_unlock(&removals.lock);
+	return NULL;
+}
+
+/*
+ * Waits for every removed subtree to be freed and stops the removal threads.
+ */
+static void removal_stop() {
+	pthread_mutex_lock(&removals.lock);
+	while (removals.pending > 0)
+		pthread_cond_wait(&removals.idle, &removals.lock);
+	removals.stopping = 1;
+	pthread_cond_broadcast(&removals.work);
+	pthread_mutex_unlock(&removals.lock);
+	for (int i = 0; i < removals.threads; i++)
+		pthread_join(removals.workers[i], NULL);
+	free(removals.inumbers);
+	removals.inumbers = NULL;
+	removals.capacity = 0;
+	removals.threads = 0;
+	removals.stopping = 0;
+}
+
+/*
+ * Returns how many i-nodes of removed subtrees are still to be deleted.
+ * A checkpoint must wait for none: the image would keep the rest, which
+ * nothing names.
  */
-void init_fs() {
+int remove_pending() {
+	pthread_mutex_lock(&removals.lock);
+	int pending = removals.pending;
+	pthread_mutex_unlock(&removals.lock);
+	return pending;
+}
+
+
+/*
+ * Initializes tecnicofs and creates root node, or loads the tree from a
+ * checkpoint image if there is one.
+ * Input:
+ *  - image: path of the image, NULL for an empty tree
+ * Returns: last record of the log the image holds, 0 without an image
+ */
+uint64_t init_fs(const char *image) {
+	uint64_t lsn = 0;
 	inode_table_init();
-	
+
+	if (image && access(image, F_OK) == 0) {
+		if (inode_table_load(image, &lsn) == FAIL) {
+			printf("failed to load the checkpoint image %s\n", image);
+			exit(EXIT_FAILURE);
+		}
+		return lsn;
+	}
+
 	/* create root inode */
 	int root = inode_create(T_DIRECTORY);
 	
@@ -59,6 +184,7 @@ void init_fs() {
 		printf("failed to create node for tecnicofs root\n");
 		exit(EXIT_FAILURE);
 	}
+	return lsn;
 }
 
 
@@ -66,6 +192,7 @@ void init_fs() {
  * Destroy tecnicofs and inode table.
  */
 void destroy_fs() {
+	removal_stop();
 	inode_table_destroy();
 }
 
@@ -112,6 +239,225 @@ int lookup_sub_node(char *name, DirEntry *entries) {
 }
 
 
+
+
+/*
+ * Initializes an empty set of held locks.
+ */
+void lock_set_init(lock_set *set) {
+	set->inumbers = set->buffer;
+	set->count = 0;
+	set->capacity = LOCK_SET_BUFFER;
+}
+
+
+/*
+ * Records that an i-node lock is held by the operation.
+ */
+static void lock_set_add(lock_set *set, int inumber) {
+	if (set->count == set->capacity) {
+		int *grown = malloc(sizeof(int) * set->capacity * 2);
+		if (grown == NULL) {
+			fprintf(stderr, "Couldn't grow lock set\n");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(grown, set->inumbers, sizeof(int) * set->count);
+		if (set->inumbers != set->buffer)
+			free(set->inumbers);
+		set->inumbers = grown;
+		set->capacity *= 2;
+	}
+	set->inumbers[set->count++] = inumber;
+}
+
+
+/*
+ * Releases every lock of the set, the most recently acquired first.
+ */
+void lock_set_release(lock_set *set) {
+	for (int i = set->count - 1; i >= 0; i--) {
+		unlock(set->inumbers[i]);
+	}
+	set->count = 0;
+	if (set->inumbers != set->buffer)
+		free(set->inumbers);
+	lock_set_init(set);
+}
+
+
+/*
+ * Locks an i-node and records it in the set.
+ * Input:
+ *  - set: locks held by the operation
+ *  - inumber: identifier of the i-node
+ *  - mode: READ_LOCK or WRITE_LOCK
+ *  - try: if non zero, gives up instead of blocking when the lock is taken
+ * Returns: SUCCESS or FAIL (only when trying)
+ */
+static int lock_set_acquire(lock_set *set, int inumber, int mode, int try) {
+	if (try) {
+		if ((mode == WRITE_LOCK ? trywritelock(inumber) : tryreadlock(inumber)) == FAIL)
+			return FAIL;
+	}
+	else if (mode == WRITE_LOCK) {
+		writelock(inumber);
+	}
+	else {
+		readlock(inumber);
+	}
+	lock_set_add(set, inumber);
+	return SUCCESS;
+}
+
+
+/*
+ * Splits a path into its components.
+ * Input:
+ *  - path: the path to split. ATENTION: the function alters this parameter
+ *  - components: array with room for at least strlen(path) / 2 + 1 pointers
+ * Returns: number of components
+ */
+static int split_path(char *path, char **components) {
+	char *saveptr;
+	int n = 0;
+	for (char *token = strtok_r(path, "/", &saveptr); token != NULL; token = strtok_r(NULL, "/", &saveptr)) {
+		components[n++] = token;
+	}
+	return n;
+}
+
+
+/*
+ * Tells whether an i-node on the path of a change may be changed: nothing
+ * in a snapshot can, and an i-node a clone shares must be copied first.
+ * The caller must hold its lock.
+ * Returns: SUCCESS, FAIL if it is in a snapshot, or SHARED
+ */
+static int check_private(int inumber) {
+	if (inode_frozen(inumber))
+		return FAIL;
+	return inode_refs(inumber) > 1 ? SHARED : SUCCESS;
+}
+
+
+/*
+ * Walks down from the root along the given components, locking every
+ * i-node on the way. The last i-node is locked in the given mode and its
+ * ancestors are read locked. The locks stay in the set even on failure.
+ * The last i-node is write locked to be changed, so then every i-node on
+ * the way must be its own, not shared with a clone.
+ * Input:
+ *  - components: names of the nodes to traverse
+ *  - n: number of components
+ *  - set: locks held by the operation
+ *  - mode: READ_LOCK or WRITE_LOCK, for the last i-node
+ * Returns:
+ *  inumber: identifier of the last i-node, if found
+ *   SHARED: if a clone shares an i-node on the way, see unshare_path
+ *     FAIL: otherwise
+ */
+static int lookup_locked(char **components, int n, lock_set *set, int mode) {
+	int current_inumber = FS_ROOT, status;
+	type nType;
+	union Data data;
+
+	lock_set_acquire(set, current_inumber, n == 0 ? mode : READ_LOCK, 0);
+	for (int i = 0; i < n; i++) {
+		inode_get(current_inumber, &nType, &data);
+		if (nType != T_DIRECTORY)
+			return FAIL;
+		current_inumber = lookup_sub_node(components[i], data.dirEntries);
+		if (current_inumber == FAIL)
+			return FAIL;
+		lock_set_acquire(set, current_inumber, i == n - 1 ? mode : READ_LOCK, 0);
+		if (mode == WRITE_LOCK && (status = check_private(current_inumber)) != SUCCESS)
+			return status;
+	}
+	return current_inumber;
+}
+
+
+/*
+ * Gives a path i-nodes of its own: walking down from the root, every i-node
+ * a clone shares is replaced by a copy, which shares what is below it in
+ * turn, so only the path is copied. The whole path is write locked meanwhile.
+ * Input:
+ *  - components: names of the nodes to traverse
+ *  - n: number of components
+ * Returns: SUCCESS, even if the path doesn't exist, or FAIL if it goes
+ *  through a snapshot or no i-node is left for a copy
+ */
+static int unshare_path(char **components, int n) {
+	int current_inumber = FS_ROOT, result = SUCCESS;
+	type nType;
+	union Data data;
+	lock_set set;
+
+	lock_set_init(&set);
+	lock_set_acquire(&set, current_inumber, WRITE_LOCK, 0);
+	for (int i = 0; i < n; i++) {
+		inode_get(current_inumber, &nType, &data);
+		if (nType != T_DIRECTORY)
+			break;
+		int child_inumber = lookup_sub_node(components[i], data.dirEntries);
+		if (child_inumber == FAIL)
+			break;
+		lock_set_acquire(&set, child_inumber, WRITE_LOCK, 0);
+		if (inode_frozen(child_inumber)) {
+			result = FAIL;
+			break;
+		}
+		if (inode_refs(child_inumber) > 1) {
+			int copy = inode_copy(child_inumber, 0);
+			if (copy == FAIL) {
+				printf("failed to copy %s, couldn't allocate inode\n", components[i]);
+				result = FAIL;
+				break;
+			}
+			lock_set_acquire(&set, copy, WRITE_LOCK, 0);
+			dir_replace_entry(current_inumber, child_inumber, copy);
+			inode_unshared(child_inumber);
+			wal_log_copy(current_inumber, child_inumber, copy);
+			inode_delete(child_inumber);	/* the last reference if a dump let go of it meanwhile */
+			child_inumber = copy;
+		}
+		current_inumber = child_inumber;
+	}
+	lock_set_release(&set);
+	return result;
+}
+
+
+/*
+ * Looks up the parent directory of a path, write locking it, after copying
+ * whatever a clone shares on the way.
+ * Input:
+ *  - parent_name: path of the parent directory
+ *  - set: locks held by the operation
+ * Returns:
+ *  inumber: identifier of the parent, if it exists and is a directory
+ *     FAIL: otherwise
+ */
+static int lookup_parent_locked(char *parent_name, lock_set *set) {
+	char parent_copy[strlen(parent_name) + 1];
+	char *components[strlen(parent_name) / 2 + 1];
+	type pType;
+
+	strcpy(parent_copy, parent_name);
+	int n = split_path(parent_copy, components), parent_inumber;
+	while ((parent_inumber = lookup_locked(components, n, set, WRITE_LOCK)) == SHARED) {
+		lock_set_release(set);
+		if (unshare_path(components, n) == FAIL)
+			return FAIL;
+	}
+	if (parent_inumber == FAIL)
+		return FAIL;
+
+	inode_get(parent_inumber, &pType, NULL);
+	return pType == T_DIRECTORY ? parent_inumber : FAIL;
+}
+
+
 /*
  * Creates a new node given a path.
  * Input:
@@ -121,33 +467,30 @@ int lookup_sub_node(char *name, DirEntry *entries) {
  */
 int create(char *name, type nodeType){
 	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	char *parent_name, *child_name, name_copy[strlen(name) + 1];
 	/* use for copy */
-	type pType;
 	union Data pdata;
+	lock_set set;
+
 	strcpy(name_copy, name);
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	lock_set_init(&set);
 
-	parent_inumber = lookupWrite(parent_name);
+	parent_inumber = lookup_parent_locked(parent_name, &set);
 
 	if (parent_inumber == FAIL) {
 		printf("failed to create %s, invalid parent dir %s\n",
 		        name, parent_name);
+		lock_set_release(&set);
 		return FAIL;
 	}
 
-	writelock(parent_inumber);
-	inode_get(parent_inumber, &pType, &pdata);
-
-	if(pType != T_DIRECTORY) {
-		printf("failed to create %s, parent %s is not a dir\n",
-		        name, parent_name);
-		return FAIL;
-	}	
+	inode_get(parent_inumber, NULL, &pdata);
 
 	if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL) {
 		printf("failed to create %s, already exists in dir %s\n",
 		       child_name, parent_name);
+		lock_set_release(&set);
 		return FAIL;
 	}
 
@@ -157,22 +500,20 @@ int create(char *name, type nodeType){
 	if (child_inumber == FAIL) {
 		printf("failed to create %s in  %s, couldn't allocate inode\n",
 		        child_name, parent_name);
+		lock_set_release(&set);
 		return FAIL;
 	}
 
-	writelock(child_inumber);
 	if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL) {
 		printf("could not add entry %s in dir %s\n",
 		       child_name, parent_name);
+		inode_delete(child_inumber);
+		lock_set_release(&set);
 		return FAIL;
 	}
 
-	unlock(parent_inumber);
-	unlock(child_inumber);
-	for(int i = 0; i < count; i++) {
-		unlock(inumbers[i]);
-	}
-	count = 0;
+	wal_log_create(parent_inumber, child_inumber, nodeType, child_name);
+	lock_set_release(&set);
 	return SUCCESS;
 }
 
@@ -184,47 +525,44 @@ int create(char *name, type nodeType){
  * Returns: SUCCESS or FAIL
  */
 int delete(char *name){
-
 	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	char *parent_name, *child_name, name_copy[strlen(name) + 1];
 	/* use for copy */
-	type pType, cType;
+	type cType;
 	union Data pdata, cdata;
+	lock_set set;
 
 	strcpy(name_copy, name);
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	lock_set_init(&set);
 
-	parent_inumber = lookupWrite(parent_name);
+	parent_inumber = lookup_parent_locked(parent_name, &set);
 
 	if (parent_inumber == FAIL) {
 		printf("failed to delete %s, invalid parent dir %s\n",
 		        child_name, parent_name);
+		lock_set_release(&set);
 		return FAIL;
 	}
 
-	writelock(parent_inumber);
-	inode_get(parent_inumber, &pType, &pdata);
-
-	if(pType != T_DIRECTORY) {
-		printf("failed to delete %s, parent %s is not a dir\n",
-		        child_name, parent_name);
-		return FAIL;
-	}
-
+	inode_get(parent_inumber, NULL, &pdata);
 	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
 
 	if (child_inumber == FAIL) {
 		printf("could not delete %s, does not exist in dir %s\n",
 		       name, parent_name);
+		lock_set_release(&set);
 		return FAIL;
 	}
 
-	writelock(child_inumber);
+	lock_set_acquire(&set, child_inumber, WRITE_LOCK, 0);
 	inode_get(child_inumber, &cType, &cdata);
 
-	if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL) {
+	/* a snapshot can't be emptied, so it is deleted whole */
+	if (cType == T_DIRECTORY && !inode_frozen(child_inumber) && is_dir_empty(cdata.dirEntries) == FAIL) {
 		printf("could not delete %s: is a directory and not empty\n",
 		       name);
+		lock_set_release(&set);
 		return FAIL;
 	}
 
@@ -232,21 +570,77 @@ int delete(char *name){
 	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
 		printf("failed to delete %s from dir %s\n",
 		       child_name, parent_name);
+		lock_set_release(&set);
 		return FAIL;
 	}
 
+	/* logged before the i-node is freed, a create reusing it is logged after */
+	wal_log_delete(parent_inumber, child_inumber);
 	if (inode_delete(child_inumber) == FAIL) {
 		printf("could not delete inode number %d from dir %s\n",
 		       child_inumber, parent_name);
+		lock_set_release(&set);
+		return FAIL;
+	}
+
+	lock_set_release(&set);
+	return SUCCESS;
+}
+
+
+/*
+ * Deletes a node and, if it is a directory, everything below it. The node
+ * is taken out of its parent at once, and logged, and the rest is freed in
+ * the background by the removal threads, so the subtree is gone for every
+ * other operation as soon as this returns. A file below it that is open may
+ * still be written until it is freed, as if it had been deleted afterwards.
+ * Input:
+ *  - name: path of node
+ * Returns: SUCCESS or FAIL
+ */
+int remove_tree(char *name) {
+	int parent_inumber, child_inumber;
+	char *parent_name, *child_name, name_copy[strlen(name) + 1];
+	union Data pdata;
+	lock_set set;
+
+	strcpy(name_copy, name);
+	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	lock_set_init(&set);
+
+	parent_inumber = lookup_parent_locked(parent_name, &set);
+
+	if (parent_inumber == FAIL) {
+		printf("failed to remove %s, invalid parent dir %s\n",
+		        child_name, parent_name);
+		lock_set_release(&set);
+		return FAIL;
+	}
+
+	inode_get(parent_inumber, NULL, &pdata);
+	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+
+	if (child_inumber == FAIL) {
+		printf("could not remove %s, does not exist in dir %s\n",
+		       name, parent_name);
+		lock_set_release(&set);
 		return FAIL;
 	}
 
-	unlock(parent_inumber);
-	unlock(child_inumber);
-	for(int i = 0; i < count; i++) {
-		unlock(inumbers[i]);
+	/* nothing below it is locked by a path any more, it can only be reached through a handle */
+	lock_set_acquire(&set, child_inumber, WRITE_LOCK, 0);
+
+	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
+		printf("failed to remove %s from dir %s\n",
+		       child_name, parent_name);
+		lock_set_release(&set);
+		return FAIL;
 	}
-	count = 0;
+
+	/* replaying the record deletes the whole subtree at once */
+	wal_log_remove(parent_inumber, child_inumber);
+	lock_set_release(&set);
+	removal_push(child_inumber, NULL);
 	return SUCCESS;
 }
 
@@ -260,193 +654,710 @@ int delete(char *name){
  *     FAIL: otherwise
  */
 int lookup(char *name) {
-	char* saveptr;
-	char full_path[MAX_FILE_NAME];
-	char delim[] = "/";
+	char full_path[strlen(name) + 1];
+	char *components[strlen(name) / 2 + 1];
+	lock_set set;
 
 	strcpy(full_path, name);
+	lock_set_init(&set);
 
-	/* start at root node */
-	int current_inumber = FS_ROOT;
+	int current_inumber = lookup_locked(components, split_path(full_path, components), &set, READ_LOCK);
 
-	/* use for copy */
+	lock_set_release(&set);
+	return current_inumber;
+}
+
+
+/*
+ * Lists part of a directory: its entries from slot *cursor on, at most max
+ * of them, looking at no more than READDIR_SCAN slots so the directory is
+ * only read locked that long. An entry keeps its slot for as long as it
+ * exists, copies made for a clone included, so a listing taken up again from
+ * the cursor returns every entry that was there all along exactly once,
+ * whatever is added or deleted meanwhile.
+ * Input:
+ *  - name: path of the directory
+ *  - cursor: first slot to look at, set to the next one, MAX_DIR_ENTRIES
+ *    once every slot was
+ *  - entries: where the entries are copied
+ *  - types: where their types are stored
+ *  - max: most entries listed
+ * Returns: number of entries listed, or FAIL if name isn't a directory
+ */
+int read_dir(char *name, unsigned int *cursor, DirEntry *entries, type *types, int max) {
+	char full_path[strlen(name) + 1];
+	char *components[strlen(name) / 2 + 1];
+	lock_set set;
 	type nType;
 	union Data data;
+	int count = 0;
 
-	/* get root inode data */
-	readlock(current_inumber);
-	inode_get(current_inumber, &nType, &data);
-	inumbers[count] = current_inumber;
-	count++;
-
-	char *path = strtok_r(full_path, delim, &saveptr);
+	strcpy(full_path, name);
+	lock_set_init(&set);
 
-	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
-		readlock(current_inumber);
-		inode_get(current_inumber, &nType, &data);
-		inumbers[count] = current_inumber;
+	int inumber = lookup_locked(components, split_path(full_path, components), &set, READ_LOCK);
+	if (inumber < 0 || inode_get(inumber, &nType, &data) == FAIL || nType != T_DIRECTORY) {
+		lock_set_release(&set);
+		return FAIL;
+	}
+	unsigned int slot = *cursor, last = slot + READDIR_SCAN;
+	for (; slot < MAX_DIR_ENTRIES && slot < last && count < max; slot++) {
+		if (data.dirEntries[slot].inumber == FREE_INODE)
+			continue;
+		entries[count] = data.dirEntries[slot];
+		inode_get(entries[count].inumber, &types[count], NULL);	/* the entry can't go while the directory is locked */
 		count++;
-		path = strtok_r(NULL, delim, &saveptr);
 	}
+	lock_set_release(&set);
+	*cursor = slot < MAX_DIR_ENTRIES ? slot : MAX_DIR_ENTRIES;
+	return count;
+}
+
+/*
+ * Locks every i-node both parents of a move need: the two parents are write
+ * locked and their other ancestors read locked.
+ * The first path is locked top-down, waiting for each lock, as every other
+ * operation does. The nodes of the second path that are not shared with the
+ * first one are only tried, so that two moves locking the same paths in
+ * opposite orders can't deadlock; when one of them is taken, every lock is
+ * released and the caller has to retry.
+ * A clone locks its source as the first path: only read, it needn't be its
+ * own nor a directory.
+ * Input:
+ *  - from: components of the source parent
+ *  - n_from: number of components of the source parent
+ *  - clone: if non zero, the first path is the source of a clone
+ *  - to: components of the destination parent
+ *  - n_to: number of components of the destination parent
+ *  - set: locks held by the operation
+ *  - from_inumber: reference to store the source parent's inumber
+ *  - to_inumber: reference to store the destination parent's inumber
+ * Returns: SUCCESS, FAIL if a parent doesn't exist or isn't a directory,
+ *  BUSY if the caller must retry, or SHARED if a clone shares an i-node
+ *  of a parent path, which must be copied before retrying
+ */
+static int lock_move_parents(char **from, int n_from, int clone, char **to, int n_to,
+                             lock_set *set, int *from_inumber, int *to_inumber) {
+	int shared = 0, status;
+	type nType;
+	union Data data;
+
+	/* number of leading components both parents have in common */
+	while (shared < n_from && shared < n_to && strcmp(from[shared], to[shared]) == 0)
+		shared++;
+
+	int current_inumber = FS_ROOT;
+	for (int i = 0; i <= n_from; i++) {
+		if (i > 0) {
+			inode_get(current_inumber, &nType, &data);
+			if (nType != T_DIRECTORY)
+				return FAIL;
+			current_inumber = lookup_sub_node(from[i - 1], data.dirEntries);
+			if (current_inumber == FAIL)
+				return FAIL;
+		}
+		int is_parent = i == n_from || (i == n_to && i == shared);
+		lock_set_acquire(set, current_inumber, is_parent ? WRITE_LOCK : READ_LOCK, 0);
+		if ((!clone || i <= shared) && (status = check_private(current_inumber)) != SUCCESS)
+			return status;
+		if (i == shared)
+			*to_inumber = current_inumber;
+	}
+	*from_inumber = current_inumber;
 
-	for(int i = 0; i < count; i++) {
-		unlock(inumbers[i]);
+	/* the common prefix is already locked, the rest of the destination is tried */
+	current_inumber = *to_inumber;
+	for (int i = shared + 1; i <= n_to; i++) {
+		inode_get(current_inumber, &nType, &data);
+		if (nType != T_DIRECTORY)
+			return FAIL;
+		current_inumber = lookup_sub_node(to[i - 1], data.dirEntries);
+		if (current_inumber == FAIL)
+			return FAIL;
+		if (lock_set_acquire(set, current_inumber, i == n_to ? WRITE_LOCK : READ_LOCK, 1) == FAIL)
+			return BUSY;
+		if ((status = check_private(current_inumber)) != SUCCESS)
+			return status;
 	}
-	count = 0;
+	*to_inumber = current_inumber;
 
-	return current_inumber;
+	inode_get(*from_inumber, &nType, NULL);
+	if (nType != T_DIRECTORY && !clone)
+		return FAIL;
+	inode_get(*to_inumber, &nType, NULL);
+	return nType == T_DIRECTORY ? SUCCESS : FAIL;
 }
 
-int lookupWrite(char *name) {
-	char* saveptr;
-	char full_path[MAX_FILE_NAME];
-	char delim[] = "/";
 
-	strcpy(full_path, name);
+/*
+ * Moves (renames) a node.
+ * Input:
+ *  - name: path of the node to move
+ *  - name2: new path of the node
+ * Returns: SUCCESS or FAIL
+ */
+int move(char* name, char* name2){
+	char from_copy[strlen(name) + 1], to_copy[strlen(name2) + 1];
+	char *from[strlen(name) / 2 + 1], *to[strlen(name2) / 2 + 1];
+	int n_from, n_to, from_parent, to_parent, child_inumber, result;
+	unsigned int backoff_seed = (unsigned int) pthread_self();
+	union Data data;
+	lock_set set;
 
-	/* start at root node */
-	int current_inumber = FS_ROOT;
+	strcpy(from_copy, name);
+	strcpy(to_copy, name2);
+	n_from = split_path(from_copy, from);
+	n_to = split_path(to_copy, to);
 
-	/* use for copy */
-	type nType;
-	union Data data;
+	if (n_from == 0 || n_to == 0) {
+		printf("failed to move %s to %s, can't move the root\n", name, name2);
+		return FAIL;
+	}
 
-	/* get root inode data */
-	readlock(current_inumber);
-	inode_get(current_inumber, &nType, &data);
-	inumbers[count] = current_inumber;
-	count++;
+	/* a directory can't be moved into itself or one of its sub directories */
+	int prefix = 0;
+	while (prefix < n_from && prefix < n_to && strcmp(from[prefix], to[prefix]) == 0)
+		prefix++;
+	if (prefix == n_from) {
+		printf("failed to move %s to %s, destination is inside the source\n", name, name2);
+		return FAIL;
+	}
 
-	char *path = strtok_r(full_path, delim, &saveptr);
+	lock_set_init(&set);
+	while ((result = lock_move_parents(from, n_from - 1, 0, to, n_to - 1, &set, &from_parent, &to_parent)) == BUSY
+	       || result == SHARED) {
+		lock_set_release(&set);
+		if (result == SHARED) {
+			if (unshare_path(from, n_from - 1) == FAIL || unshare_path(to, n_to - 1) == FAIL) {
+				result = FAIL;
+				break;
+			}
+			continue;
+		}
+		insert_delay(rand_r(&backoff_seed) % (DELAY + 1));     /* random backoff before retrying */
+		sched_yield();     /* lets a preempted lock holder run when there are more threads than cores */
+	}
 
-	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
-		readlock(current_inumber);
-		inode_get(current_inumber, &nType, &data);
-		inumbers[count] = current_inumber;
-		count++;
-		path = strtok_r(NULL, delim, &saveptr);
+	if (result == FAIL) {
+		printf("failed to move %s to %s, invalid parent dir\n", name, name2);
+		lock_set_release(&set);
+		return FAIL;
 	}
 
-	unlock(current_inumber);
-	count--;
-	return current_inumber;
+	inode_get(from_parent, NULL, &data);
+	child_inumber = lookup_sub_node(from[n_from - 1], data.dirEntries);
+	if (child_inumber == FAIL) {
+		printf("failed to move %s, does not exist\n", name);
+		lock_set_release(&set);
+		return FAIL;
+	}
+
+	inode_get(to_parent, NULL, &data);
+	if (lookup_sub_node(to[n_to - 1], data.dirEntries) != FAIL) {
+		printf("failed to move %s, %s already exists\n", name, name2);
+		lock_set_release(&set);
+		return FAIL;
+	}
+
+	if (dir_reset_entry(from_parent, child_inumber) == FAIL) {
+		printf("failed to move %s, couldn't remove it from its dir\n", name);
+		lock_set_release(&set);
+		return FAIL;
+	}
+
+	if (dir_add_entry(to_parent, child_inumber, to[n_to - 1]) == FAIL) {
+		printf("failed to move %s, couldn't add it to the destination dir\n", name);
+		dir_add_entry(from_parent, child_inumber, from[n_from - 1]);
+		lock_set_release(&set);
+		return FAIL;
+	}
+
+	wal_log_move(from_parent, to_parent, child_inumber, to[n_to - 1]);
+	lock_set_release(&set);
+	return SUCCESS;
 }
 
- 
+
 /*
- * recieves place to create, data type and inumber
+ * Clones a node in constant time: the clone gets a copy of the node's own
+ * table, or shares its contents if it is a file, and shares every i-node
+ * below it with the source until either side changes one, which then copies
+ * only the i-nodes on the path it changes (see unshare_path). Nothing in a
+ * snapshot can be changed, a clone of a snapshot can.
+ * Files opened before a clone must be opened again, what they name may be
+ * shared since. Writes through opened files don't lock the file's
+ * ancestors, so the caller must keep them out while a clone runs.
  * Input:
- *  - name: path of node, data type, inumber
- * Returns: 
- *   SUCESS OR FAIL
+ *  - name: path of the node to clone
+ *  - name2: path of the clone
+ *  - frozen: if non zero, the clone is a snapshot
+ * Returns: SUCCESS or FAIL
  */
-int createWithInumber(char* name, type nodeType, int inumber){
-    int parent_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
-	/* use for copy */
-	type pType;
-	union Data pdata;
+int clone_tree(char *name, char *name2, int frozen) {
+	char from_copy[strlen(name) + 1], to_copy[strlen(name2) + 1];
+	char *from[strlen(name) / 2 + 1], *to[strlen(name2) / 2 + 1];
+	int n_from, n_to, source, to_parent, copy, result;
+	unsigned int backoff_seed = (unsigned int) pthread_self();
+	union Data data;
+	lock_set set;
 
-	strcpy(name_copy, name);
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	strcpy(from_copy, name);
+	strcpy(to_copy, name2);
+	n_from = split_path(from_copy, from);
+	n_to = split_path(to_copy, to);
 
-	parent_inumber = lookupWrite(parent_name);
+	if (n_to == 0) {
+		printf("failed to clone %s to %s, can't replace the root\n", name, name2);
+		return FAIL;
+	}
 
-	if (parent_inumber == FAIL) {
-		printf("failed to create %s, invalid parent dir %s\n",
-		        name, parent_name);
+	/* below the source, the clone would share the directory it is added to, and so hold itself */
+	int prefix = 0;
+	while (prefix < n_from && prefix < n_to && strcmp(from[prefix], to[prefix]) == 0)
+		prefix++;
+	if (prefix == n_from && n_to - 1 > n_from) {
+		printf("failed to clone %s to %s, destination is inside the source\n", name, name2);
 		return FAIL;
 	}
 
-	writelock(parent_inumber);
-	inode_get(parent_inumber, &pType, &pdata);
+	lock_set_init(&set);
+	while ((result = lock_move_parents(from, n_from, 1, to, n_to - 1, &set, &source, &to_parent)) == BUSY
+	       || result == SHARED) {
+		lock_set_release(&set);
+		if (result == SHARED) {
+			if (unshare_path(to, n_to - 1) == FAIL) {
+				result = FAIL;
+				break;
+			}
+			continue;
+		}
+		insert_delay(rand_r(&backoff_seed) % (DELAY + 1));     /* random backoff before retrying */
+		sched_yield();
+	}
 
-	if(pType != T_DIRECTORY) {
-		printf("failed to create %s, parent %s is not a dir\n",
-		        name, parent_name);
+	if (result == FAIL) {
+		printf("failed to clone %s to %s, invalid path\n", name, name2);
+		lock_set_release(&set);
 		return FAIL;
 	}
 
-	if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL) {
-		printf("failed to create %s, already exists in dir %s\n",
-		       child_name, parent_name);
+	inode_get(to_parent, NULL, &data);
+	if (lookup_sub_node(to[n_to - 1], data.dirEntries) != FAIL) {
+		printf("failed to clone %s, %s already exists\n", name, name2);
+		lock_set_release(&set);
 		return FAIL;
 	}
 
-
-	writelock(inumber);
-	if (dir_add_entry(parent_inumber, inumber, child_name) == FAIL) {
-		printf("could not add entry %s in dir %s\n",
-		       child_name, parent_name);
+	copy = inode_copy(source, frozen);
+	if (copy == FAIL) {
+		printf("failed to clone %s to %s, couldn't allocate inode\n", name, name2);
+		lock_set_release(&set);
 		return FAIL;
 	}
 
-	unlock(parent_inumber);
-	unlock(inumber);
-	for(int i = count; i >= 0; i--) {
-		unlock(inumbers[i]);
+	if (dir_add_entry(to_parent, copy, to[n_to - 1]) == FAIL) {
+		printf("failed to clone %s, couldn't add it to the destination dir\n", name);
+		inode_delete(copy);
+		lock_set_release(&set);
+		return FAIL;
 	}
+
+	inode_epoch_advance();
+	wal_log_clone(to_parent, source, copy, frozen, to[n_to - 1]);
+	lock_set_release(&set);
 	return SUCCESS;
 }
 
 
 /*
- * Move function
+ * Locks a file in the given mode. A file named by its path is looked up from
+ * the root, read locking its ancestors, and write locked only once whatever
+ * a clone shares on the way is copied; an opened one is locked alone and
+ * must still be the i-node it was when it was opened, with no clone since
+ * and not replaced by a copy.
  * Input:
- *  - name: path of file to move, path of place to move
+ *  - file: the file
+ *  - set: locks held by the operation, kept even on failure
+ *  - mode: READ_LOCK or WRITE_LOCK
+ *  - directories: if non zero, a path may name a directory as well
  * Returns:
- *   SUCESS OR FAIL
+ *  inumber: identifier of the file, if found
+ *    STALE: if it was opened before a clone or before it was copied, or only to be read
+ *     FAIL: if it doesn't exist, isn't a file or was deleted since it was opened
  */
-int move(char* name, char* name2){
-    char* saveptr_origin;
-	saveptr_origin = malloc(sizeof(char)*MAX_FILE_NAME);
-    char delim[] = "/";
-    int inumbers[INODE_TABLE_SIZE];
-    int count = 0;    
-    ///functions lack  error warnings 
-
-
-    /* start at root node*/
-    int current_inumber = FS_ROOT;
-    
-
-    /* use for copy */
-    type nType;
-    union Data data;
-
-    /* get root inode data */
-    count = 0;
-    readlock(current_inumber);
-    inode_get(current_inumber, &nType, &data);
-    inumbers[count] = current_inumber;
-    count++;
-
-    char *path = strtok_r(name, delim, &saveptr_origin);
-
-    while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
-        readlock(current_inumber);
-        inode_get(current_inumber, &nType, &data);
-        inumbers[count] = current_inumber;
-        count++;
-        path = strtok_r(NULL, delim, &saveptr_origin);
-    }
+static int lock_file(file_id *file, lock_set *set, int mode, int directories) {
+	type nType;
+	int inumber;
+
+	if (file->name) {
+		char full_path[strlen(file->name) + 1];
+		char *components[strlen(file->name) / 2 + 1];
+		strcpy(full_path, file->name);
+		int n = split_path(full_path, components);
+		while ((inumber = lookup_locked(components, n, set, mode)) == SHARED) {
+			lock_set_release(set);
+			if (unshare_path(components, n) == FAIL)
+				return FAIL;
+		}
+		if (inumber == FAIL)
+			return FAIL;
+	}
+	else {
+		inumber = file->inumber;
+		if (inumber < 0 || inumber >= INODE_TABLE_SIZE)
+			return FAIL;
+		lock_set_acquire(set, inumber, mode, 0);
+		if (inode_handle_stale(inumber, file->epoch & ~HANDLE_READ_ONLY) || (mode == WRITE_LOCK && (file->epoch & HANDLE_READ_ONLY)))
+			return STALE;
+		if (inode_generation(inumber) != file->generation)
+			return FAIL;
+	}
+	if (inode_get(inumber, &nType, NULL) == FAIL)
+		return FAIL;
+	return nType == T_FILE || (directories && file->name) ? inumber : FAIL;
+}
 
-    for(int i = count; i >= 0; i--) {
-        unlock(inumbers[i]);
-    }
-    delete(name);
-    createWithInumber(name2, nType, current_inumber);
 
-    return SUCCESS;
-} 
+/*
+ * Finds the type and size of a file, or of a directory named by its path,
+ * and the i-number, generation and epoch that name it from then on.
+ * Input:
+ *  - file: the file, its i-number, generation and epoch are filled in
+ *  - nType: where its type is stored
+ *  - size: where the size of its contents is stored, 0 for a directory
+ *  - unshare: if non zero, whatever a clone shares on its path is copied,
+ *    so it can be written through its i-number; otherwise only read
+ * Returns:
+ *  inumber: identifier of the file, if found
+ *    STALE: if an opened file is, see lock_file
+ *     FAIL: otherwise
+ */
+int stat_file(file_id *file, type *nType, size_t *size, int unshare) {
+	lock_set set;
+	lock_set_init(&set);
+
+	int inumber = lock_file(file, &set, unshare ? WRITE_LOCK : READ_LOCK, 1);
+	if (inumber >= 0) {
+		inode_get(inumber, nType, NULL);
+		*size = *nType == T_FILE ? inode_file_size(inumber) : 0;
+		file->inumber = inumber;
+		file->generation = inode_generation(inumber);
+		file->epoch = (inode_epoch() & ~HANDLE_READ_ONLY) | (unshare ? 0 : HANDLE_READ_ONLY);
+	}
+	lock_set_release(&set);
+	return inumber;
+}
+
+
+/*
+ * Writes to a file, growing it if the bytes go past its end.
+ * Input:
+ *  - file: the file
+ *  - offset: position of the first byte, ignored when appending
+ *  - buffer: the bytes to write
+ *  - len: number of bytes to write
+ *  - append: if non zero, the bytes are written at the end of the file
+ * Returns: SUCCESS, FAIL or STALE (see lock_file)
+ */
+int write_file(file_id *file, size_t offset, const char *buffer, size_t len, int append) {
+	lock_set set;
+	lock_set_init(&set);
+
+	int inumber = lock_file(file, &set, WRITE_LOCK, 0);
+	if (inumber < 0) {
+		printf("failed to write %s, not a file\n", file->name ? file->name : "an opened file");
+		lock_set_release(&set);
+		return inumber;
+	}
+	if (append)
+		offset = inode_file_size(inumber);
+
+	int result = inode_write_file(inumber, offset, buffer, len);
+	if (result == SUCCESS)
+		wal_log_write(inumber, offset, buffer, len);
+	lock_set_release(&set);
+	return result;
+}
+
+
+/*
+ * Sets the size of a file, dropping the bytes past it or adding zeros.
+ * Input:
+ *  - file: the file
+ *  - size: the new size
+ * Returns: SUCCESS, FAIL or STALE (see lock_file)
+ */
+int truncate_file(file_id *file, size_t size) {
+	lock_set set;
+	lock_set_init(&set);
+
+	int inumber = lock_file(file, &set, WRITE_LOCK, 0);
+	if (inumber < 0) {
+		printf("failed to truncate %s, not a file\n", file->name ? file->name : "an opened file");
+		lock_set_release(&set);
+		return inumber;
+	}
+
+	int result = inode_truncate_file(inumber, size);
+	if (result == SUCCESS)
+		wal_log_truncate(inumber, size);
+	lock_set_release(&set);
+	return result;
+}
+
+
+/*
+ * Maps part of a file, leaving it read locked until the view is released,
+ * so a server can send the bytes straight from the extents holding them.
+ * At most FILE_VIEW_EXTENTS extents are mapped, fewer bytes may be.
+ * Input:
+ *  - file: the file
+ *  - offset: position of the first byte
+ *  - len: number of bytes wanted
+ *  - view: where the pieces and the locks are stored
+ * Returns:
+ *  number of bytes mapped, 0 past the end of the file
+ *  FAIL: if the file doesn't exist, or STALE (see lock_file); nothing is left locked then
+ */
+int open_file_view(file_id *file, size_t offset, size_t len, file_view *view) {
+	lock_set_init(&view->set);
+	view->count = 0;
+	view->length = 0;
+	view->open = 0;
+
+	int inumber = lock_file(file, &view->set, READ_LOCK, 0);
+	if (inumber < 0) {
+		printf("failed to read %s, not a file\n", file->name ? file->name : "an opened file");
+		lock_set_release(&view->set);
+		return inumber;
+	}
+	view->count = inode_map_file(inumber, offset, len, view->iov, FILE_VIEW_EXTENTS, &view->length);
+	view->open = 1;
+	return view->length;
+}
+
+
+/*
+ * Releases the locks of an open view, its iovecs are no longer valid.
+ */
+void release_file_view(file_view *view) {
+	if (view->open)
+		lock_set_release(&view->set);
+	view->count = 0;
+	view->length = 0;
+	view->open = 0;
+}
+
+
+/*
+ * Copies part of a file.
+ * Input:
+ *  - file: the file
+ *  - offset: position of the first byte
+ *  - buffer: where the bytes are copied to
+ *  - len: room in buffer
+ * Returns: number of bytes copied, 0 past the end of the file, FAIL or STALE
+ */
+int read_file(file_id *file, size_t offset, char *buffer, size_t len) {
+	size_t copied = 0;
+	while (copied < len) {
+		file_view view;
+		int mapped = open_file_view(file, offset + copied, len - copied, &view);
+		if (mapped < 0)
+			return copied ? (int) copied : mapped;
+		for (int i = 0; i < view.count; i++) {
+			memcpy(buffer + copied, view.iov[i].iov_base, view.iov[i].iov_len);
+			copied += view.iov[i].iov_len;
+		}
+		release_file_view(&view);
+		if (mapped == 0)
+			break;
+	}
+	return copied;
+}
+
 
 /*
  * Prints tecnicofs tree.
  * Input:
  *  - fp: pointer to output file
+ *  - threads: most threads walking the tree at once
+ * Returns: SUCCESS or FAIL
+ */
+int print_tecnicofs_tree(FILE *fp, int threads){
+	if (fflush(fp) != 0)
+		return FAIL;
+	return inode_print_tree(fileno(fp), FS_ROOT, threads);
+}
+
+
+/*
+ * Dumps being streamed: each one reads a frozen copy of the root taken when
+ * it started, so it sees the tree as it was then while changes go on, and
+ * only the i-nodes changed meanwhile are copied.
+ */
+typedef struct dump_t {
+	unsigned int id;        /* 0 while the slot is free */
+	int inumber;            /* the copy of the root */
+	tree_cursor *cursor;
+	int busy;               /* a request is using it */
+	time_t used;
+	time_t opened;
+} dump_t;
+
+static dump_t dumps[MAX_DUMPS];
+static unsigned int dump_sequence = 0;
+static pthread_mutex_t dumps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Drops the copy of the root a dump held, and with it what nothing else
+ * names any more, and frees the slot. The dump must be busy.
+ */
+static void dump_release(dump_t *dump) {
+	writelock(dump->inumber);
+	inode_delete(dump->inumber);
+	unlock(dump->inumber);
+	if (dump->cursor)
+		tree_cursor_close(dump->cursor);
+	pthread_mutex_lock(&dumps_lock);
+	*dump = (dump_t) { 0 };
+	pthread_mutex_unlock(&dumps_lock);
+}
+
+
+/*
+ * Takes the dump an identifier names for a request, NULL if there is no
+ * such dump or another request is using it.
+ */
+static dump_t *dump_take(unsigned int id) {
+	dump_t *dump = &dumps[id % MAX_DUMPS];
+	pthread_mutex_lock(&dumps_lock);
+	if (id == 0 || dump->id != id || dump->busy)
+		dump = NULL;
+	else
+		dump->busy = 1;
+	pthread_mutex_unlock(&dumps_lock);
+	return dump;
+}
+
+
+/*
+ * Starts a dump of the whole tree. Like a clone, it makes the i-nodes below
+ * the root shared, but a dump only reads the names of the tree, so handles
+ * opened before go on working until a change copies their i-node.
+ * The caller must keep every change out meanwhile.
+ * Input:
+ *  - id: where the identifier of the dump is stored
+ * Returns: SUCCESS, or FAIL if MAX_DUMPS are open or no i-node is left
+ */
+int dump_open(unsigned int *id) {
+	dump_t *dump = NULL;
+	dump_expire(0);
+	pthread_mutex_lock(&dumps_lock);
+	for (int i = 0; i < MAX_DUMPS && dump == NULL; i++) {
+		if (dumps[i].id == 0) {
+			dump = &dumps[i];
+			dump->id = ++dump_sequence * MAX_DUMPS + i;
+			dump->busy = 1;
+		}
+	}
+	pthread_mutex_unlock(&dumps_lock);
+	if (dump == NULL)
+		return FAIL;
+
+	dump->inumber = inode_copy(FS_ROOT, 1);
+	if (dump->inumber == FAIL) {
+		pthread_mutex_lock(&dumps_lock);
+		*dump = (dump_t) { 0 };
+		pthread_mutex_unlock(&dumps_lock);
+		return FAIL;
+	}
+	dump->cursor = tree_cursor_open(dump->inumber);
+	if (dump->cursor == NULL) {
+		dump_release(dump);
+		return FAIL;
+	}
+	*id = dump->id;
+	pthread_mutex_lock(&dumps_lock);
+	dump->used = dump->opened = time(NULL);
+	dump->busy = 0;
+	pthread_mutex_unlock(&dumps_lock);
+	return SUCCESS;
+}
+
+
+/*
+ * Reads the next bytes of a dump, the lines of the tree cut wherever len
+ * ends; the dump is closed once they reach its end.
+ * The caller must keep a print or checkpoint from running meanwhile.
+ * Input:
+ *  - id: identifier of the dump
+ *  - buffer: where the bytes are copied
+ *  - len: most bytes read
+ *  - end: set if the dump ended
+ * Returns: number of bytes read, or FAIL if there is no such dump, it is
+ * being read already or memory ran out
  */
-void print_tecnicofs_tree(FILE *fp){
-	inode_print_tree(fp, FS_ROOT, "");
+int dump_read(unsigned int id, char *buffer, size_t len, int *end) {
+	dump_t *dump = dump_take(id);
+	if (dump == NULL)
+		return FAIL;
+	int read = tree_cursor_read(dump->cursor, buffer, len);
+	*end = read == FAIL || (size_t) read < len;
+	if (*end) {
+		dump_release(dump);
+		return read;
+	}
+	pthread_mutex_lock(&dumps_lock);
+	dump->used = time(NULL);
+	dump->busy = 0;
+	pthread_mutex_unlock(&dumps_lock);
+	return read;
+}
+
+
+/*
+ * Closes a dump before its end.
+ * The caller must keep a print or checkpoint from running meanwhile.
+ * Input:
+ *  - id: identifier of the dump
+ * Returns: SUCCESS or FAIL
+ */
+int dump_close(unsigned int id) {
+	dump_t *dump = dump_take(id);
+	if (dump == NULL)
+		return FAIL;
+	dump_release(dump);
+	return SUCCESS;
+}
+
+
+/*
+ * Closes the dumps no request used for DUMP_IDLE_S seconds, their clients
+ * having gone away. The caller must keep every change out meanwhile.
+ * Input:
+ *  - checkpoint: if non zero, dumps open for DUMP_HOLD_S seconds are
+ *    closed as well, so they can't put checkpoints off for good
+ * Returns: number of dumps still open
+ */
+int dump_expire(int checkpoint) {
+	dump_t *idle[MAX_DUMPS];
+	int count = 0, open = 0;
+	time_t now = time(NULL);
+	pthread_mutex_lock(&dumps_lock);
+	for (int i = 0; i < MAX_DUMPS; i++) {
+		if (dumps[i].id == 0)
+			continue;
+		if (!dumps[i].busy && (now - dumps[i].used >= DUMP_IDLE_S || (checkpoint && now - dumps[i].opened >= DUMP_HOLD_S))) {
+			dumps[i].busy = 1;
+			idle[count++] = &dumps[i];
+		}
+		else
+			open++;
+	}
+	pthread_mutex_unlock(&dumps_lock);
+	for (int i = 0; i < count; i++)
+		dump_release(idle[i]);
+	return open;
 }
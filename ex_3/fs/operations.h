@@ -3,14 +3,85 @@
 #include <pthread.h>
 #include "state.h"
 
-void init_fs();
+#define READ_LOCK 0
+#define WRITE_LOCK 1
+#define BUSY -2
+#define SHARED -3       /* a change must first copy what a clone shares */
+#define STALE -4        /* a handle was opened before a clone, the file must be opened again */
+
+/* set in the epoch of a handle opened without copying what a clone shares, it can only read */
+#define HANDLE_READ_ONLY 0x80000000u
+
+#define LOCK_SET_BUFFER 16
+
+/*
+ * I-node locks held by an operation, released in the reverse order
+ */
+typedef struct lock_set {
+	int *inumbers;
+	int count;
+	int capacity;
+	int buffer[LOCK_SET_BUFFER]; /* used until the set needs to grow */
+} lock_set;
+
+#define FILE_VIEW_EXTENTS 16
+
+#define REMOVE_THREADS 4        /* threads freeing removed subtrees, at most one per processor */
+
+#define READDIR_SCAN 4096       /* slots a page of a directory listing looks at, at most */
+
+#define MAX_DUMPS 64            /* dumps streamed at once */
+#define DUMP_IDLE_S 60          /* a dump no request reads for this long is closed */
+#define DUMP_HOLD_S 300         /* a dump open this long is closed by the next checkpoint, which it puts off */
+
+/*
+ * A file named by its path or, once opened, by its i-number and the
+ * generation the i-node had then, which skips the lookup of the path.
+ * An opened file is only valid until the next clone: the i-node may be
+ * shared since, and the file its path names a copy of it.
+ */
+typedef struct file_id {
+	char *name;             /* NULL for an opened file */
+	int inumber;
+	unsigned int generation;
+	unsigned int epoch;     /* clone epoch it was opened in, see inode_epoch */
+} file_id;
+
+/*
+ * Part of a file's contents, described in place by the extents holding it.
+ * The file and its ancestors stay read locked until the view is released.
+ */
+typedef struct file_view {
+	struct iovec iov[FILE_VIEW_EXTENTS];
+	int count;
+	size_t length;
+	int open;       /* set while the view holds its locks */
+	lock_set set;
+} file_view;
+
+void lock_set_init(lock_set *set);
+void lock_set_release(lock_set *set);
+uint64_t init_fs(const char *image);
 void destroy_fs();
 int is_dir_empty(DirEntry *dirEntries);
 int create(char *name, type nodeType);
 int delete(char *name);
+int remove_tree(char *name);
+int remove_pending();
 int lookup(char *name);
-int lookupWrite(char *name);
+int read_dir(char *name, unsigned int *cursor, DirEntry *entries, type *types, int max);
 int move(char* name, char* name2);
-void print_tecnicofs_tree(FILE *fp);
+int clone_tree(char *name, char *name2, int frozen);
+int stat_file(file_id *file, type *nType, size_t *size, int unshare);
+int write_file(file_id *file, size_t offset, const char *buffer, size_t len, int append);
+int truncate_file(file_id *file, size_t size);
+int read_file(file_id *file, size_t offset, char *buffer, size_t len);
+int open_file_view(file_id *file, size_t offset, size_t len, file_view *view);
+void release_file_view(file_view *view);
+int print_tecnicofs_tree(FILE *fp, int threads);
+int dump_open(unsigned int *id);
+int dump_read(unsigned int id, char *buffer, size_t len, int *end);
+int dump_close(unsigned int id);
+int dump_expire(int checkpoint);
 
 #endif /* FS_H */
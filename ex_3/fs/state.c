@@ -3,10 +3,147 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "state.h"
 #include "../tecnicofs-api-constants.h"
 
 inode_t inode_table[INODE_TABLE_SIZE];
+pthread_mutex_t inode_alloc_lock = PTHREAD_MUTEX_INITIALIZER;   /* serializes taking and freeing i-node slots */
+
+/*
+ * Checkpoint image: a header, one image_inode for every slot of the table and
+ * then the data of the i-nodes in use. Everything is found by its offset from
+ * the start of the image, so it is used straight from a read-only mapping.
+ * The entries of a directory are stored one after the other, only the used
+ * ones, each keeping the slot it had so a reloaded tree prints the same.
+ */
+#define IMAGE_MAGIC "TFSIMG02"
+#define IMAGE_FROZEN 0x01       /* flag of the root of a snapshot */
+#define IMAGE_BUFFER (1 << 20)     /* bytes written to an image at once */
+
+typedef struct image_header {
+    char magic[8];
+    uint32_t inode_table_size;
+    uint32_t max_dir_entries;
+    uint64_t lsn;               /* last record of the log the image holds */
+    uint64_t length;            /* of the whole image */
+    uint32_t epoch;             /* clones made, see inode_epoch */
+    uint32_t reserved;
+} image_header;
+
+typedef struct image_inode {
+    int32_t type;
+    uint32_t generation;
+    uint64_t offset;            /* of its entries or contents */
+    uint64_t size;              /* bytes of its entries or contents */
+    uint32_t refs;
+    uint32_t flags;
+} image_inode;
+
+typedef struct image_entry {
+    uint32_t slot;
+    int32_t inumber;
+    uint32_t length;            /* of the name that follows, without a terminator */
+} image_entry;
+
+typedef struct image_writer {
+    int fd;
+    char *buffer;
+    size_t used;
+    uint64_t offset;            /* of the next byte put */
+    int failed;
+} image_writer;
+
+/*
+ * Tree dump: lines are gathered in chunks that are written out together with
+ * one writev once they are all full. A parallel dump splits the tree in
+ * units, walked by a pool of threads into buffers of their own, and merges
+ * the buffers in the order of the units.
+ */
+#define PRINT_CHUNK (64 << 10)
+#define PRINT_CHUNKS 16             /* 1 MiB buffered */
+#define PRINT_UNITS 8               /* subtrees a parallel dump aims for per thread */
+#define PRINT_ROUNDS 4              /* levels a parallel dump looks down for them */
+
+typedef struct tree_writer {
+    int fd;                     /* -1 keeps everything in the first chunk, grown as needed */
+    struct iovec chunks[PRINT_CHUNKS];  /* the length of each is the bytes it holds */
+    int count;                  /* chunks in use, the last one being filled */
+    size_t capacity;            /* of the first chunk, when kept in memory */
+    int failed;
+} tree_writer;
+
+/* a directory the dump is in */
+typedef struct tree_frame {
+    int inumber;
+    int slot;                   /* next entry to visit */
+    size_t length;              /* of its path */
+} tree_frame;
+
+/* a walk that can be stopped and taken up again, see tree_cursor_open */
+struct tree_cursor {
+    tree_frame *stack;          /* the directories it is in */
+    int depth;
+    size_t stack_capacity;
+    char *path;                 /* of the last line printed, each directory on the stack owns a prefix */
+    size_t path_capacity;
+    tree_writer pending;        /* lines walked and not read yet */
+    size_t taken;               /* bytes of them already read */
+};
+
+#define UNIT_LINE 0             /* only its own line is printed, by the merge */
+#define UNIT_WAITING 1          /* a subtree no thread has taken yet */
+#define UNIT_TAKEN 2
+#define UNIT_DONE 3
+
+/* part of a parallel dump, in the order of a sequential one */
+typedef struct tree_unit {
+    int inumber;
+    char *path;
+    size_t length;
+    int state;
+    tree_writer output;         /* the lines of a subtree, kept in memory */
+} tree_unit;
+
+typedef struct tree_dump {
+    tree_unit *units;
+    int count;
+    int next;                   /* first unit that may still be waiting */
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} tree_dump;
+
+/* the image the table was loaded from; an i-node still pending takes its data from it the first time it is used */
+static const char *image = NULL;
+static size_t image_length = 0;
+static pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;     /* serializes copying i-nodes out of the image */
+static int image_pending = 0;
+
+/* moves on whenever a clone starts sharing i-nodes or a shared i-node is copied, so handles opened before can tell */
+static unsigned int clone_epoch = 0;
+static unsigned int clone_last = 0;     /* clone_epoch the last clone moved it to */
+
+static void inode_fault(int inumber);
+
+/* extents given back by deleted and truncated files, by order, linked through their first bytes */
+char *pool_free[MAX_EXTENT_ORDER + 1];
+size_t pool_blocks = 0;         /* blocks taken from the system, cached ones included */
+size_t pool_cached = 0;         /* blocks waiting in the free lists */
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread unsigned long long lock_wait_ns = 0;
+
+
+static unsigned long long lock_clock() {      //monotonic time in nanoseconds, only read when a lock is contended
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
 
 
 void init_lock(pthread_rwlock_t* lock) {      //initializes the rw lock
@@ -24,17 +161,45 @@ void destroy_lock(pthread_rwlock_t* lock) {     //destroys the rw lock
 }
 
 void readlock(int inumber) {       //prevents other threads from reading from the locked content
+    if(pthread_rwlock_tryrdlock(&(inode_table[inumber].rwlock)) == 0) {
+        return;
+    }
+    unsigned long long start = lock_clock();    //the lock is contended, the time spent waiting for it is accounted
     if(pthread_rwlock_rdlock(&(inode_table[inumber].rwlock)) != 0) {
         fprintf(stderr, "Couldn't lock rwlock\n");
         exit(EXIT_FAILURE);
     }
+    lock_wait_ns += lock_clock() - start;
 }
 
 void writelock(int inumber) {      //prevents other threads from writing to the locked content
+    if(pthread_rwlock_trywrlock(&(inode_table[inumber].rwlock)) == 0) {
+        return;
+    }
+    unsigned long long start = lock_clock();
     if(pthread_rwlock_wrlock(&(inode_table[inumber].rwlock)) != 0) {
         fprintf(stderr, "Couldn't lock rwlock\n");
         exit(EXIT_FAILURE);
     }
+    lock_wait_ns += lock_clock() - start;
+}
+
+int tryreadlock(int inumber) {     //read locks the i-node only if that doesn't require waiting
+    int result = pthread_rwlock_tryrdlock(&(inode_table[inumber].rwlock));
+    if(result != 0 && result != EBUSY) {
+        fprintf(stderr, "Couldn't lock rwlock\n");
+        exit(EXIT_FAILURE);
+    }
+    return result == 0 ? SUCCESS : FAIL;
+}
+
+int trywritelock(int inumber) {    //write locks the i-node only if that doesn't require waiting
+    int result = pthread_rwlock_trywrlock(&(inode_table[inumber].rwlock));
+    if(result != 0 && result != EBUSY) {
+        fprintf(stderr, "Couldn't lock rwlock\n");
+        exit(EXIT_FAILURE);
+    }
+    return result == 0 ? SUCCESS : FAIL;
 }
 
 void unlock(int inumber) {     //unlocks the rw lock
@@ -64,6 +229,128 @@ void inode_table_init() {
     }
 }
 
+/*
+ * Returns the order of extent i of a file: it holds FILE_BLOCK_SIZE << order bytes.
+ */
+static int extent_order(int i) {
+    return i < MAX_EXTENT_ORDER ? i : MAX_EXTENT_ORDER;
+}
+
+/*
+ * Finds the extent holding a byte of a file.
+ * Input:
+ *  - offset: position of the byte in the file
+ *  - start: where the offset of the first byte of the extent is stored
+ * Returns: index of the extent
+ */
+static int extent_at(size_t offset, size_t *start) {
+    /* extents 0 to MAX_EXTENT_ORDER double in size, the ones after it all have the largest size */
+    size_t growing = (size_t) FILE_BLOCK_SIZE * ((2UL << MAX_EXTENT_ORDER) - 1);
+    if (offset < growing) {
+        int i = 63 - __builtin_clzll(offset / FILE_BLOCK_SIZE + 1);
+        *start = (size_t) FILE_BLOCK_SIZE * ((1UL << i) - 1);
+        return i;
+    }
+    size_t largest = (size_t) FILE_BLOCK_SIZE << MAX_EXTENT_ORDER;
+    size_t i = (offset - growing) / largest;
+    *start = growing + i * largest;
+    return MAX_EXTENT_ORDER + 1 + i;
+}
+
+/*
+ * Gives every cached extent back to the system.
+ * The pool lock must be held.
+ */
+static void pool_reclaim() {
+    for (int order = 0; order <= MAX_EXTENT_ORDER; order++) {
+        while (pool_free[order]) {
+            char *extent = pool_free[order];
+            memcpy(&pool_free[order], extent, sizeof(char *));
+            free(extent);
+            pool_blocks -= 1UL << order;
+            pool_cached -= 1UL << order;
+        }
+    }
+}
+
+/*
+ * Takes an extent from the pool, reusing one a file gave back if possible.
+ * Input:
+ *  - order: the extent has FILE_BLOCK_SIZE << order bytes
+ * Returns: the extent, whose bytes are undefined, or NULL if the pool is exhausted
+ */
+static char *pool_take(int order) {
+    char *extent = NULL;
+    pthread_mutex_lock(&pool_lock);
+    if (pool_free[order]) {
+        extent = pool_free[order];
+        memcpy(&pool_free[order], extent, sizeof(char *));
+        pool_cached -= 1UL << order;
+    }
+    else {
+        if (pool_blocks + (1UL << order) > FILE_POOL_BLOCKS)
+            pool_reclaim();     /* extents of other sizes may be cached */
+        if (pool_blocks + (1UL << order) <= FILE_POOL_BLOCKS
+            && posix_memalign((void **) &extent, FILE_BLOCK_SIZE, (size_t) FILE_BLOCK_SIZE << order) == 0)
+            pool_blocks += 1UL << order;
+        else
+            extent = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return extent;
+}
+
+/*
+ * Gives an extent back to the pool.
+ */
+static void pool_give(char *extent, int order) {
+    pthread_mutex_lock(&pool_lock);
+    memcpy(extent, &pool_free[order], sizeof(char *));
+    pool_free[order] = extent;
+    pool_cached += 1UL << order;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * Gives back the extents of a file past the first count ones.
+ */
+static void file_drop_extents(FileContents *contents, int count) {
+    while (contents->count > count) {
+        contents->count--;
+        pool_give(contents->extents[contents->count], extent_order(contents->count));
+    }
+}
+
+/*
+ * Drops a reference to the contents of a file, the last one gives their
+ * extents back to the pool.
+ */
+static void file_release_contents(FileContents *contents) {
+    if (contents == NULL || __atomic_sub_fetch(&contents->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    file_drop_extents(contents, 0);
+    free(contents->extents);
+    free(contents);
+}
+
+/*
+ * Releases the data of an i-node: its directory table or its file contents.
+ */
+static void inode_release_data(int inumber) {
+    if (inode_table[inumber].pending) {
+        /* its data never left the image */
+        inode_table[inumber].pending = 0;
+        __atomic_sub_fetch(&image_pending, 1, __ATOMIC_RELAXED);
+    }
+    else if (inode_table[inumber].nodeType == T_FILE) {
+        file_release_contents(inode_table[inumber].data.fileContents);
+    }
+    else if (inode_table[inumber].data.dirEntries) {
+        free(inode_table[inumber].data.dirEntries);
+    }
+    inode_table[inumber].data.dirEntries = NULL;
+}
+
 /*
  * Releases the allocated memory for the i-nodes tables.
  */
@@ -71,13 +358,49 @@ void inode_table_init() {
 void inode_table_destroy() {
     for (int i = 0; i < INODE_TABLE_SIZE; i++) {
         if (inode_table[i].nodeType != T_NONE) {
-            /* as data is an union, the same pointer is used for both dirEntries and fileContents */
-            /* just release one of them */
-	    if (inode_table[i].data.dirEntries)
-            free(inode_table[i].data.dirEntries);
+            inode_release_data(i);
         }
         destroy_lock(&(inode_table[i].rwlock));
     }
+    pthread_mutex_lock(&pool_lock);
+    pool_reclaim();
+    pthread_mutex_unlock(&pool_lock);
+    if (image) {
+        munmap((void *) image, image_length);
+        image = NULL;
+    }
+}
+
+/*
+ * Counts the i-nodes in use without taking any lock, so the counts are a
+ * snapshot that may be off by the operations running meanwhile.
+ * Input:
+ *  - inodes: where the number of i-nodes in use is stored
+ *  - directories: where the number of directories is stored
+ *  - dir_bytes: where the memory held by directory tables is stored
+ */
+void inode_table_usage(int *inodes, int *directories, size_t *dir_bytes) {
+    *inodes = 0;
+    *directories = 0;
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        type nType = __atomic_load_n(&inode_table[i].nodeType, __ATOMIC_RELAXED);
+        *inodes += nType != T_NONE;
+        *directories += nType == T_DIRECTORY;
+    }
+    *dir_bytes = (size_t) *directories * MAX_DIR_ENTRIES * sizeof(DirEntry);
+}
+
+/*
+ * Counts the blocks of the file contents pool.
+ * Input:
+ *  - blocks_used: where the number of blocks holding file contents is stored
+ *  - blocks_cached: where the number of blocks given back and kept for reuse is stored
+ */
+void file_pool_usage(size_t *blocks_used, size_t *blocks_cached) {
+    pthread_mutex_lock(&pool_lock);
+    *blocks_used = pool_blocks - pool_cached;
+    *blocks_cached = pool_cached;
+    pthread_mutex_unlock(&pool_lock);
 }
 
 /*
@@ -92,33 +415,186 @@ int inode_create(type nType) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
     for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if (inode_table[inumber].nodeType == T_NONE) {
-            inode_table[inumber].nodeType = nType;
-
-            if (nType == T_DIRECTORY) {
-                /* Initializes entry table */
-                inode_table[inumber].data.dirEntries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
-                
-                for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-                }
-            }
-            else {
-                inode_table[inumber].data.fileContents = NULL;
-            }
-            return inumber;
+        if (inode_table[inumber].nodeType == T_NONE && inode_create_at(inumber, nType) == SUCCESS)
+            return inumber;     /* another thread may take a free i-node first */
+    }
+    return FAIL;
+}
+
+/*
+ * Creates a new i-node with a given identifier, as a log being replayed
+ * recreates the i-nodes it names.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - nType: the type of the node (file or directory)
+ * Returns: SUCCESS or FAIL if the i-node is in use
+ */
+int inode_create_at(int inumber, type nType) {
+    if (inumber < 0 || inumber >= INODE_TABLE_SIZE)
+        return FAIL;
+    pthread_mutex_lock(&inode_alloc_lock);
+    if (inode_table[inumber].nodeType != T_NONE) {
+        pthread_mutex_unlock(&inode_alloc_lock);
+        return FAIL;
+    }
+    inode_table[inumber].nodeType = nType;
+    pthread_mutex_unlock(&inode_alloc_lock);
+
+    /* the new i-node is not in any directory yet, so no other thread can reach it */
+    inode_table[inumber].refs = 1;
+    inode_table[inumber].frozen = 0;
+    if (nType == T_DIRECTORY) {
+        /* Initializes entry table */
+        inode_table[inumber].data.dirEntries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
+        
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+            inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
         }
     }
+    else {
+        inode_table[inumber].data.fileContents = NULL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Creates a copy of an i-node that shares everything below it: a directory
+ * gets its own table naming the same i-nodes, which gain a reference each,
+ * and a file shares its contents until either copy is written.
+ * The caller must hold the source's lock.
+ * Input:
+ *  - source: identifier of the i-node copied
+ *  - frozen: if non zero, the copy is a snapshot and can't be changed
+ * Returns:
+ *  inumber: identifier of the copy, if successfully created
+ *     FAIL: if an error occurs
+ */
+int inode_copy(int source, int frozen) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
+        if (inode_table[inumber].nodeType == T_NONE && inode_copy_at(inumber, source, frozen) == SUCCESS)
+            return inumber;
+    }
     return FAIL;
 }
 
 /*
- * Deletes the i-node.
+ * Creates a copy of an i-node with a given identifier, see inode_copy.
+ * Input:
+ *  - inumber: identifier of the copy
+ *  - source: identifier of the i-node copied
+ *  - frozen: if non zero, the copy is a snapshot and can't be changed
+ * Returns: SUCCESS or FAIL
+ */
+int inode_copy_at(int inumber, int source, int frozen) {
+    if (source < 0 || source >= INODE_TABLE_SIZE || inode_table[source].nodeType == T_NONE)
+        return FAIL;
+    type nType = inode_table[source].nodeType;
+    if (inode_create_at(inumber, nType) == FAIL)
+        return FAIL;
+
+    inode_fault(source);
+    inode_table[inumber].frozen = frozen;
+    if (nType == T_DIRECTORY) {
+        DirEntry *entries = inode_table[inumber].data.dirEntries;
+        memcpy(entries, inode_table[source].data.dirEntries, sizeof(DirEntry) * MAX_DIR_ENTRIES);
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+            if (entries[i].inumber != FREE_INODE)
+                __atomic_add_fetch(&inode_table[entries[i].inumber].refs, 1, __ATOMIC_ACQ_REL);
+        }
+    }
+    else {
+        FileContents *contents = inode_table[source].data.fileContents;
+        if (contents)
+            __atomic_add_fetch(&contents->refs, 1, __ATOMIC_ACQ_REL);
+        inode_table[inumber].data.fileContents = contents;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Returns how many directory entries name an i-node, more than one if a
+ * clone shares it; such an i-node must be copied before it is changed.
+ */
+int inode_refs(int inumber) {
+    return __atomic_load_n(&inode_table[inumber].refs, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Returns whether an i-node is the root of a snapshot.
+ */
+int inode_frozen(int inumber) {
+    return inode_table[inumber].frozen;
+}
+
+/*
+ * Returns the clone epoch, it moves on every time a clone starts sharing
+ * i-nodes or an i-node something shared is replaced by a copy, after which
+ * an i-node a handle names may have been copied.
+ */
+unsigned int inode_epoch() {
+    return __atomic_load_n(&clone_epoch, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Moves the clone epoch on for a clone: anything below what it copied is
+ * shared now, so every handle opened before it is stale.
+ */
+void inode_epoch_advance() {
+    __atomic_store_n(&clone_last, __atomic_add_fetch(&clone_epoch, 1, __ATOMIC_ACQ_REL), __ATOMIC_RELEASE);
+}
+
+/*
+ * Marks an i-node its directory replaced by a copy, left to whatever else
+ * shares it: handles opened before name the i-node the path no longer does.
+ * The caller must hold its lock.
+ */
+void inode_unshared(int inumber) {
+    inode_table[inumber].unshared = __atomic_add_fetch(&clone_epoch, 1, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * Returns whether a handle opened in a clone epoch must be opened again:
+ * a clone came since, or its i-node was replaced by a copy.
+ * The caller must hold the i-node's lock.
+ */
+int inode_handle_stale(int inumber, unsigned int epoch) {
+    return epoch < __atomic_load_n(&clone_last, __ATOMIC_ACQUIRE) || epoch < inode_table[inumber].unshared;
+}
+
+/*
+ * Deletes an entry of a directory being deleted, right away.
+ */
+static void delete_entry(int sub_inumber, void *context) {
+    writelock(sub_inumber);
+    inode_delete(sub_inumber);
+    unlock(sub_inumber);
+}
+
+/*
+ * Deletes the i-node, or drops one of its references if a clone shares it.
  * Input:
  *  - inumber: identifier of the i-node
  * Returns: SUCCESS or FAIL
  */
 int inode_delete(int inumber) {
+    return inode_delete_deferred(inumber, delete_entry, NULL);
+}
+
+/*
+ * Deletes the i-node as inode_delete does, but hands each entry of a
+ * directory to defer instead of deleting it, so the entries may be deleted
+ * later, by other threads. Nothing else may name the directory, so nothing
+ * reaches its entries meanwhile but through what a clone shares.
+ * The caller must hold the i-node's write lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - defer: called with each entry, and the context, which it must delete
+ *  - context: passed to defer
+ * Returns: SUCCESS or FAIL
+ */
+int inode_delete_deferred(int inumber, void (*defer)(int sub_inumber, void *context), void *context) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
@@ -127,11 +603,23 @@ int inode_delete(int inumber) {
         return FAIL;
     } 
 
-    inode_table[inumber].nodeType = T_NONE;
-    /* see inode_table_destroy function */
-    if (inode_table[inumber].data.dirEntries) {
-        free(inode_table[inumber].data.dirEntries);
+    if (__atomic_sub_fetch(&inode_table[inumber].refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return SUCCESS;     /* a clone still names it */
+    if (inode_table[inumber].nodeType == T_DIRECTORY) {
+        /* only a snapshot, a copy undone or a removed subtree is deleted with entries: they lose their reference */
+        inode_fault(inumber);
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+            int sub_inumber = inode_table[inumber].data.dirEntries[i].inumber;
+            if (sub_inumber != FREE_INODE)
+                defer(sub_inumber, context);
+        }
     }
+    inode_release_data(inumber);
+    inode_table[inumber].generation++;
+    /* the slot is only given back once its data is released */
+    pthread_mutex_lock(&inode_alloc_lock);
+    inode_table[inumber].nodeType = T_NONE;
+    pthread_mutex_unlock(&inode_alloc_lock);
     return SUCCESS;
 }
 
@@ -155,13 +643,24 @@ int inode_get(int inumber, type *nType, union Data *data) {
     if (nType)
         *nType = inode_table[inumber].nodeType;
 
-    if (data)
+    if (data) {
+        inode_fault(inumber);
         *data = inode_table[inumber].data;
+    }
 
     return SUCCESS;
 }
 
 
+/*
+ * Returns the generation of an i-node, it changes every time the i-node is
+ * deleted. The caller must hold the i-node's lock.
+ */
+unsigned int inode_generation(int inumber) {
+    return inode_table[inumber].generation;
+}
+
+
 /*
  * Resets an entry for a directory.
  * Input:
@@ -188,7 +687,7 @@ int dir_reset_entry(int inumber, int sub_inumber) {
         return FAIL;
     }
 
-    
+    inode_fault(inumber);
     for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
         if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber) {
             inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
@@ -232,7 +731,13 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
                entry name must be non-empty\n");
         return FAIL;
     }
-    
+
+    if (strlen(sub_name) >= MAX_FILE_NAME) {
+        printf("inode_add_entry: entry name is too long\n");
+        return FAIL;
+    }
+
+    inode_fault(inumber);
     for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
         if (inode_table[inumber].data.dirEntries[i].inumber == FREE_INODE) {
             inode_table[inumber].data.dirEntries[i].inumber = sub_inumber;
@@ -245,27 +750,964 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
 
 
 /*
- * Prints the i-nodes table.
+ * Makes the entry of a directory naming an i-node name another one, as a
+ * private copy takes the place of an i-node a clone shares; the caller
+ * drops the reference of the i-node replaced with inode_delete.
+ * Input:
+ *  - inumber: identifier of the directory
+ *  - sub_inumber: identifier of the i-node replaced
+ *  - new_inumber: identifier of the i-node taking its place
+ * Returns: SUCCESS or FAIL
+ */
+int dir_replace_entry(int inumber, int sub_inumber, int new_inumber) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    if ((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].nodeType != T_DIRECTORY)) {
+        printf("dir_replace_entry: invalid inumber\n");
+        return FAIL;
+    }
+
+    if ((new_inumber < 0) || (new_inumber >= INODE_TABLE_SIZE) || (inode_table[new_inumber].nodeType == T_NONE)) {
+        printf("dir_replace_entry: invalid entry inumber\n");
+        return FAIL;
+    }
+
+    inode_fault(inumber);
+    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber) {
+            inode_table[inumber].data.dirEntries[i].inumber = new_inumber;
+            return SUCCESS;
+        }
+    }
+    return FAIL;
+}
+
+
+/*
+ * Returns the size of a file's contents.
+ * The caller must hold the i-node's lock.
+ */
+size_t inode_file_size(int inumber) {
+    inode_fault(inumber);
+    FileContents *contents = inode_table[inumber].data.fileContents;
+    return contents ? contents->size : 0;
+}
+
+
+/*
+ * Returns the number of extents holding the first size bytes of a file.
+ */
+static int extents_for(size_t size) {
+    size_t start;
+    return size ? extent_at(size - 1, &start) + 1 : 0;
+}
+
+
+/*
+ * Makes room in a file for its first size bytes, taking extents from the pool.
+ * The bytes of the new extents are undefined.
+ * Returns: SUCCESS or FAIL, if the pool is exhausted or could never hold them
+ */
+static int file_reserve(FileContents *contents, size_t size) {
+    if (size > MAX_FILE_SIZE)
+        return FAIL;        /* the index of its last extent wouldn't even fit an int */
+    int needed = extents_for(size);
+    if (needed > contents->capacity) {
+        int capacity = contents->capacity ? contents->capacity : 8;
+        while (capacity < needed)
+            capacity *= 2;
+        char **extents = realloc(contents->extents, sizeof(char *) * capacity);
+        if (extents == NULL)
+            return FAIL;
+        contents->extents = extents;
+        contents->capacity = capacity;
+    }
+    while (contents->count < needed) {
+        char *extent = pool_take(extent_order(contents->count));
+        if (extent == NULL)
+            return FAIL;
+        contents->extents[contents->count++] = extent;
+    }
+    return SUCCESS;
+}
+
+
+/*
+ * Copies bytes into a file, or zeroes them when buffer is NULL.
+ * Room for them must be reserved.
+ */
+static void file_copy_in(FileContents *contents, size_t offset, const char *buffer, size_t len) {
+    while (len > 0) {
+        size_t start;
+        int i = extent_at(offset, &start);
+        size_t inside = offset - start;
+        size_t chunk = ((size_t) FILE_BLOCK_SIZE << extent_order(i)) - inside;
+        if (chunk > len)
+            chunk = len;
+        if (buffer) {
+            memcpy(contents->extents[i] + inside, buffer, chunk);
+            buffer += chunk;
+        }
+        else {
+            memset(contents->extents[i] + inside, 0, chunk);
+        }
+        offset += chunk;
+        len -= chunk;
+    }
+}
+
+
+/*
+ * Copies the data of an i-node out of the checkpoint image the first time it
+ * is used, so loading a table costs nothing for the parts never touched.
+ * The caller must hold the i-node's lock, for reading at least.
+ */
+static void inode_fault(int inumber) {
+    if (!__atomic_load_n(&inode_table[inumber].pending, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&image_lock);    /* readers of the same i-node may fault it together */
+    if (inode_table[inumber].pending) {
+        const image_inode *saved = (const image_inode *) (image + sizeof(image_header)) + inumber;
+        const char *bytes = image + saved->offset;
+        if (inode_table[inumber].nodeType == T_DIRECTORY) {
+            DirEntry *entries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
+            if (entries == NULL) {
+                fprintf(stderr, "Couldn't load directory %d\n", inumber);
+                exit(EXIT_FAILURE);
+            }
+            for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+                entries[i].inumber = FREE_INODE;
+            for (size_t at = 0; at < saved->size; ) {
+                image_entry entry;
+                if (saved->size - at < sizeof(entry)) {
+                    fprintf(stderr, "Corrupt checkpoint image: directory %d\n", inumber);
+                    exit(EXIT_FAILURE);
+                }
+                memcpy(&entry, bytes + at, sizeof(entry));
+                at += sizeof(entry);
+                if (entry.slot >= MAX_DIR_ENTRIES || entry.length >= MAX_FILE_NAME || entry.length > saved->size - at
+                    || entry.inumber < 0 || entry.inumber >= INODE_TABLE_SIZE) {
+                    fprintf(stderr, "Corrupt checkpoint image: directory %d\n", inumber);
+                    exit(EXIT_FAILURE);
+                }
+                entries[entry.slot].inumber = entry.inumber;
+                memcpy(entries[entry.slot].name, bytes + at, entry.length);
+                entries[entry.slot].name[entry.length] = '\0';
+                at += entry.length;
+            }
+            inode_table[inumber].data.dirEntries = entries;
+        }
+        else if (saved->size > 0) {
+            FileContents *contents = calloc(1, sizeof(FileContents));
+            if (contents == NULL || file_reserve(contents, saved->size) == FAIL) {
+                fprintf(stderr, "Couldn't load file %d\n", inumber);
+                exit(EXIT_FAILURE);
+            }
+            file_copy_in(contents, 0, bytes, saved->size);
+            contents->size = saved->size;
+            contents->refs = 1;
+            inode_table[inumber].data.fileContents = contents;
+        }
+        __atomic_store_n(&inode_table[inumber].pending, 0, __ATOMIC_RELEASE);
+        __atomic_sub_fetch(&image_pending, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&image_lock);
+}
+
+
+/*
+ * Gives a file contents of its own if it shares them with a clone, so that
+ * changing them leaves the clone as it was.
+ * The caller must hold the i-node's write lock.
+ * Returns: SUCCESS or FAIL, if the pool is exhausted
+ */
+static int file_own(int inumber) {
+    FileContents *shared = inode_table[inumber].data.fileContents;
+    if (shared == NULL || __atomic_load_n(&shared->refs, __ATOMIC_ACQUIRE) == 1)
+        return SUCCESS;
+    FileContents *contents = calloc(1, sizeof(FileContents));
+    if (contents == NULL)
+        return FAIL;
+    if (file_reserve(contents, shared->size) == FAIL) {
+        file_drop_extents(contents, 0);
+        free(contents->extents);
+        free(contents);
+        return FAIL;
+    }
+    for (size_t offset = 0; offset < shared->size; ) {
+        size_t start;
+        int i = extent_at(offset, &start);
+        size_t chunk = (size_t) FILE_BLOCK_SIZE << extent_order(i);
+        if (chunk > shared->size - offset)
+            chunk = shared->size - offset;
+        memcpy(contents->extents[i], shared->extents[i], chunk);
+        offset += chunk;
+    }
+    contents->size = shared->size;
+    contents->refs = 1;
+    inode_table[inumber].data.fileContents = contents;
+    file_release_contents(shared);
+    return SUCCESS;
+}
+
+
+/*
+ * Writes bytes to a file, growing it if they go past its end. The bytes
+ * between the end and the offset, if any, read as zeros.
+ * The caller must hold the i-node's write lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - offset: position of the first byte to write
+ *  - buffer: the bytes to write
+ *  - len: number of bytes to write
+ * Returns: SUCCESS or FAIL
+ */
+int inode_write_file(int inumber, size_t offset, const char *buffer, size_t len) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    if ((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].nodeType != T_FILE)) {
+        printf("inode_write_file: invalid inumber\n");
+        return FAIL;
+    }
+    if (offset + len < offset || offset + len > MAX_FILE_SIZE) {
+        printf("inode_write_file: file too large\n");
+        return FAIL;
+    }
+
+    inode_fault(inumber);
+    if (file_own(inumber) == FAIL) {
+        printf("inode_write_file: out of blocks\n");
+        return FAIL;
+    }
+    FileContents *contents = inode_table[inumber].data.fileContents;
+    if (contents == NULL) {
+        if ((contents = calloc(1, sizeof(FileContents))) == NULL)
+            return FAIL;
+        contents->refs = 1;
+        inode_table[inumber].data.fileContents = contents;
+    }
+    if (offset + len > contents->size) {
+        if (file_reserve(contents, offset + len) == FAIL) {
+            printf("inode_write_file: out of blocks\n");
+            file_drop_extents(contents, extents_for(contents->size));     /* the extents taken for the write go back */
+            return FAIL;
+        }
+        if (offset > contents->size)
+            file_copy_in(contents, contents->size, NULL, offset - contents->size);
+    }
+    file_copy_in(contents, offset, buffer, len);
+    if (offset + len > contents->size)
+        contents->size = offset + len;
+    return SUCCESS;
+}
+
+/*
+ * Sets the size of a file: the bytes past it are dropped and, if it grows,
+ * the new bytes read as zeros.
+ * The caller must hold the i-node's write lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - size: the new size
+ * Returns: SUCCESS or FAIL
+ */
+int inode_truncate_file(int inumber, size_t size) {
+    if ((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].nodeType != T_FILE)) {
+        printf("inode_truncate_file: invalid inumber\n");
+        return FAIL;
+    }
+
+    inode_fault(inumber);
+    if (file_own(inumber) == FAIL) {
+        printf("inode_truncate_file: out of blocks\n");
+        return FAIL;
+    }
+    FileContents *contents = inode_table[inumber].data.fileContents;
+    size_t old_size = contents ? contents->size : 0;
+    if (size > old_size) {
+        /* writing the last byte zeroes the ones before it */
+        return inode_write_file(inumber, size - 1, "", 1);
+    }
+    if (contents) {
+        file_drop_extents(contents, extents_for(size));
+        contents->size = size;
+    }
+    return SUCCESS;
+}
+
+
+/*
+ * Describes part of a file's contents in place: each iovec points into one
+ * of its extents, so the bytes can be sent without copying them. They stay
+ * valid while the caller holds the i-node's lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - offset: position of the first byte
+ *  - len: number of bytes wanted, fewer are mapped past the end of the file
+ *  - iov: where the pieces are stored
+ *  - max_iov: room in iov, fewer bytes are mapped if they need more pieces
+ *  - mapped: where the number of bytes mapped is stored
+ * Returns: number of iovecs used, or FAIL
+ */
+int inode_map_file(int inumber, size_t offset, size_t len, struct iovec *iov, int max_iov, size_t *mapped) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    if ((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].nodeType != T_FILE)) {
+        printf("inode_map_file: invalid inumber\n");
+        return FAIL;
+    }
+
+    size_t size = inode_file_size(inumber);
+    int count = 0;
+    *mapped = 0;
+    if (offset >= size)
+        return 0;
+    if (len > size - offset)
+        len = size - offset;
+    while (len > 0 && count < max_iov) {
+        size_t start;
+        int i = extent_at(offset, &start);
+        size_t inside = offset - start;
+        size_t chunk = ((size_t) FILE_BLOCK_SIZE << extent_order(i)) - inside;
+        if (chunk > len)
+            chunk = len;
+        iov[count].iov_base = inode_table[inumber].data.fileContents->extents[i] + inside;
+        iov[count].iov_len = chunk;
+        count++;
+        offset += chunk;
+        len -= chunk;
+        *mapped += chunk;
+    }
+    return count;
+}
+
+
+/*
+ * Replaces the contents of a file.
+ * The caller must hold the i-node's write lock.
  * Input:
  *  - inumber: identifier of the i-node
- *  - name: pointer to the name of current file/dir
+ *  - fileContents: the new contents
+ *  - len: number of bytes of the new contents
+ * Returns: SUCCESS or FAIL
  */
-void inode_print_tree(FILE *fp, int inumber, char *name) {
-    if (inode_table[inumber].nodeType == T_FILE) {
-        fprintf(fp, "%s\n", name);
+int inode_set_file(int inumber, char *fileContents, int len) {
+    if (len < 0 || inode_truncate_file(inumber, 0) == FAIL)
+        return FAIL;
+    return inode_write_file(inumber, 0, fileContents, len);
+}
+
+
+/*
+ * Writes out the chunks of a tree dump with as few writev calls as the
+ * file takes, and empties them.
+ */
+static void tree_flush(tree_writer *writer) {
+    struct iovec pending[PRINT_CHUNKS];
+    int count = writer->count, first = 0;
+    memcpy(pending, writer->chunks, count * sizeof(struct iovec));
+    while (first < count && !writer->failed) {
+        ssize_t written = writev(writer->fd, pending + first, count - first);
+        if (written < 0 && errno != EINTR)
+            writer->failed = 1;
+        while (written > 0 && first < count) {      /* a partial write leaves part of a chunk */
+            size_t done = (size_t) written < pending[first].iov_len ? (size_t) written : pending[first].iov_len;
+            pending[first].iov_base = (char *) pending[first].iov_base + done;
+            pending[first].iov_len -= done;
+            written -= done;
+            if (pending[first].iov_len == 0)
+                first++;
+        }
+        while (first < count && pending[first].iov_len == 0)
+            first++;
+    }
+    for (int i = 0; i < writer->count; i++)
+        writer->chunks[i].iov_len = 0;
+    writer->count = 1;
+}
+
+
+/*
+ * Appends bytes to a tree dump, writing its chunks out once they are all full.
+ */
+static void tree_put(tree_writer *writer, const char *bytes, size_t len) {
+    if (len == 0)
+        return;     /* an empty buffer may not be allocated yet */
+    if (writer->fd < 0) {
+        struct iovec *buffer = &writer->chunks[0];
+        if (writer->failed)
+            return;
+        if (buffer->iov_len + len > writer->capacity) {
+            size_t capacity = writer->capacity ? writer->capacity : FILE_BLOCK_SIZE;
+            while (capacity < buffer->iov_len + len)
+                capacity *= 2;
+            char *grown = realloc(buffer->iov_base, capacity);
+            if (grown == NULL) {
+                writer->failed = 1;
+                return;
+            }
+            buffer->iov_base = grown;
+            writer->capacity = capacity;
+        }
+        memcpy((char *) buffer->iov_base + buffer->iov_len, bytes, len);
+        buffer->iov_len += len;
         return;
     }
 
-    if (inode_table[inumber].nodeType == T_DIRECTORY) {
-        fprintf(fp, "%s\n", name);
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-            if (inode_table[inumber].data.dirEntries[i].inumber != FREE_INODE) {
-                char path[MAX_FILE_NAME];
-                if (snprintf(path, sizeof(path), "%s/%s", name, inode_table[inumber].data.dirEntries[i].name) > sizeof(path)) {
-                    fprintf(stderr, "truncation when building full path\n");
+    while (len > 0) {
+        struct iovec *chunk = &writer->chunks[writer->count - 1];
+        size_t room = PRINT_CHUNK - chunk->iov_len;
+        if (room == 0) {
+            if (writer->count == PRINT_CHUNKS)
+                tree_flush(writer);
+            else
+                writer->count++;
+            continue;
+        }
+        if (room > len)
+            room = len;
+        memcpy((char *) chunk->iov_base + chunk->iov_len, bytes, room);
+        chunk->iov_len += room;
+        bytes += room;
+        len -= room;
+    }
+}
+
+
+/*
+ * Appends a path to a tree dump as one line.
+ */
+static void tree_put_line(tree_writer *writer, const char *path, size_t length) {
+    tree_put(writer, path, length);
+    tree_put(writer, "\n", 1);
+}
+
+
+/*
+ * Starts a walk of the subtree of a directory whose path is prefix.
+ * Returns: the walk, or NULL if memory ran out
+ */
+static tree_cursor *tree_cursor_start(int inumber, const char *prefix, size_t prefix_length) {
+    tree_cursor *cursor = calloc(1, sizeof(tree_cursor));
+    if (cursor == NULL)
+        return NULL;
+    cursor->path_capacity = prefix_length + MAX_FILE_NAME;
+    cursor->stack_capacity = 64;
+    cursor->path = malloc(cursor->path_capacity);
+    cursor->stack = malloc(cursor->stack_capacity * sizeof(tree_frame));
+    cursor->pending = (tree_writer) { -1, { { 0 } }, 1, 0, 0 };
+    if (cursor->path == NULL || cursor->stack == NULL) {
+        free(cursor->path);
+        free(cursor->stack);
+        free(cursor);
+        return NULL;
+    }
+    memcpy(cursor->path, prefix, prefix_length);
+    inode_fault(inumber);
+    cursor->stack[cursor->depth++] = (tree_frame) { inumber, 0, prefix_length };
+    return cursor;
+}
+
+
+/*
+ * Goes on with a walk, printing a line for every i-node it visits, until it
+ * ends or, if the writer keeps its lines in memory, the writer holds limit
+ * bytes. The walk keeps its own stack of the directories it is in, each
+ * with the next entry to visit and the length of its path, and extends one
+ * path buffer in place, so neither the depth nor the length of a path is
+ * bounded.
+ */
+static void tree_cursor_walk(tree_cursor *cursor, tree_writer *writer, size_t limit) {
+    while (cursor->depth > 0 && !writer->failed && (writer->fd >= 0 || writer->chunks[0].iov_len < limit)) {
+        tree_frame *top = &cursor->stack[cursor->depth - 1];
+        DirEntry *entries = inode_table[top->inumber].data.dirEntries;
+        while (top->slot < MAX_DIR_ENTRIES && entries[top->slot].inumber == FREE_INODE)
+            top->slot++;
+        if (top->slot == MAX_DIR_ENTRIES) {
+            cursor->depth--;
+            continue;
+        }
+
+        int child = entries[top->slot].inumber;
+        size_t name_length = strnlen(entries[top->slot].name, MAX_FILE_NAME);
+        size_t length = top->length + 1 + name_length;
+        top->slot++;
+        if (inode_table[child].nodeType == T_NONE)
+            continue;
+
+        if (length > cursor->path_capacity) {
+            char *grown = realloc(cursor->path, 2 * length);
+            if (grown == NULL) {
+                writer->failed = 1;
+                break;
+            }
+            cursor->path = grown;
+            cursor->path_capacity = 2 * length;
+        }
+        cursor->path[top->length] = '/';
+        memcpy(cursor->path + top->length + 1, entries[top->slot - 1].name, name_length);
+        tree_put_line(writer, cursor->path, length);
+
+        if (inode_table[child].nodeType == T_DIRECTORY) {
+            if (cursor->depth == (int) cursor->stack_capacity) {
+                tree_frame *grown = realloc(cursor->stack, 2 * cursor->stack_capacity * sizeof(tree_frame));
+                if (grown == NULL) {
+                    writer->failed = 1;
+                    break;
                 }
-                inode_print_tree(fp, inode_table[inumber].data.dirEntries[i].inumber, path);
+                cursor->stack = grown;
+                cursor->stack_capacity *= 2;
             }
+            inode_fault(child);
+            cursor->stack[cursor->depth++] = (tree_frame) { child, 0, length };
         }
     }
 }
+
+
+/*
+ * Prints the subtree of a directory whose own line is already printed.
+ */
+static void tree_walk(tree_writer *writer, int inumber, const char *prefix, size_t prefix_length) {
+    tree_cursor *cursor = tree_cursor_start(inumber, prefix, prefix_length);
+    if (cursor == NULL) {
+        writer->failed = 1;
+        return;
+    }
+    tree_cursor_walk(cursor, writer, SIZE_MAX);
+    tree_cursor_close(cursor);
+}
+
+
+/*
+ * Splits the subtree of a directory in units for a parallel dump: every
+ * round replaces each directory unit by its own line and a unit for each
+ * entry, until there are enough units or PRINT_ROUNDS levels were split.
+ * Returns: number of units, FAIL if not even one could be made
+ */
+static int tree_split(tree_dump *dump, int inumber, int wanted) {
+    dump->units = malloc(sizeof(tree_unit));
+    char *root = strdup("");
+    if (dump->units == NULL || root == NULL) {
+        free(dump->units);
+        free(root);
+        dump->units = NULL;
+        return FAIL;
+    }
+    dump->units[0] = (tree_unit) { inumber, root, 0, UNIT_WAITING, { -1, { { 0 } }, 1, 0, 0 } };
+    dump->count = 1;
+
+    for (int round = 0; round < PRINT_ROUNDS && dump->count < wanted; round++) {
+        int count = 0, capacity = dump->count, split = 1;
+        for (int i = 0; i < dump->count; i++)
+            if (dump->units[i].state == UNIT_WAITING)
+                capacity += MAX_DIR_ENTRIES;
+        tree_unit *units = capacity > dump->count ? malloc(capacity * sizeof(tree_unit)) : NULL;
+        if (units == NULL)
+            break;
+
+        for (int i = 0; i < dump->count; i++) {
+            tree_unit *unit = &dump->units[i];
+            int first = count;
+            units[count++] = *unit;
+            if (unit->state != UNIT_WAITING || !split)
+                continue;
+            units[first].state = UNIT_LINE;
+            inode_fault(unit->inumber);
+            DirEntry *entries = inode_table[unit->inumber].data.dirEntries;
+            for (int slot = 0; slot < MAX_DIR_ENTRIES && split; slot++) {
+                int child = entries[slot].inumber;
+                if (child == FREE_INODE || inode_table[child].nodeType == T_NONE)
+                    continue;
+                size_t name_length = strnlen(entries[slot].name, MAX_FILE_NAME);
+                char *path = malloc(unit->length + name_length + 2);
+                if (path == NULL) {         /* the directory stays whole, and so does everything after it */
+                    while (count > first + 1)
+                        free(units[--count].path);
+                    units[first].state = UNIT_WAITING;
+                    split = 0;
+                    break;
+                }
+                sprintf(path, "%s/%.*s", unit->path, (int) name_length, entries[slot].name);
+                units[count++] = (tree_unit) { child, path, unit->length + 1 + name_length,
+                    inode_table[child].nodeType == T_DIRECTORY ? UNIT_WAITING : UNIT_LINE, { -1, { { 0 } }, 1, 0, 0 } };
+            }
+        }
+        free(dump->units);
+        dump->units = units;
+        dump->count = count;
+        if (!split)
+            break;
+    }
+    return dump->count;
+}
+
+
+/*
+ * Walks the units of a parallel dump in order until none is left waiting.
+ */
+static void *tree_worker(void *arg) {
+    tree_dump *dump = arg;
+    for (;;) {
+        pthread_mutex_lock(&dump->lock);
+        while (dump->next < dump->count && dump->units[dump->next].state != UNIT_WAITING)
+            dump->next++;
+        if (dump->next == dump->count) {
+            pthread_mutex_unlock(&dump->lock);
+            return NULL;
+        }
+        tree_unit *unit = &dump->units[dump->next++];
+        unit->state = UNIT_TAKEN;
+        pthread_mutex_unlock(&dump->lock);
+
+        tree_walk(&unit->output, unit->inumber, unit->path, unit->length);
+
+        pthread_mutex_lock(&dump->lock);
+        unit->state = UNIT_DONE;
+        pthread_cond_broadcast(&dump->done);
+        pthread_mutex_unlock(&dump->lock);
+    }
+}
+
+
+/*
+ * Prints the tree below an i-node, one full path per line, to a file.
+ * With more than one thread, the subtrees found a few levels down are
+ * walked by a pool of them while the calling thread merges their output in
+ * order, walking itself any unit it reaches before a thread has taken it,
+ * so the file is the same as the one a single thread writes.
+ * Lines are gathered in PRINT_CHUNKS chunks written out with one writev.
+ * The caller must keep the tree from changing meanwhile.
+ * Input:
+ *  - fd: the file, written from its current offset
+ *  - inumber: identifier of the i-node, printed with an empty path
+ *  - threads: most threads walking the tree at once, no more than there are processors
+ * Returns: SUCCESS or FAIL
+ */
+int inode_print_tree(int fd, int inumber, int threads) {
+    tree_writer writer = { fd, { { 0 } }, 1, 0, 0 };
+    tree_dump dump = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int started = 0;
+
+    if (cpus > 0 && threads > cpus)     /* more threads than processors only slow the walk down */
+        threads = cpus;
+    pthread_t workers[threads > 1 ? threads - 1 : 1];
+
+    for (int i = 0; i < PRINT_CHUNKS; i++)
+        if ((writer.chunks[i].iov_base = malloc(PRINT_CHUNK)) == NULL)
+            writer.failed = 1;
+
+    if (writer.failed || inode_table[inumber].nodeType == T_NONE)
+        ;
+    else if (inode_table[inumber].nodeType == T_FILE)
+        tree_put_line(&writer, "", 0);
+    else if (threads <= 1 || tree_split(&dump, inumber, threads * PRINT_UNITS) <= 1) {
+        tree_put_line(&writer, "", 0);
+        tree_walk(&writer, inumber, "", 0);
+    }
+    else {
+        for (int i = 0; i < threads - 1; i++)       /* the calling thread is the last one */
+            if (pthread_create(&workers[started], NULL, tree_worker, &dump) == 0)
+                started++;
+
+        for (int i = 0; i < dump.count; i++) {
+            tree_unit *unit = &dump.units[i];
+            tree_put_line(&writer, unit->path, unit->length);
+            if (unit->state == UNIT_LINE)
+                continue;
+
+            pthread_mutex_lock(&dump.lock);
+            int walk = unit->state == UNIT_WAITING;
+            if (walk)
+                unit->state = UNIT_TAKEN;
+            while (!walk && unit->state != UNIT_DONE)
+                pthread_cond_wait(&dump.done, &dump.lock);
+            pthread_mutex_unlock(&dump.lock);
+
+            if (walk)
+                tree_walk(&writer, unit->inumber, unit->path, unit->length);
+            else {
+                writer.failed |= unit->output.failed;
+                tree_put(&writer, unit->output.chunks[0].iov_base, unit->output.chunks[0].iov_len);
+            }
+            free(unit->output.chunks[0].iov_base);
+            unit->output.chunks[0].iov_base = NULL;
+        }
+        for (int i = 0; i < started; i++)
+            pthread_join(workers[i], NULL);
+    }
+    if (!writer.failed)
+        tree_flush(&writer);
+    for (int i = 0; i < dump.count; i++) {
+        free(dump.units[i].path);
+        free(dump.units[i].output.chunks[0].iov_base);
+    }
+    free(dump.units);
+    for (int i = 0; i < PRINT_CHUNKS; i++)
+        free(writer.chunks[i].iov_base);
+    return writer.failed ? FAIL : SUCCESS;
+}
+
+
+/*
+ * Starts reading the tree below an i-node as inode_print_tree prints it, a
+ * piece at a time. The subtree must not change until the cursor is closed,
+ * which a frozen copy of it guarantees.
+ * Input:
+ *  - inumber: identifier of the i-node, printed with an empty path
+ * Returns: the cursor, or NULL if memory ran out
+ */
+tree_cursor *tree_cursor_open(int inumber) {
+    tree_cursor *cursor = tree_cursor_start(inumber, "", 0);
+    if (cursor == NULL)
+        return NULL;
+    if (inode_table[inumber].nodeType != T_DIRECTORY)
+        cursor->depth = 0;
+    if (inode_table[inumber].nodeType != T_NONE)
+        tree_put_line(&cursor->pending, "", 0);
+    return cursor;
+}
+
+
+/*
+ * Reads the next bytes of the tree, walking only as much of it as they take;
+ * lines are cut wherever len ends.
+ * Input:
+ *  - cursor: the cursor
+ *  - buffer: where the bytes are copied
+ *  - len: most bytes read
+ * Returns: number of bytes read, less than len only at the end, or FAIL
+ */
+int tree_cursor_read(tree_cursor *cursor, char *buffer, size_t len) {
+    struct iovec *pending = &cursor->pending.chunks[0];
+    if (pending->iov_len - cursor->taken < len && cursor->depth > 0) {
+        memmove(pending->iov_base, (char *) pending->iov_base + cursor->taken, pending->iov_len - cursor->taken);
+        pending->iov_len -= cursor->taken;
+        cursor->taken = 0;
+        tree_cursor_walk(cursor, &cursor->pending, len);
+    }
+    if (cursor->pending.failed)
+        return FAIL;
+    size_t read = pending->iov_len - cursor->taken < len ? pending->iov_len - cursor->taken : len;
+    memcpy(buffer, (char *) pending->iov_base + cursor->taken, read);
+    cursor->taken += read;
+    return read;
+}
+
+
+void tree_cursor_close(tree_cursor *cursor) {
+    free(cursor->pending.chunks[0].iov_base);
+    free(cursor->path);
+    free(cursor->stack);
+    free(cursor);
+}
+
+
+/*
+ * Loads the table from a checkpoint image. The image is mapped and only the
+ * type and generation of every i-node are read: the data of an i-node is
+ * copied out of it the first time it is used, so loading takes as long for
+ * an empty tree as for a full one. Must be called right after
+ * inode_table_init, before any other thread uses the table.
+ * Input:
+ *  - path: the image
+ *  - lsn: where the last record of the log the image holds is stored
+ * Returns: SUCCESS or FAIL
+ */
+int inode_table_load(const char *path, uint64_t *lsn) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        perror("inode_table_load");
+        if (fd >= 0)
+            close(fd);
+        return FAIL;
+    }
+    size_t length = info.st_size;
+    const image_header *header = NULL;
+    if (length >= sizeof(image_header)) {
+        header = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);      /* the mapping keeps the image */
+    if (header == NULL || header == MAP_FAILED || memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0
+        || header->inode_table_size != INODE_TABLE_SIZE || header->max_dir_entries > MAX_DIR_ENTRIES
+        || header->length != length || length < sizeof(image_header) + sizeof(image_inode) * INODE_TABLE_SIZE) {
+        printf("inode_table_load: %s isn't an image of this table\n", path);
+        if (header && header != MAP_FAILED)
+            munmap((void *) header, length);
+        return FAIL;
+    }
+
+    const image_inode *saved = (const image_inode *) (header + 1);
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        if ((saved[i].type != T_FILE && saved[i].type != T_DIRECTORY && saved[i].type != T_NONE)
+            || saved[i].offset > length || saved[i].size > length - saved[i].offset) {
+            printf("inode_table_load: corrupt i-node %d\n", i);
+            munmap((void *) header, length);
+            return FAIL;        /* the table is left half loaded, the file system can't start */
+        }
+        inode_table[i].nodeType = saved[i].type;
+        inode_table[i].generation = saved[i].generation;
+        inode_table[i].refs = saved[i].refs;
+        inode_table[i].frozen = (saved[i].flags & IMAGE_FROZEN) != 0;
+        inode_table[i].pending = saved[i].type != T_NONE;
+        image_pending += inode_table[i].pending;
+    }
+    image = (const char *) header;
+    image_length = length;
+    clone_epoch = clone_last = header->epoch;
+    *lsn = header->lsn;
+    return SUCCESS;
+}
+
+
+/*
+ * Writes out what an image writer holds.
+ */
+static void image_flush(image_writer *writer) {
+    size_t done = 0;
+    while (done < writer->used && !writer->failed) {
+        ssize_t written = write(writer->fd, writer->buffer + done, writer->used - done);
+        if (written < 0 && errno != EINTR)
+            writer->failed = 1;
+        else if (written > 0)
+            done += written;
+    }
+    writer->used = 0;
+}
+
+
+/*
+ * Appends bytes to the image being written.
+ */
+static void image_put(image_writer *writer, const void *bytes, size_t len) {
+    writer->offset += len;
+    while (len > 0) {
+        size_t chunk = IMAGE_BUFFER - writer->used;
+        if (chunk > len)
+            chunk = len;
+        memcpy(writer->buffer + writer->used, bytes, chunk);
+        writer->used += chunk;
+        bytes = (const char *) bytes + chunk;
+        len -= chunk;
+        if (writer->used == IMAGE_BUFFER)
+            image_flush(writer);
+    }
+}
+
+
+/*
+ * Appends the data of an i-node to the image being written and describes it.
+ * An i-node still pending is copied from the image the table was loaded from.
+ */
+static void image_put_inode(image_writer *writer, int inumber, image_inode *saved) {
+    saved->type = inode_table[inumber].nodeType;
+    saved->generation = inode_table[inumber].generation;
+    saved->refs = inode_table[inumber].refs;
+    saved->flags = inode_table[inumber].frozen ? IMAGE_FROZEN : 0;
+    saved->offset = writer->offset;
+    if (saved->type == T_NONE) {
+        saved->offset = 0;
+        saved->refs = 0;
+        saved->flags = 0;
+    }
+    else if (__atomic_load_n(&inode_table[inumber].pending, __ATOMIC_ACQUIRE)) {
+        const image_inode *old = (const image_inode *) (image + sizeof(image_header)) + inumber;
+        image_put(writer, image + old->offset, old->size);
+    }
+    else if (saved->type == T_DIRECTORY) {
+        DirEntry *entries = inode_table[inumber].data.dirEntries;
+        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
+            if (entries[i].inumber == FREE_INODE)
+                continue;
+            image_entry entry = { i, entries[i].inumber, strlen(entries[i].name) };
+            image_put(writer, &entry, sizeof(entry));
+            image_put(writer, entries[i].name, entry.length);
+        }
+    }
+    else if (inode_table[inumber].data.fileContents) {
+        FileContents *contents = inode_table[inumber].data.fileContents;
+        size_t left = contents->size;
+        for (int i = 0; left > 0; i++) {
+            size_t chunk = (size_t) FILE_BLOCK_SIZE << extent_order(i);
+            if (chunk > left)
+                chunk = left;
+            image_put(writer, contents->extents[i], chunk);
+            left -= chunk;
+        }
+    }
+    saved->size = writer->offset - saved->offset;
+    if (saved->type == T_NONE)
+        saved->size = 0;
+}
+
+
+/*
+ * Writes a checkpoint image of the table. It is written next to the image
+ * it replaces and renamed over it once synced, so a crash leaves either
+ * image whole. No i-node may change meanwhile: the caller must keep every
+ * change out, reads and lookups may go on.
+ * Input:
+ *  - path: the image
+ *  - lsn: last record of the log the table holds, 0 without a log
+ *  - bytes: where the size of the image is stored
+ * Returns: SUCCESS or FAIL
+ */
+int inode_table_save(const char *path, uint64_t lsn, size_t *bytes) {
+    size_t table = sizeof(image_header) + sizeof(image_inode) * INODE_TABLE_SIZE;
+    char temporary[strlen(path) + 5];
+    sprintf(temporary, "%s.tmp", path);
+    image_writer writer = { open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644), malloc(IMAGE_BUFFER), 0, table, 0 };
+    image_inode *saved = calloc(INODE_TABLE_SIZE, sizeof(image_inode));
+    if (writer.fd < 0 || writer.buffer == NULL || saved == NULL || lseek(writer.fd, table, SEEK_SET) < 0) {
+        perror("inode_table_save");
+        writer.failed = 1;
+    }
+
+    /* the data goes first, after room for the table, which is written once every offset is known */
+    for (int i = 0; i < INODE_TABLE_SIZE && !writer.failed; i++)
+        image_put_inode(&writer, i, &saved[i]);
+    image_flush(&writer);
+    image_header header = { IMAGE_MAGIC, INODE_TABLE_SIZE, MAX_DIR_ENTRIES, lsn, writer.offset, inode_epoch(), 0 };
+    if (!writer.failed
+        && (pwrite(writer.fd, &header, sizeof(header), 0) != sizeof(header)
+            || pwrite(writer.fd, saved, sizeof(image_inode) * INODE_TABLE_SIZE, sizeof(header)) != (ssize_t) (sizeof(image_inode) * INODE_TABLE_SIZE)
+            || fsync(writer.fd) < 0 || rename(temporary, path) < 0)) {
+        perror("inode_table_save");
+        writer.failed = 1;
+    }
+    if (writer.fd >= 0)
+        close(writer.fd);
+    free(writer.buffer);
+    free(saved);
+    if (writer.failed) {
+        unlink(temporary);
+        return FAIL;
+    }
+
+    /* the rename is only durable once the directory holding the image is synced */
+    char directory[strlen(path) + 1];
+    strcpy(directory, path);
+    int dirfd = open(dirname(directory), O_RDONLY | O_DIRECTORY);
+    if (dirfd >= 0) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+    *bytes = writer.offset;
+    return SUCCESS;
+}
+
+
+/*
+ * Describes the image the table was loaded from.
+ * Input:
+ *  - bytes: where its size is stored, 0 without one
+ *  - pending: where the number of i-nodes whose data is still only in it is stored
+ */
+void image_usage(size_t *bytes, int *pending) {
+    *bytes = image ? image_length : 0;
+    *pending = __atomic_load_n(&image_pending, __ATOMIC_RELAXED);
+}
@@ -4,19 +4,45 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/uio.h>
 #include "../tecnicofs-api-constants.h"
 
 /* FS root inode number */
 #define FS_ROOT 0
 
 #define FREE_INODE -1
+/* both limits can be raised at build time, e.g. make FSFLAGS=-DINODE_TABLE_SIZE=100000 */
+#ifndef INODE_TABLE_SIZE
 #define INODE_TABLE_SIZE 50
+#endif
+#ifndef MAX_DIR_ENTRIES
 #define MAX_DIR_ENTRIES 20
+#endif
 
 #define SUCCESS 0
 #define FAIL -1
 
+/*
+ * File contents are kept in extents of contiguous blocks taken from a pool.
+ * Extent i of a file holds FILE_BLOCK_SIZE << min(i, MAX_EXTENT_ORDER) bytes,
+ * so small files take one block and large ones few extents.
+ */
+#ifndef FILE_BLOCK_SIZE
+#define FILE_BLOCK_SIZE 4096
+#endif
+#ifndef MAX_EXTENT_ORDER
+#define MAX_EXTENT_ORDER 8              /* extents stop growing at 1 MiB */
+#endif
+#ifndef FILE_POOL_BLOCKS
+#define FILE_POOL_BLOCKS 262144         /* blocks the pool may take from the system, 1 GiB */
+#endif
+#define MAX_FILE_SIZE ((size_t) FILE_POOL_BLOCKS * FILE_BLOCK_SIZE)     /* no file can grow past the whole pool */
+
+/* busy-wait cycles simulating the cost of each i-node access, make FSFLAGS=-DDELAY=0 removes it */
+#ifndef DELAY
 #define DELAY 5000
+#endif
 
 
 /*
@@ -27,11 +53,22 @@ typedef struct dirEntry {
 	int inumber;
 } DirEntry;
 
+/*
+ * Contents of a file: its extents, in order, and how many bytes are used
+ */
+typedef struct fileContents {
+	char **extents;
+	int count;
+	int capacity;
+	size_t size;
+	int refs;           /* i-nodes sharing these contents since a clone, a write to one of them copies them first */
+} FileContents;
+
 /*
  * Data is either text (file) or entries (DirEntry)
  */
 union Data {
-	char *fileContents; /* for files */
+	FileContents *fileContents; /* for files, NULL until something is written */
 	DirEntry *dirEntries; /* for directories */
 };
 
@@ -41,26 +78,63 @@ union Data {
 typedef struct inode_t {    
 	type nodeType;
 	union Data data;
+	unsigned int generation; /* changes when the i-node is deleted, tells a reused i-node from the one a handle names */
+	int pending; /* its data is still only in the checkpoint image the table was loaded from */
+	int refs; /* directory entries naming it, more than one once a clone shares it */
+	int frozen; /* the root of a snapshot, nothing below it can be changed */
+	unsigned int unshared; /* clone epoch it was replaced by a copy in, see inode_unshared */
 	pthread_rwlock_t rwlock;
     /* more i-node attributes will be added in future exercises */
 } inode_t;
 
 
+/* reads the tree a piece at a time, see tree_cursor_open */
+typedef struct tree_cursor tree_cursor;
+
+/* time, in nanoseconds, the calling thread has spent blocked on i-node locks */
+extern __thread unsigned long long lock_wait_ns;
+
 void init_lock(pthread_rwlock_t* lock);
 void destroy_lock(pthread_rwlock_t* lock);
 void readlock(int inumber);
 void writelock(int inumber);
+int tryreadlock(int inumber);
+int trywritelock(int inumber);
 void unlock(int inumber);
 void insert_delay(int cycles);
 void inode_table_init();
 void inode_table_destroy();
+int inode_table_load(const char *path, uint64_t *lsn);
+int inode_table_save(const char *path, uint64_t lsn, size_t *bytes);
+void inode_table_usage(int *inodes, int *directories, size_t *dir_bytes);
+void image_usage(size_t *bytes, int *pending);
+void file_pool_usage(size_t *blocks_used, size_t *blocks_cached);
 int inode_create(type nType);
+int inode_create_at(int inumber, type nType);
+int inode_copy(int source, int frozen);
+int inode_copy_at(int inumber, int source, int frozen);
+int inode_refs(int inumber);
+int inode_frozen(int inumber);
+unsigned int inode_epoch();
+void inode_epoch_advance();
+void inode_unshared(int inumber);
+int inode_handle_stale(int inumber, unsigned int epoch);
 int inode_delete(int inumber);
+int inode_delete_deferred(int inumber, void (*defer)(int sub_inumber, void *context), void *context);
 int inode_get(int inumber, type *nType, union Data *data);
+unsigned int inode_generation(int inumber);
 int inode_set_file(int inumber, char *fileContents, int len);
+size_t inode_file_size(int inumber);
+int inode_write_file(int inumber, size_t offset, const char *buffer, size_t len);
+int inode_truncate_file(int inumber, size_t size);
+int inode_map_file(int inumber, size_t offset, size_t len, struct iovec *iov, int max_iov, size_t *mapped);
 int dir_reset_entry(int inumber, int sub_inumber);
 int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
-void inode_print_tree(FILE *fp, int inumber, char *name);
+int dir_replace_entry(int inumber, int sub_inumber, int new_inumber);
+int inode_print_tree(int fd, int inumber, int threads);
+tree_cursor *tree_cursor_open(int inumber);
+int tree_cursor_read(tree_cursor *cursor, char *buffer, size_t len);
+void tree_cursor_close(tree_cursor *cursor);
 
 
 #endif /* INODES_H */
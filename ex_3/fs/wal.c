@@ -0,0 +1,483 @@
+#include "wal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Records appended since the committer last took them wait in one buffer
+ * while the committer writes the other
+ */
+typedef struct wal_buffer {
+	char *data;
+	size_t length;
+	size_t capacity;
+} wal_buffer;
+
+static struct {
+	int fd;                         /* -1 while no log is open, nothing is logged then */
+	wal_config config;
+	wal_buffer buffers[2];
+	wal_buffer *active;             /* records are appended here */
+	uint64_t appended;              /* sequence number of the last record appended */
+	uint64_t durable;               /* every record up to this one is written, and synced */
+	uint64_t group_start;           /* when the first record of the active buffer was appended */
+	int stopping;
+	pthread_t committer;
+	pthread_mutex_t lock;
+	pthread_cond_t work;            /* the committer waits for records, on the monotonic clock */
+	pthread_cond_t committed;       /* threads in wal_commit wait for their records */
+	wal_counters counters;
+	int removed;                    /* a subtree was removed while the log was replayed */
+} wal = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .committed = PTHREAD_COND_INITIALIZER };
+
+__thread uint64_t wal_pending = 0;
+
+#define WAL_DROPPED UINT64_MAX         /* wal_pending of a thread whose record the closing log refused */
+
+
+static uint64_t wal_clock() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+#define WAL_HASH_SEED 2166136261u      /* FNV-1a offset basis */
+
+/*
+ * FNV-1a hash of some bytes, continuing from a previous hash.
+ */
+static uint32_t wal_hash(uint32_t hash, const void *bytes, size_t len) {
+	const unsigned char *p = bytes;
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619u;
+	return hash;
+}
+
+
+/*
+ * Checksum of a record: its payload, then its header after the checksum.
+ * Input:
+ *  - record: the header
+ *  - payload_hash: wal_hash of the payload, from WAL_HASH_SEED
+ */
+static uint32_t wal_checksum(wal_record *record, uint32_t payload_hash) {
+	return wal_hash(payload_hash, (char *) record + 2 * sizeof(uint32_t), sizeof(wal_record) - 2 * sizeof(uint32_t));
+}
+
+
+/*
+ * Tells whether a write or truncate follows the removal of a subtree that
+ * held its file: the file was freed by the removal when it was replayed,
+ * but the server freed it later and let it be written until then.
+ */
+static int wal_freed(int inumber) {
+	return wal.removed && inumber >= 0 && inumber < INODE_TABLE_SIZE && inode_refs(inumber) == 0;
+}
+
+
+/*
+ * Applies a record to the i-node table, the way the operation that
+ * appended it changed the table.
+ * Returns: SUCCESS or FAIL if the record doesn't fit the table
+ */
+static int wal_apply(wal_record *record, const char *payload) {
+	size_t len = record->length - sizeof(wal_record);
+	char name[MAX_FILE_NAME];
+
+	if (record->kind == WAL_CREATE || record->kind == WAL_MOVE || record->kind == WAL_CLONE) {
+		if (len == 0 || len >= MAX_FILE_NAME)
+			return FAIL;
+		memcpy(name, payload, len);
+		name[len] = '\0';
+	}
+	switch (record->kind) {
+		case WAL_CREATE:
+			if (inode_create_at(record->inumber, record->node_type) == FAIL)
+				return FAIL;
+			return dir_add_entry(record->parent, record->inumber, name);
+		case WAL_REMOVE:
+			wal.removed = 1;
+			/* fall through */
+		case WAL_DELETE:
+			if (dir_reset_entry(record->parent, record->inumber) == FAIL)
+				return FAIL;
+			return inode_delete(record->inumber);
+		case WAL_MOVE:
+			if (dir_reset_entry(record->parent, record->inumber) == FAIL)
+				return FAIL;
+			return dir_add_entry(record->target, record->inumber, name);
+		case WAL_WRITE:
+			if (wal_freed(record->inumber))
+				return SUCCESS;
+			return inode_write_file(record->inumber, record->offset, payload, len);
+		case WAL_TRUNCATE:
+			if (wal_freed(record->inumber))
+				return SUCCESS;
+			return inode_truncate_file(record->inumber, record->offset);
+		case WAL_CLONE:
+			if (inode_copy_at(record->inumber, record->target, record->node_type) == FAIL)
+				return FAIL;
+			inode_epoch_advance();
+			return dir_add_entry(record->parent, record->inumber, name);
+		case WAL_COPY:
+			if (inode_copy_at(record->inumber, record->target, 0) == FAIL)
+				return FAIL;
+			if (dir_replace_entry(record->parent, record->target, record->inumber) == FAIL)
+				return FAIL;
+			inode_unshared(record->target);
+			return inode_delete(record->target);	/* freed here if only a dump, which isn't logged, shared it */
+	}
+	return FAIL;
+}
+
+
+/*
+ * Applies the records of a log to the i-node table. A record torn by a
+ * crash, and everything after it, is cut off the log. Records a checkpoint
+ * image already holds are skipped: they are left in the log when the server
+ * stops between writing an image and emptying the log.
+ * Input:
+ *  - fd: the log, open for reading and writing
+ *  - base: last record the table holds
+ * Returns: SUCCESS or FAIL if a whole record can't be applied or records are missing
+ */
+static int wal_replay(int fd, uint64_t base) {
+	struct stat info;
+	size_t offset = 0;
+	uint64_t previous = 0;
+
+	wal.appended = base;
+
+	if (fstat(fd, &info) < 0)
+		return FAIL;
+	if (info.st_size == 0)
+		return SUCCESS;
+	char *log = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (log == MAP_FAILED)
+		return FAIL;
+	madvise(log, info.st_size, MADV_SEQUENTIAL);
+
+	while (offset + sizeof(wal_record) <= (size_t) info.st_size) {
+		wal_record record;
+		memcpy(&record, log + offset, sizeof(record));
+		if (record.length < sizeof(record) || record.length > info.st_size - offset
+		    || (previous && record.lsn != previous + 1)
+		    || wal_checksum(&record, wal_hash(WAL_HASH_SEED, log + offset + sizeof(record), record.length - sizeof(record))) != record.checksum)
+			break;
+		const char *payload = log + offset + sizeof(record);
+		previous = record.lsn;
+		offset += record.length;
+		if (record.lsn <= base)
+			continue;
+		if (record.lsn != wal.appended + 1) {
+			fprintf(stderr, "log starts at record %llu, after the image's %llu\n", (unsigned long long) record.lsn, (unsigned long long) base);
+			munmap(log, info.st_size);
+			return FAIL;
+		}
+		if (wal_apply(&record, payload) == FAIL) {
+			fprintf(stderr, "log record %llu doesn't apply\n", (unsigned long long) record.lsn);
+			munmap(log, info.st_size);
+			return FAIL;
+		}
+		wal.appended = record.lsn;
+		wal.counters.replayed++;
+	}
+	munmap(log, info.st_size);
+	if (offset < (size_t) info.st_size && ftruncate(fd, offset) < 0)
+		return FAIL;
+	return SUCCESS;
+}
+
+
+/*
+ * Writes a group of records to the log and syncs them.
+ */
+static void wal_write(wal_buffer *buffer) {
+	size_t written = 0;
+	while (written < buffer->length) {
+		ssize_t count = write(wal.fd, buffer->data + written, buffer->length - written);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0) {
+			perror("Couldn't write the log");
+			exit(EXIT_FAILURE);
+		}
+		written += count;
+	}
+	if (wal.config.sync && fdatasync(wal.fd) < 0) {
+		perror("Couldn't sync the log");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Commits the records appended meanwhile, in groups: a group waits for more
+ * records until the window after its first one ends or it holds group_bytes.
+ * A group is only taken once the previous one is synced, so records appended
+ * during a sync share the next one even without a window.
+ */
+static void *wal_committer(void *arg) {
+	sigset_t signals;
+	sigfillset(&signals);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);    /* a signal sent to the server never interrupts a commit */
+	pthread_mutex_lock(&wal.lock);
+	while (1) {
+		while (wal.active->length == 0 && !wal.stopping)
+			pthread_cond_wait(&wal.work, &wal.lock);
+		if (wal.active->length == 0)
+			break;
+		uint64_t deadline = wal.group_start + wal.config.window_ns;
+		while (wal.active->length < wal.config.group_bytes && !wal.stopping && wal_clock() < deadline) {
+			struct timespec until = { deadline / 1000000000ULL, deadline % 1000000000ULL };
+			pthread_cond_timedwait(&wal.work, &wal.lock, &until);
+		}
+
+		wal_buffer *group = wal.active;
+		uint64_t last = wal.appended;
+		wal.active = group == &wal.buffers[0] ? &wal.buffers[1] : &wal.buffers[0];
+		pthread_mutex_unlock(&wal.lock);
+		wal_write(group);
+		pthread_mutex_lock(&wal.lock);
+
+		wal.counters.bytes += group->length;
+		wal.counters.groups++;
+		group->length = 0;
+		wal.durable = last;
+		pthread_cond_broadcast(&wal.committed);
+	}
+	pthread_mutex_unlock(&wal.lock);
+	return NULL;
+}
+
+
+/*
+ * Opens a log, creating it if it doesn't exist, replays its records into the
+ * i-node table and starts the committer. The table must be freshly
+ * initialized, or loaded from a checkpoint image.
+ * Input:
+ *  - path: the log file
+ *  - config: how records are grouped and whether they are synced
+ *  - base: last record the image holds, 0 without one
+ * Returns: SUCCESS or FAIL
+ */
+int wal_open(const char *path, wal_config *config, uint64_t base) {
+	pthread_condattr_t attributes;
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) {
+		perror("Couldn't open the log");
+		return FAIL;
+	}
+	if (wal_replay(fd, base) == FAIL) {
+		fprintf(stderr, "Couldn't replay the log %s\n", path);
+		close(fd);
+		return FAIL;
+	}
+
+	wal.config = *config;
+	wal.durable = wal.appended;
+	wal.active = &wal.buffers[0];
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&wal.work, &attributes);
+	pthread_condattr_destroy(&attributes);
+	wal.fd = fd;
+	if (pthread_create(&wal.committer, NULL, wal_committer, NULL) != 0) {
+		fprintf(stderr, "Couldn't start the log committer\n");
+		close(fd);
+		wal.fd = -1;
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+
+/*
+ * Commits the records appended so far and closes the log. Records appended
+ * later are dropped, and wal_commit fails for the threads that appended them.
+ */
+void wal_close() {
+	if (wal.fd < 0)
+		return;
+	pthread_mutex_lock(&wal.lock);
+	wal.stopping = 1;
+	pthread_cond_signal(&wal.work);
+	pthread_mutex_unlock(&wal.lock);
+	pthread_join(wal.committer, NULL);
+	pthread_mutex_lock(&wal.lock);
+	close(wal.fd);
+	__atomic_store_n(&wal.fd, -1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&wal.committed);
+	pthread_mutex_unlock(&wal.lock);
+	for (int i = 0; i < 2; i++) {
+		free(wal.buffers[i].data);
+		wal.buffers[i] = (wal_buffer) { NULL, 0, 0 };
+	}
+}
+
+
+/*
+ * Appends a record to the active group, the caller holds the locks of the
+ * i-nodes it changes.
+ * Input:
+ *  - record: the header, its length, number and checksum are filled in
+ *  - payload: the name or data that follows it
+ *  - len: bytes of the payload
+ */
+static void wal_append(wal_record *record, const char *payload, size_t len) {
+	if (__atomic_load_n(&wal.fd, __ATOMIC_ACQUIRE) < 0 && !wal.stopping)
+		return;     /* no log was opened; once it is closed, stopping tells the record is dropped */
+	record->length = sizeof(wal_record) + len;
+	record->reserved = 0;
+	uint32_t hash = wal_hash(WAL_HASH_SEED, payload, len);     /* the payload is hashed without the lock */
+
+	pthread_mutex_lock(&wal.lock);
+	if (wal.stopping) {
+		pthread_mutex_unlock(&wal.lock);
+		wal_pending = WAL_DROPPED;     /* the committer is gone or only writes what it already has */
+		return;
+	}
+	wal_buffer *buffer = wal.active;
+	if (buffer->length + record->length > buffer->capacity) {
+		size_t capacity = buffer->capacity ? buffer->capacity : 65536;
+		while (capacity < buffer->length + record->length)
+			capacity *= 2;
+		char *grown = realloc(buffer->data, capacity);
+		if (grown == NULL) {
+			fprintf(stderr, "Couldn't grow the log buffer\n");
+			exit(EXIT_FAILURE);
+		}
+		buffer->data = grown;
+		buffer->capacity = capacity;
+	}
+	record->lsn = ++wal.appended;
+	record->checksum = wal_checksum(record, hash);
+	memcpy(buffer->data + buffer->length, record, sizeof(wal_record));
+	if (len > 0)
+		memcpy(buffer->data + buffer->length + sizeof(wal_record), payload, len);
+	if (buffer->length == 0)
+		wal.group_start = wal_clock();
+	buffer->length += record->length;
+	wal.counters.records++;
+	if (buffer->length == record->length || buffer->length >= wal.config.group_bytes)
+		pthread_cond_signal(&wal.work);
+	pthread_mutex_unlock(&wal.lock);
+	wal_pending = record->lsn;
+}
+
+
+void wal_log_create(int parent, int inumber, type nType, const char *name) {
+	wal_record record = { .kind = WAL_CREATE, .node_type = nType, .inumber = inumber, .parent = parent };
+	wal_append(&record, name, strlen(name));
+}
+
+
+void wal_log_delete(int parent, int inumber) {
+	wal_record record = { .kind = WAL_DELETE, .inumber = inumber, .parent = parent };
+	wal_append(&record, NULL, 0);
+}
+
+
+void wal_log_remove(int parent, int inumber) {
+	wal_record record = { .kind = WAL_REMOVE, .inumber = inumber, .parent = parent };
+	wal_append(&record, NULL, 0);
+}
+
+
+void wal_log_move(int parent, int target, int inumber, const char *name) {
+	wal_record record = { .kind = WAL_MOVE, .inumber = inumber, .parent = parent, .target = target };
+	wal_append(&record, name, strlen(name));
+}
+
+
+void wal_log_write(int inumber, size_t offset, const char *buffer, size_t len) {
+	wal_record record = { .kind = WAL_WRITE, .inumber = inumber, .offset = offset };
+	wal_append(&record, buffer, len);
+}
+
+
+void wal_log_truncate(int inumber, size_t size) {
+	wal_record record = { .kind = WAL_TRUNCATE, .inumber = inumber, .offset = size };
+	wal_append(&record, NULL, 0);
+}
+
+
+void wal_log_clone(int parent, int source, int inumber, int frozen, const char *name) {
+	wal_record record = { .kind = WAL_CLONE, .node_type = frozen != 0, .inumber = inumber, .parent = parent, .target = source };
+	wal_append(&record, name, strlen(name));
+}
+
+
+void wal_log_copy(int parent, int source, int inumber) {
+	wal_record record = { .kind = WAL_COPY, .inumber = inumber, .parent = parent, .target = source };
+	wal_append(&record, NULL, 0);
+}
+
+
+/*
+ * Waits until every record the calling thread appended is durable.
+ * Returns: 1 if it had records to wait for, 0 otherwise, or FAIL if one of
+ * them was appended while the log was closing and will never be durable
+ */
+int wal_commit() {
+	if (wal_pending == 0)
+		return 0;
+	pthread_mutex_lock(&wal.lock);
+	while (wal.durable < wal_pending && wal.fd >= 0 && wal_pending != WAL_DROPPED)
+		pthread_cond_wait(&wal.committed, &wal.lock);
+	int durable = wal.durable >= wal_pending;
+	pthread_mutex_unlock(&wal.lock);
+	wal_pending = 0;
+	return durable ? 1 : FAIL;
+}
+
+
+/*
+ * Returns the sequence number of the last record appended, 0 if none ever was.
+ */
+uint64_t wal_last() {
+	pthread_mutex_lock(&wal.lock);
+	uint64_t last = wal.appended;
+	pthread_mutex_unlock(&wal.lock);
+	return last;
+}
+
+
+/*
+ * Empties the log once a checkpoint image holds all its records. No record
+ * may be appended meanwhile, the caller keeps every change out.
+ * Input:
+ *  - lsn: last record the image holds
+ * Returns: SUCCESS or FAIL, the log is then left as it was
+ */
+int wal_truncate(uint64_t lsn) {
+	int result = SUCCESS;
+	if (wal.fd < 0)
+		return SUCCESS;
+	pthread_mutex_lock(&wal.lock);
+	while (wal.durable < wal.appended)     /* the committer may still be writing records the image holds */
+		pthread_cond_wait(&wal.committed, &wal.lock);
+	if (wal.appended != lsn || ftruncate(wal.fd, 0) < 0)
+		result = FAIL;
+	pthread_mutex_unlock(&wal.lock);
+	return result;
+}
+
+
+/*
+ * Copies the counters of the log.
+ */
+void wal_usage(wal_counters *counters) {
+	pthread_mutex_lock(&wal.lock);
+	*counters = wal.counters;
+	pthread_mutex_unlock(&wal.lock);
+}
@@ -0,0 +1,74 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "state.h"
+
+/*
+ * Write-ahead log of every change to the tree and to the contents of files.
+ * A record is appended while the i-nodes it changes are still locked, so
+ * changes that conflict are logged in the order they happened, and it names
+ * i-nodes by their number, so replaying the log rebuilds the same table.
+ * A committer thread writes the records appended meanwhile and syncs them
+ * with one fdatasync (group commit); wal_commit waits until the records of
+ * the calling thread are durable.
+ */
+#define WAL_CREATE 1
+#define WAL_DELETE 2
+#define WAL_MOVE 3
+#define WAL_WRITE 4
+#define WAL_TRUNCATE 5
+#define WAL_CLONE 6
+#define WAL_COPY 7
+#define WAL_REMOVE 8            /* a delete of a whole subtree, whose files may still be written until they are freed */
+
+/*
+ * Header of a record in the log, followed by the name of a create, a move
+ * or a clone, or by the data of a write
+ */
+typedef struct wal_record {
+	uint32_t length;        /* of the whole record */
+	uint32_t checksum;      /* of everything after it, a torn record ends the log */
+	uint64_t lsn;           /* sequence number, one more than the previous record's */
+	uint8_t kind;
+	uint8_t node_type;      /* of a create, or non zero for a clone that is a snapshot */
+	uint16_t reserved;
+	int32_t inumber;        /* the i-node created, deleted, moved, written or copied */
+	int32_t parent;         /* the directory holding it, before a move */
+	int32_t target;         /* the directory a move puts it in, or the i-node a clone or copy copies */
+	uint64_t offset;        /* where a write starts, or the size a truncate sets */
+} wal_record;
+
+typedef struct wal_config {
+	uint64_t window_ns;     /* how long the committer waits for more records after the first of a group */
+	size_t group_bytes;     /* a group is committed as soon as it holds this many bytes */
+	int sync;               /* if zero, records are written but never synced, for benchmarks */
+} wal_config;
+
+typedef struct wal_counters {
+	uint64_t records;       /* appended since the log was opened */
+	uint64_t bytes;
+	uint64_t groups;        /* written, each with one sync */
+	uint64_t replayed;      /* records applied when the log was opened */
+} wal_counters;
+
+/* sequence number of the last record the calling thread appended and hasn't waited for, 0 if none */
+extern __thread uint64_t wal_pending;
+
+int wal_open(const char *path, wal_config *config, uint64_t base);
+void wal_close();
+void wal_log_create(int parent, int inumber, type nType, const char *name);
+void wal_log_delete(int parent, int inumber);
+void wal_log_remove(int parent, int inumber);
+void wal_log_move(int parent, int target, int inumber, const char *name);
+void wal_log_write(int inumber, size_t offset, const char *buffer, size_t len);
+void wal_log_truncate(int inumber, size_t size);
+void wal_log_clone(int parent, int source, int inumber, int frozen, const char *name);
+void wal_log_copy(int parent, int source, int inumber);
+int wal_commit();
+uint64_t wal_last();
+int wal_truncate(uint64_t lsn);
+void wal_usage(wal_counters *counters);
+
+#endif /* WAL_H */
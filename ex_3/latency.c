@@ -0,0 +1,145 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "latency.h"
+
+
+/*
+ * Returns the current time of the monotonic clock, in nanoseconds.
+ */
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+/*
+ * Computes the bucket of a value.
+ * Values below HIST_SUB_BUCKETS have a bucket of their own, the others are
+ * placed by their most significant bit and the HIST_SUB_BITS bits after it.
+ */
+static int bucket_of(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS)
+        return value;
+
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > HIST_MAX_EXPONENT)
+        return HIST_BUCKETS - 1;
+
+    int sub = (value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+
+/*
+ * Returns the highest value that falls in a bucket.
+ */
+static uint64_t bucket_value(int bucket) {
+    if (bucket < HIST_SUB_BUCKETS)
+        return bucket;
+
+    int exponent = bucket / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    uint64_t sub = bucket % HIST_SUB_BUCKETS;
+    return ((HIST_SUB_BUCKETS + sub + 1) << (exponent - HIST_SUB_BITS)) - 1;
+}
+
+
+/*
+ * Empties a histogram.
+ */
+void histogram_reset(histogram_t *hist) {
+    memset(hist, 0, sizeof(histogram_t));
+}
+
+
+/*
+ * Adds a value to a histogram.
+ * Must only be called by the thread that owns the histogram.
+ * Input:
+ *  - hist: the histogram
+ *  - value: latency in nanoseconds
+ */
+void histogram_record(histogram_t *hist, uint64_t value) {
+    int bucket = bucket_of(value);
+    __atomic_store_n(&hist->counts[bucket], hist->counts[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->total, hist->total + 1, __ATOMIC_RELAXED);
+    if (value > hist->max)
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Adds the counts of a histogram to another one.
+ * The source may be concurrently updated by its owner thread.
+ * Input:
+ *  - into: histogram that receives the counts
+ *  - from: histogram to be merged
+ */
+void histogram_merge(histogram_t *into, histogram_t *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        into->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+    into->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > into->max)
+        into->max = max;
+}
+
+
+/*
+ * Computes a percentile of a histogram.
+ * Input:
+ *  - hist: the histogram
+ *  - percentile: percentile to compute, between 0 and 100
+ * Returns: highest value of the bucket where the percentile falls (0 if empty)
+ */
+uint64_t histogram_percentile(histogram_t *hist, double percentile) {
+    uint64_t total = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        total += hist->counts[i];
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (percentile / 100.0 * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+
+/*
+ * Prints the column names used by histogram_print.
+ */
+void histogram_print_header(FILE *fp) {
+    fprintf(fp, "%-28s %10s %10s %10s %10s %10s %10s\n",
+            "latency (us)", "count", "p50", "p90", "p99", "p99.9", "max");
+}
+
+
+/*
+ * Prints the count and the usual percentiles of a histogram, in microseconds.
+ * Input:
+ *  - fp: pointer to output file
+ *  - label: name of the row
+ *  - hist: the histogram
+ */
+void histogram_print(FILE *fp, const char *label, histogram_t *hist) {
+    fprintf(fp, "%-28s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", label,
+            (unsigned long long) hist->total,
+            histogram_percentile(hist, 50) / 1000.0,
+            histogram_percentile(hist, 90) / 1000.0,
+            histogram_percentile(hist, 99) / 1000.0,
+            histogram_percentile(hist, 99.9) / 1000.0,
+            hist->max / 1000.0);
+}
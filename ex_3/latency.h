@@ -0,0 +1,37 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Log-linear histogram of latencies in nanoseconds: every power of two is split
+ * into HIST_SUB_BUCKETS linear buckets, so the relative error of any recorded
+ * value is below 1/HIST_SUB_BUCKETS whatever its magnitude.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXPONENT 40    /* values above 2^40 ns (about 18 minutes) go to the last bucket */
+#define HIST_BUCKETS ((HIST_MAX_EXPONENT - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS)
+
+/*
+ * A histogram is written by a single thread and may be read by any other,
+ * so every counter is updated with relaxed atomic stores and never locked.
+ */
+typedef struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+} histogram_t;
+
+
+uint64_t now_ns();
+void histogram_reset(histogram_t *hist);
+void histogram_record(histogram_t *hist, uint64_t value);
+void histogram_merge(histogram_t *into, histogram_t *from);
+uint64_t histogram_percentile(histogram_t *hist, double percentile);
+void histogram_print_header(FILE *fp);
+void histogram_print(FILE *fp, const char *label, histogram_t *hist);
+
+
+#endif /* LATENCY_H */
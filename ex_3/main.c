@@ -1,52 +1,257 @@
+#define _GNU_SOURCE     //accept4, F_GET_SEALS
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <getopt.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <signal.h>
 #include "fs/operations.h"
-#include <sys/time.h>
+#include "fs/wal.h"
+#include "latency.h"
+#include "tecnicofs-protocol.h"
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sched.h>
 
 #define MAX_INPUT_SIZE 100
+#define MAX_REQUEST_SIZE TFS_MAX_MESSAGE_SIZE       //longest request of either protocol, a full batch of text commands included
+#define MAX_RESULT_SIZE 12                          //a result and its separator
+#define MAX_REPLY_SIZE TFS_MAX_REPLY_SIZE             //the results of a full batch of text commands fit as well
+#define CONNECTION_BUFFER 4096                      //initial size of a connection's buffer, grown for batches
+#define MAX_EVENTS 256
+#define MAX_RECV_BATCH 64                           //most datagrams a worker takes from the socket at once
+#define RECV_BATCH 16                               //datagrams per receive unless TECNICOFS_RECV_BATCH says otherwise
+#define WAL_GROUP_KB 1024                           //most a group commit of the log holds unless TECNICOFS_WAL_GROUP_KB says otherwise
+#define CHECKPOINT_S 60                             //seconds between checkpoints unless TECNICOFS_CHECKPOINT_S says otherwise
+
+/*classes of requests, each with its own queue: lookups are latency critical, mutations and dumps are background work*/
+#define CLASS_LOOKUP 0
+#define CLASS_MUTATION 1
+#define CLASS_DUMP 2
+#define NUM_CLASSES 3
+
+/*operations whose latencies are recorded separately*/
+#define OP_CREATE_FILE 0
+#define OP_CREATE_DIR 1
+#define OP_LOOKUP 2
+#define OP_DELETE 3
+#define OP_MOVE 4
+#define OP_PRINT 5
+#define OP_READ 6
+#define OP_WRITE 7
+#define OP_TRUNCATE 8
+#define OP_STAT 9
+#define OP_CLONE 10
+#define OP_DUMP 11
+#define OP_READDIR 12
+#define OP_REMOVE 13
+#define NUM_OPS 14
+
+/*every latency is split into the time the request waited in the socket, the time spent
+blocked on locks and the time spent executing, the total is recorded as well*/
+#define LAT_QUEUE 0
+#define LAT_LOCK 1
+#define LAT_EXEC 2
+#define LAT_TOTAL 3
+#define LAT_PARTS 4
+
+typedef struct threadStats {    //latency histograms and counters of a worker, only that worker writes to them
+    histogram_t latency[NUM_OPS][LAT_PARTS];
+    uint64_t errors[NUM_OPS];       //operations that failed, a lookup of a missing path included
+    uint64_t invalid;               //malformed commands
+    uint64_t lockWait;              //nanoseconds spent blocked on i-node locks and the tree lock
+    uint64_t datagrams;             //requests received by the worker from the datagram socket
+    uint64_t syscalls;              //receives and sends the worker made on the datagram socket
+    histogram_t commit;             //time replies waited for the changes they report to be durable in the log
+} threadStats_t;
+
+typedef struct watch {          //what an epoll event is about: a connection's socket or its doorbell, NULL for the listening socket
+    struct connection* connection;
+    int doorbell;
+} watch_t;
+
+typedef struct connection {     //a connected client, shared by the reactor and the workers answering its requests
+    int fd;
+    int refs;                       //held by the reactor and by every request of the connection not yet answered
+    pthread_mutex_t writeLock;      //replies of different workers are written one at a time
+    size_t length;                  //bytes of incomplete requests kept in the buffer
+    size_t capacity;
+    char* buffer;
+    watch_t socketWatch;
+    watch_t doorbellWatch;
+    int passed[3];                  //descriptors received with the requests, kept until a TFS_OP_ATTACH takes them
+    int passedCount;
+    tfs_shm_ring* ring;             //shared with the client once it attaches one, see tecnicofs-protocol.h
+    int doorbell;                   //written by the client when the ring has requests and the server is idle
+    int wakeup;                     //written by the server when the ring has replies and the client sleeps
+    int draining;                   //a worker is serving the ring
+    int closed;                     //the client disconnected, a worker serving the ring stops
+} connection_t;
+
+typedef struct request {        //a complete request read by the reactor, waiting for a worker
+    connection_t* connection;       //NULL for a datagram, answered at the client's address
+    struct sockaddr_un client;
+    socklen_t clientLength;
+    uint64_t arrival;
+    struct request* next;
+    int drain;                      //the worker serves the connection's ring, there is no command
+    size_t length;                  //binary requests aren't NUL-terminated
+    char command[];
+} request_t;
+
+typedef struct requestQueue {   //the requests of a class, in arrival order
+    request_t* head;
+    request_t* tail;
+    int length;
+    int weight;                     //share of the dispatches the class gets while every class has requests waiting
+    int credit;                     //grows by the weight at every dispatch, the class with the most goes next
+} requestQueue_t;
+
+const char* opNames[NUM_OPS] = {"create file", "create directory", "lookup", "delete", "move", "print", "read", "write", "truncate", "stat", "clone", "dump", "readdir", "remove"};
+const char* partNames[LAT_PARTS] = {"queue", "lock wait", "execution", "total"};
+const char* opKeys[NUM_OPS] = {"create_file", "create_dir", "lookup", "delete", "move", "print", "read", "write", "truncate", "stat", "clone", "dump", "readdir", "remove"};     //names of the counters
+const char* classKeys[NUM_CLASSES] = {"lookup", "mutation", "dump"};
 
 /*global variables that are used when initializing the program:
-tecnicofs maxThreads nomeSocket*/
+tecnicofs maxThreads nomeSocket [dgram|stream|seqpacket [lookup,mutation,dump weights]]*/
 
 int maxThreads = 0;             //maximum number of threads is stored here
-int isPrinting = 0;             //0 for not printing, 1 for printing, 2 for waiting state
-int modThreads = 0;             //stores number of threads that have modifying behavior
 char* nomeSocket = NULL;        //socket identification
+int socketType = SOCK_DGRAM;    //on stream and seqpacket sockets clients keep a connection open
+int ringSpin = TFS_SHM_SPIN;    //polls of an empty ring before yielding, none on a single processor
+int priorities = 0;             //set when weights are given, every request is a lookup otherwise so they are served in order
+int recvBatch = RECV_BATCH;     //datagrams a worker receives and answers with one system call each way
+uint64_t busyPoll = 0;          //nanoseconds a worker keeps polling the datagram socket before it sleeps, 0 sleeps at once
+char* walPath = NULL;           //log of every change, replayed when the server starts; none keeps the tree in memory only
+wal_config walConfig = { 0, WAL_GROUP_KB * 1024, 1 };
+char* checkpointPath = NULL;    //image of the tree loaded at startup and rewritten periodically; none starts from an empty tree
+int checkpointInterval = CHECKPOINT_S;
+uint64_t startupTime = 0;       //nanoseconds from the start of the server until it could serve, loading the tree included
+
+//the checkpoint counters are only changed with the tree lock held for writing, read without it by the counters
+uint64_t checkpointLsn = UINT64_MAX;    //last log record the newest image holds, none is known yet
+uint64_t checkpointCount = 0;
+uint64_t checkpointBytes = 0;
+uint64_t checkpointTime = 0;            //nanoseconds the last checkpoint kept changes out
 
-//this condition variable and lock garantees that the program only prints if there are no other active operations that modify the tree
-pthread_mutex_t printLock =  PTHREAD_MUTEX_INITIALIZER; 
-pthread_cond_t printCond = PTHREAD_COND_INITIALIZER;
+//requests read by the reactor wait here for a worker, in the queue of their class
+requestQueue_t queues[NUM_CLASSES];
+pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queueNotEmpty = PTHREAD_COND_INITIALIZER;
+int queueLength = 0;            //requests in every queue, only changed with queueLock held, read without it by the counters
+int connectionCount = 0;        //open connections, only changed by the reactor
 
-//this condition variable and lock garantees that while the program is printing, the other threads can't modify the tree
-pthread_mutex_t opLock =  PTHREAD_MUTEX_INITIALIZER; 
-pthread_cond_t opCond = PTHREAD_COND_INITIALIZER;
+//commands that modify the tree hold this lock for reading and the print command holds it for writing,
+//so the program only prints when there are no active modifications and no modification starts while it prints
+pthread_rwlock_t treeLock = PTHREAD_RWLOCK_INITIALIZER;
 
 int sockfd;
-struct sockaddr_un remote, local;
-socklen_t servlen, clilen;
-FILE* outputFile;
+struct sockaddr_un remote;
+socklen_t servlen;
+
+threadStats_t* threadStats;     //one entry per worker thread, merged when a report is printed
+struct timespec startTime;      //time at which the server started accepting commands
 
 
 static void arguments(int argc, char* const argv[]) {   //this function parses the program's variables
-    if(argc != 3) {                                     //the function only succeeds if you have exactly 3 arguments and if their typings are correct
+    if(argc < 3 || argc > 5) {                          //the function only succeeds if you have 3 to 5 arguments and if their typings are correct
         fprintf(stderr, "Wrong argument usage\n");
         exit(EXIT_FAILURE);
     }
     maxThreads = atoi(argv[1]);
     nomeSocket = argv[2]; 
+    if(argc >= 4) {
+        if(strcmp(argv[3], "stream") == 0)
+            socketType = SOCK_STREAM;
+        else if(strcmp(argv[3], "seqpacket") == 0)
+            socketType = SOCK_SEQPACKET;
+        else if(strcmp(argv[3], "dgram") != 0) {
+            fprintf(stderr, "Please use dgram, stream or seqpacket as the socket type\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+        
+    for(int i = 0; i < NUM_CLASSES; i++) {
+        queues[i].weight = 1;
+    }
+    if(argc == 5) {     //e.g. 8,2,1 serves up to 8 lookups for every 2 mutations and 1 dump when all of them are waiting
+        priorities = 1;
+        if(sscanf(argv[4], "%d,%d,%d", &queues[CLASS_LOOKUP].weight, &queues[CLASS_MUTATION].weight, &queues[CLASS_DUMP].weight) != NUM_CLASSES
+           || queues[CLASS_LOOKUP].weight <= 0 || queues[CLASS_MUTATION].weight <= 0 || queues[CLASS_DUMP].weight <= 0) {
+            fprintf(stderr, "Please use three positive weights, for lookups, mutations and dumps\n");
+            exit(EXIT_FAILURE);
+        }
+    }
         
     if(maxThreads <= 0) {   //there has to be a number of threads greater than 0
         fprintf(stderr, "Please use a valid number of threads\n");
         exit(EXIT_FAILURE);
     }
+
+    char* tuning = getenv("TECNICOFS_RECV_BATCH");      //the datagram workers can be tuned from the environment
+    if(tuning) {
+        recvBatch = atoi(tuning);
+        if(recvBatch <= 0 || recvBatch > MAX_RECV_BATCH) {
+            fprintf(stderr, "TECNICOFS_RECV_BATCH must be between 1 and %d\n", MAX_RECV_BATCH);
+            exit(EXIT_FAILURE);
+        }
+    }
+    tuning = getenv("TECNICOFS_BUSY_POLL_US");
+    if(tuning) {
+        if(atoi(tuning) < 0) {
+            fprintf(stderr, "TECNICOFS_BUSY_POLL_US can't be negative\n");
+            exit(EXIT_FAILURE);
+        }
+        busyPoll = (uint64_t) atoi(tuning) * 1000;
+    }
+
+    walPath = getenv("TECNICOFS_WAL");      //so can the log
+    tuning = getenv("TECNICOFS_WAL_WINDOW_US");
+    if(tuning) {
+        if(atoi(tuning) < 0) {
+            fprintf(stderr, "TECNICOFS_WAL_WINDOW_US can't be negative\n");
+            exit(EXIT_FAILURE);
+        }
+        walConfig.window_ns = (uint64_t) atoi(tuning) * 1000;
+    }
+    tuning = getenv("TECNICOFS_WAL_GROUP_KB");
+    if(tuning) {
+        if(atoi(tuning) <= 0) {
+            fprintf(stderr, "TECNICOFS_WAL_GROUP_KB must be positive\n");
+            exit(EXIT_FAILURE);
+        }
+        walConfig.group_bytes = (size_t) atoi(tuning) * 1024;
+    }
+    tuning = getenv("TECNICOFS_WAL_MODE");
+    if(tuning) {
+        if(strcmp(tuning, "sync") != 0 && strcmp(tuning, "no-sync") != 0) {
+            fprintf(stderr, "TECNICOFS_WAL_MODE must be sync or no-sync\n");
+            exit(EXIT_FAILURE);
+        }
+        walConfig.sync = strcmp(tuning, "sync") == 0;
+    }
+
+    checkpointPath = getenv("TECNICOFS_CHECKPOINT");     //and the checkpoints
+    tuning = getenv("TECNICOFS_CHECKPOINT_S");
+    if(tuning) {
+        checkpointInterval = atoi(tuning);
+        if(checkpointInterval <= 0) {
+            fprintf(stderr, "TECNICOFS_CHECKPOINT_S must be positive\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 }
 
 FILE* openOutput(char* filename) {        //the output file is opened for writing only
@@ -58,136 +263,1362 @@ FILE* openOutput(char* filename) {        //the output file is opened for writin
     return outputFile;
 }
 
-void* applyCommands() {     //this fuction receives a command from a client and executes the associated function
+uint64_t socketWait(struct msghdr* message) {     //how long a received datagram waited in the socket, from its timestamp
+    struct cmsghdr* header = CMSG_FIRSTHDR(message);
+    if(header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_TIMESTAMPNS) {
+        struct timespec arrival, now;
+        memcpy(&arrival, CMSG_DATA(header), sizeof(arrival));   //the kernel stamps datagrams with the realtime clock
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t waited = (int64_t) (now.tv_sec - arrival.tv_sec) * 1000000000LL + (now.tv_nsec - arrival.tv_nsec);
+        return waited > 0 ? waited : 0;
+    }
+    return 0;
+}
+
+//receives a datagram, storing the sender's address, and computes how long it waited in the socket
+ssize_t receiveCommand(char* command, size_t size, struct sockaddr_un* client, socklen_t* clientLength, uint64_t* queueTime) {
+    struct iovec iov = { command, size - 1 };
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct msghdr message = { client, sizeof(struct sockaddr_un), &iov, 1, control, sizeof(control), 0 };
+    ssize_t received = recvmsg(sockfd, &message, 0);
+    if(received < 0) {
+        return received;
+    }
+    command[received] = '\0';
+    *clientLength = message.msg_namelen;
+    *queueTime = socketWait(&message);
+    return received;
+}
+
+int opOfCommand(char token, char type) {   //returns the operation a command is accounted as, -1 if unknown
+    switch(token) {
+        case 'c':
+            return type == 'd' ? OP_CREATE_DIR : OP_CREATE_FILE;
+        case 'l':
+            return OP_LOOKUP;
+        case 'd':
+            return type == 'r' ? OP_REMOVE : OP_DELETE;
+        case 'm':
+            return OP_MOVE;
+        case 'k':
+            return OP_CLONE;
+        case 'p':
+            return OP_PRINT;
+    }
+    return -1;
+}
+
+//accounts a command to the worker's histograms and counters, result is what the command returned
+void recordLatency(threadStats_t* stats, int op, int result, uint64_t queueTime, uint64_t serviceTime, uint64_t lockTime) {
+    if(op < 0) {
+        __atomic_store_n(&stats->invalid, stats->invalid + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if(lockTime > serviceTime) {
+        lockTime = serviceTime;
+    }
+    if(result < 0) {
+        __atomic_store_n(&stats->errors[op], stats->errors[op] + 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&stats->lockWait, stats->lockWait + lockTime, __ATOMIC_RELAXED);
+    histogram_record(&stats->latency[op][LAT_QUEUE], queueTime);
+    histogram_record(&stats->latency[op][LAT_LOCK], lockTime);
+    histogram_record(&stats->latency[op][LAT_EXEC], serviceTime - lockTime);
+    histogram_record(&stats->latency[op][LAT_TOTAL], queueTime + serviceTime);
+}
+
+void printLatencyReport(FILE* fp) {     //merges the histograms of every worker and prints their percentiles
+    histogram_t* merged = malloc(sizeof(histogram_t));
+    histogram_print_header(fp);
+    for(int op = 0; op < NUM_OPS; op++) {
+        for(int part = 0; part < LAT_PARTS; part++) {
+            char label[64];
+            histogram_reset(merged);
+            for(int i = 0; i < maxThreads; i++) {
+                histogram_merge(merged, &threadStats[i].latency[op][part]);
+            }
+            if(merged->total == 0) {
+                break;      //operations that never happened are left out
+            }
+            snprintf(label, sizeof(label), "%s %s", opNames[op], partNames[part]);
+            histogram_print(fp, label, merged);
+        }
+    }
+    histogram_reset(merged);
+    for(int i = 0; i < maxThreads; i++) {
+        histogram_merge(merged, &threadStats[i].commit);
+    }
+    if(merged->total > 0) {
+        histogram_print(fp, "log commit", merged);
+    }
+    fflush(fp);
+    free(merged);
+}
+
+double elapsedSeconds() {    //time since the server started accepting commands
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - startTime.tv_sec) + (now.tv_nsec - startTime.tv_nsec) / 1e9;
+}
+
+//appends to the counters written so far, as much as fits; length never goes past the last byte of the buffer
+void appendStats(char* buffer, size_t size, size_t* length, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buffer + *length, size - *length, format, args);
+    va_end(args);
+    if(written > 0) {
+        *length = (size_t) written < size - *length ? *length + written : size - 1;
+    }
+}
+
+//writes every counter of the server as "name value" lines, adding up the counters of every worker; the workers
+//keep counting meanwhile, so the values are a snapshot that may be off by the commands running while it is taken
+size_t writeStats(char* buffer, size_t size) {
+    histogram_t* merged = malloc(sizeof(histogram_t));
+    uint64_t lockWait = 0, invalid = 0, datagrams = 0, syscalls = 0;
+    int inodes, directories;
+    size_t dirBytes, blocksUsed, blocksCached, length = 0;
+    if(!merged) {
+        return 0;
+    }
+    inode_table_usage(&inodes, &directories, &dirBytes);
+    file_pool_usage(&blocksUsed, &blocksCached);
+    for(int i = 0; i < maxThreads; i++) {
+        lockWait += __atomic_load_n(&threadStats[i].lockWait, __ATOMIC_RELAXED);
+        invalid += __atomic_load_n(&threadStats[i].invalid, __ATOMIC_RELAXED);
+        datagrams += __atomic_load_n(&threadStats[i].datagrams, __ATOMIC_RELAXED);
+        syscalls += __atomic_load_n(&threadStats[i].syscalls, __ATOMIC_RELAXED);
+    }
+    appendStats(buffer, size, &length, "uptime_seconds %.3f\nstartup_ms %.3f\nthreads %d\nconnections %d\nqueue_depth %d\n",
+        elapsedSeconds(), startupTime / 1e6, maxThreads, __atomic_load_n(&connectionCount, __ATOMIC_RELAXED), __atomic_load_n(&queueLength, __ATOMIC_RELAXED));
+    for(int i = 0; i < NUM_CLASSES; i++) {
+        appendStats(buffer, size, &length, "queue_depth_%s %d\n", classKeys[i], __atomic_load_n(&queues[i].length, __ATOMIC_RELAXED));
+    }
+    appendStats(buffer, size, &length, "inodes_used %d\ninodes_total %d\ndirectories %d\ndir_table_bytes %zu\nremove_pending %d\n",
+        inodes, INODE_TABLE_SIZE, directories, dirBytes, remove_pending());
+    appendStats(buffer, size, &length, "file_block_bytes %d\nfile_blocks_used %zu\nfile_blocks_cached %zu\nfile_blocks_total %d\n",
+        FILE_BLOCK_SIZE, blocksUsed, blocksCached, FILE_POOL_BLOCKS);
+    appendStats(buffer, size, &length, "lock_wait_ns %llu\ninvalid_commands %llu\n",
+        (unsigned long long) lockWait, (unsigned long long) invalid);
+    appendStats(buffer, size, &length, "dgram_requests %llu\ndgram_syscalls %llu\ndgram_syscalls_per_request %.3f\n",
+        (unsigned long long) datagrams, (unsigned long long) syscalls, datagrams ? (double) syscalls / datagrams : 0.0);
+    if(walPath) {
+        wal_counters log;
+        wal_usage(&log);
+        histogram_reset(merged);
+        for(int i = 0; i < maxThreads; i++) {
+            histogram_merge(merged, &threadStats[i].commit);
+        }
+        appendStats(buffer, size, &length, "wal_records %llu\nwal_bytes %llu\nwal_groups %llu\nwal_records_per_group %.2f\n"
+            "wal_replayed %llu\nwal_sync %d\nwal_commits %llu\nwal_durable_ops_per_s %.1f\n",
+            (unsigned long long) log.records, (unsigned long long) log.bytes, (unsigned long long) log.groups,
+            log.groups ? (double) log.records / log.groups : 0.0, (unsigned long long) log.replayed, walConfig.sync,
+            (unsigned long long) merged->total, merged->total / elapsedSeconds());
+        if(merged->total > 0) {
+            appendStats(buffer, size, &length, "wal_commit_p50_us %.1f\nwal_commit_p99_us %.1f\nwal_commit_max_us %.1f\n",
+                histogram_percentile(merged, 50) / 1000.0, histogram_percentile(merged, 99) / 1000.0, merged->max / 1000.0);
+        }
+    }
+    if(checkpointPath) {
+        size_t imageBytes;
+        int pending;
+        image_usage(&imageBytes, &pending);
+        appendStats(buffer, size, &length, "checkpoints %llu\ncheckpoint_bytes %llu\ncheckpoint_last_ms %.3f\n"
+            "image_loaded_bytes %zu\nimage_inodes_pending %d\n",
+            (unsigned long long) __atomic_load_n(&checkpointCount, __ATOMIC_RELAXED),
+            (unsigned long long) __atomic_load_n(&checkpointBytes, __ATOMIC_RELAXED),
+            __atomic_load_n(&checkpointTime, __ATOMIC_RELAXED) / 1e6, imageBytes, pending);
+    }
+    for(int op = 0; op < NUM_OPS && length < size - 1; op++) {     //a full buffer takes nothing more
+        uint64_t errors = 0;
+        histogram_reset(merged);
+        for(int i = 0; i < maxThreads; i++) {
+            histogram_merge(merged, &threadStats[i].latency[op][LAT_TOTAL]);
+            errors += __atomic_load_n(&threadStats[i].errors[op], __ATOMIC_RELAXED);
+        }
+        appendStats(buffer, size, &length, "ops_%s %llu\nerrors_%s %llu\n",
+            opKeys[op], (unsigned long long) merged->total, opKeys[op], (unsigned long long) errors);
+        if(merged->total > 0) {
+            appendStats(buffer, size, &length, "p50_us_%s %.1f\np99_us_%s %.1f\np999_us_%s %.1f\nmax_us_%s %.1f\n",
+                opKeys[op], histogram_percentile(merged, 50) / 1000.0, opKeys[op], histogram_percentile(merged, 99) / 1000.0,
+                opKeys[op], histogram_percentile(merged, 99.9) / 1000.0, opKeys[op], merged->max / 1000.0);
+        }
+    }
+    free(merged);
+    return length;
+}
+
+void printElapsedTime() {
+    struct timespec stopTime;
+    if(clock_gettime(CLOCK_MONOTONIC, &stopTime) != 0) {    //the program obtains its stopping time from the same clock
+        fprintf(stderr, "Couldn't get time\n");
+        exit(EXIT_FAILURE);
+    }
+    double elapsedTime = (stopTime.tv_sec - startTime.tv_sec) + (stopTime.tv_nsec - startTime.tv_nsec) / 1e9;
+    printf("The program ended in %.6f seconds.\n", elapsedTime);
+}
+
+void lockTree(int forPrinting) {     //takes the tree lock, accounting the time spent waiting for it
+    int result = forPrinting ? pthread_rwlock_trywrlock(&treeLock) : pthread_rwlock_tryrdlock(&treeLock);
+    if(result == 0) {
+        return;
+    }
+    uint64_t waitStart = now_ns();
+    result = forPrinting ? pthread_rwlock_wrlock(&treeLock) : pthread_rwlock_rdlock(&treeLock);
+    if(result != 0) {
+        fprintf(stderr, "Couldn't lock rwlock\n");
+        exit(EXIT_FAILURE);
+    }
+    lock_wait_ns += now_ns() - waitStart;
+}
+
+void unlockTree() {
+    if(pthread_rwlock_unlock(&treeLock) != 0) {
+        fprintf(stderr, "Couldn't unlock rwlock\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+//writes the checkpoint while the caller holds the tree lock for writing
+void writeCheckpointLocked() {
+    size_t bytes;
+    uint64_t start = now_ns(), lsn = wal_last();
+    if((walPath && lsn == checkpointLsn) || dump_expire(1) > 0 || remove_pending() > 0) {     //an open dump's copies and what a removal is still freeing must not be saved, the log keeps everything meanwhile
+        return;
+    }
+    if(inode_table_save(checkpointPath, lsn, &bytes) == FAIL || wal_truncate(lsn) == FAIL) {
+        fprintf(stderr, "Couldn't write the checkpoint %s\n", checkpointPath);   //the log keeps every change, nothing is lost
+    }
+    else {
+        checkpointLsn = lsn;
+        __atomic_store_n(&checkpointCount, checkpointCount + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&checkpointBytes, bytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&checkpointTime, now_ns() - start, __ATOMIC_RELAXED);
+    }
+}
+
+//writes the tree to the checkpoint image and empties the log, which the image then holds; changes wait meanwhile,
+//like they do for a print, while lookups and reads go on; nothing is written if nothing changed since the last image
+void writeCheckpoint() {
+    lockTree(1);
+    writeCheckpointLocked();
+    unlockTree();
+}
+
+void* checkpointPeriodically(void* arg) {
     while(1) {
-        char* command = malloc(sizeof(char) * 100);
-        int numTokens;
-        char token, type;
-        char name[MAX_INPUT_SIZE];
-        char name2[MAX_INPUT_SIZE];
-        if(recvfrom(sockfd, command, sizeof(char) * 100, 0, (struct sockaddr *) &local, &clilen) < 0) {
+        sleep(checkpointInterval);
+        writeCheckpoint();
+    }
+    return NULL;
+}
+
+void* handleSignals(void* arg) {    //SIGUSR1 prints the latency report, SIGINT and SIGTERM print it and shut the server down
+    sigset_t* signals = (sigset_t*) arg;
+    int received;
+    while(1) {
+        if(sigwait(signals, &received) != 0) {
+            continue;
+        }
+        if(received == SIGUSR1) {
+            printLatencyReport(stdout);
+            continue;
+        }
+        printElapsedTime();
+        printLatencyReport(stdout);
+        unlink(nomeSocket);
+        lockTree(1);        //held until the exit, no change starts after the last one the log commits
+        if(checkpointPath) {
+            writeCheckpointLocked();      //the next start loads the image instead of replaying the log
+        }
+        wal_close();        //the changes logged so far are committed; a change logged later fails to commit and gets no reply
+        exit(EXIT_SUCCESS);
+    }
+    return NULL;
+}
+
+//executes a command, the operation it is accounted as is stored in op (-1 if the command is invalid),
+//treeLocked is set when the caller already holds the tree lock for the command
+int executeCommand(char token, char type, char* name, char* name2, int* op, int treeLocked) {
+    *op = -1;
+    if(!token || !strchr("cldmkp", token) || (token == 'c' && type != 'f' && type != 'd') || ((token == 'm' || token == 'k') && !name2)
+       || (token == 'k' && type && type != 's')) {
+        fprintf(stderr, "Error: invalid command received\n");     //a malformed request only fails for the client that sent it
+        return FAIL;
+    }
+    else if(token != 'l' && !treeLocked) {
+        lockTree(token == 'p' || token == 'k');     //every thread with modifying behavior waits until the program finishes printing
+    }
+
+    int result = 0;        //this variable saves the output of the applied command an it is sent back to the client as a reply
+    switch (token) {      //there are 5 different types of commands: c (create), d (delete), l (lookup), m (move) and p (print)
+        case 'c':
+            switch (type) {
+                case 'f':
+                    printf("Create file: %s\n", name);
+                    result = create(name, T_FILE);
+                    break;
+                case 'd':
+                    printf("Create directory: %s\n", name);
+                    result = create(name, T_DIRECTORY);
+                    break;
+            }
+            break;
+        case 'l':       
+            result = lookup(name);
+            if (result >= 0)
+                printf("Search: %s found\n", name);
+            else
+                printf("Search: %s not found\n", name);
+            break;
+        case 'd':       
+            if(type == 'r') {       //"d path r" removes a directory with everything below it, freed in the background
+                printf("Remove: %s\n", name);
+                result = remove_tree(name);
+                break;
+            }
+            printf("Delete: %s\n", name);
+            result = delete(name);
+            break;
+        case 'm':
+            printf("Move: %s to %s\n", name, name2);
+            result = move(name, name2);
+            break;
+        case 'k':       //like a print, a clone keeps every other change out, writes to opened files included
+            printf("Clone: %s to %s\n", name, name2);
+            result = clone_tree(name, name2, type == 's');
+            break;
+        case 'p': {     //the tree lock is held for writing, so no other task modifies the tree while it is printed
+            FILE* outputFile = openOutput(name);
+            result = print_tecnicofs_tree(outputFile, maxThreads);      //the dump may use as many threads as serve requests
+            if(fclose(outputFile) != 0) {
+                result = FAIL;
+            }
+            break;
+        }
+    }
+    if(token != 'l' && !treeLocked) {
+        unlockTree();
+    }
+    *op = opOfCommand(token, type);
+    return result;
+}
+
+//parses a text command, applies it and writes the reply for the client ("error" if the command is malformed), returns its result
+int applyCommand(char* command, char* reply, size_t replySize, int* op, int treeLocked) {
+    int numTokens;
+    char token, type = 0;
+    char name[MAX_INPUT_SIZE];
+    char name2[MAX_INPUT_SIZE];
+    if(command[0] == 'm'){
+        numTokens = sscanf(command, "%c %99s %99s", &token, name, name2);
+    }
+    else if(command[0] == 'k') {        //"k from to", or "k from to s" for a snapshot
+        numTokens = sscanf(command, "%c %99s %99s %c", &token, name, name2, &type);
+    }
+    else if(command[0] == 'p') {
+        numTokens = sscanf(command, "%c %99s", &token, name);
+    }
+    else {
+        numTokens = sscanf(command, "%c %99s %c", &token, name, &type);
+    }
+    if(numTokens < 2) {
+        fprintf(stderr, "Error: invalid command received\n");
+        *op = -1;
+        snprintf(reply, replySize, "error");
+        return FAIL;
+    }
+    int result = executeCommand(token, type, name, numTokens >= 3 ? name2 : NULL, op, treeLocked);
+    if(*op < 0) {
+        snprintf(reply, replySize, "error");
+    }
+    else {
+        snprintf(reply, replySize, "%d", result);
+    }
+    return result;
+}
+
+//applies every command of a batch ("b\ncommand\ncommand..."), taking the tree lock only once,
+//and replies with the results separated by spaces, in the order of the commands
+void applyBatch(char* batch, char* reply, size_t replySize, threadStats_t* stats, uint64_t queueTime) {
+    char* commands[MAX_BATCH_SIZE];
+    int numberCommands = 0, printing = 0;
+    char* savePtr;
+    for(char* command = strtok_r(batch + 1, "\n", &savePtr); command; command = strtok_r(NULL, "\n", &savePtr)) {
+        if(numberCommands == MAX_BATCH_SIZE) {
+            fprintf(stderr, "Error: batch too long\n");
+            snprintf(reply, replySize, "error");
+            return;
+        }
+        printing |= command[0] == 'p' || command[0] == 'k';
+        commands[numberCommands++] = command;
+    }
+
+    uint64_t lockStart = now_ns();
+    lockTree(printing);         //the whole batch is one dispatch, a print or clone in it excludes every other modification
+    uint64_t lockTime = now_ns() - lockStart;
+    size_t length = 0;
+    reply[0] = '\0';
+    for(int i = 0; i < numberCommands; i++) {
+        char result[MAX_RESULT_SIZE];
+        int op;
+        uint64_t serviceStart = now_ns();
+        lock_wait_ns = 0;
+        int value = applyCommand(commands[i], result, sizeof(result), &op, 1);
+        length += snprintf(reply + length, replySize - length, i == 0 ? "%s" : " %s", result);
+        recordLatency(stats, op, value, queueTime, now_ns() - serviceStart + lockTime, lock_wait_ns + lockTime);
+        lockTime = 0;       //the tree lock wait is accounted to the first command
+    }
+    unlockTree();
+}
+
+size_t binaryMessageSize(tfs_request* header) {     //the header of a binary request tells how long the whole request is
+    return sizeof(tfs_request) + header->length1 + (header->opcode == TFS_OP_BATCH ? 0 : header->length2);
+}
+
+//copies the header of the binary request at the start of the available bytes,
+//returns the size of the request or 0 if it is malformed or doesn't fit
+size_t decodeRequest(const char* request, size_t available, tfs_request* header) {
+    if(available < sizeof(tfs_request)) {
+        return 0;
+    }
+    memcpy(header, request, sizeof(tfs_request));   //requests in a batch aren't aligned
+    size_t size = binaryMessageSize(header);
+    return header->version == TFS_PROTOCOL_BYTE && size <= available ? size : 0;
+}
+
+//applies a binary request whose paths follow its header, the paths are copied so they can be NUL-terminated
+int applyBinaryCommand(tfs_request* header, const char* paths, int* op, int treeLocked) {
+    char name[header->length1 + 1], name2[header->length2 + 1];
+    char tokens[] = { 0, 'c', 'l', 'd', 'm', 'p' };     //indexed by opcode
+    memcpy(name, paths, header->length1);
+    name[header->length1] = '\0';
+    memcpy(name2, paths + header->length1, header->length2);
+    name2[header->length2] = '\0';
+    char token = header->opcode < sizeof(tokens) ? tokens[header->opcode] : header->opcode == TFS_OP_CLONE ? 'k' : 0;
+    char type = header->flags & TFS_FLAG_DIRECTORY ? 'd' : 'f';
+    if(token == 'k') {
+        type = header->flags & TFS_FLAG_SNAPSHOT ? 's' : 0;
+    }
+    else if(token == 'd' && header->flags & TFS_FLAG_RECURSIVE) {
+        type = 'r';
+    }
+    return executeCommand(token, type, name, token == 'm' || token == 'k' ? name2 : NULL, op, treeLocked);
+}
+
+//applies every request of a binary batch with the tree lock taken once, the reply carries one result per request
+size_t applyBinaryBatch(tfs_request* batch, const char* requests, char* replyBuffer, size_t replySize, threadStats_t* stats, uint64_t queueTime) {
+    tfs_reply reply = { TFS_PROTOCOL_BYTE, TFS_OP_BATCH, TFS_REPLY_ERROR, batch->id, 0 };
+    tfs_request headers[MAX_BATCH_SIZE];
+    const char* paths[MAX_BATCH_SIZE];
+    int numberCommands = batch->length2, printing = 0;
+    size_t offset = 0;
+    for(int i = 0; i < numberCommands && numberCommands <= MAX_BATCH_SIZE; i++) {
+        size_t size = decodeRequest(requests + offset, batch->length1 - offset, &headers[i]);
+        if(!size || headers[i].opcode == TFS_OP_BATCH) {
+            break;
+        }
+        paths[i] = requests + offset + sizeof(tfs_request);
+        printing |= headers[i].opcode == TFS_OP_PRINT || headers[i].opcode == TFS_OP_CLONE;
+        offset += size;
+        if(i == numberCommands - 1 && offset == batch->length1) {
+            reply.flags = 0;    //every request was decoded and nothing is left over
+        }
+    }
+    if(reply.flags || sizeof(tfs_reply) + numberCommands * sizeof(int32_t) > replySize) {
+        fprintf(stderr, "Error: invalid batch received\n");
+        reply.flags = TFS_REPLY_ERROR;
+        memcpy(replyBuffer, &reply, sizeof(reply));
+        return sizeof(reply);
+    }
+
+    uint64_t lockStart = now_ns();
+    lockTree(printing);         //the whole batch is one dispatch, a print or clone in it excludes every other modification
+    uint64_t lockTime = now_ns() - lockStart;
+    for(int i = 0; i < numberCommands; i++) {
+        int op;
+        uint64_t serviceStart = now_ns();
+        lock_wait_ns = 0;
+        int32_t result = applyBinaryCommand(&headers[i], paths[i], &op, 1);
+        memcpy(replyBuffer + sizeof(tfs_reply) + i * sizeof(int32_t), &result, sizeof(result));
+        recordLatency(stats, op, result, queueTime, now_ns() - serviceStart + lockTime, lock_wait_ns + lockTime);
+        lockTime = 0;       //the tree lock wait is accounted to the first command
+    }
+    unlockTree();
+    reply.result = numberCommands;
+    memcpy(replyBuffer, &reply, sizeof(reply));
+    return sizeof(tfs_reply) + numberCommands * sizeof(int32_t);
+}
+
+//applies a read, write, truncate or stat and records its latencies, returns the size of the reply; the bytes of a read
+//follow the header, copied into the reply or, when a view is given, left in the file's extents for the caller to send
+//from the view, with the file locked until the caller releases it; a file opened by the client is named by its args
+size_t applyFileRequest(tfs_request* header, const char* paths, char* replyBuffer, size_t replySize, file_view* view, threadStats_t* stats, uint64_t queueTime) {
+    tfs_reply reply = { TFS_PROTOCOL_BYTE, header->opcode, 0, header->id, FAIL };
+    tfs_file_args args;
+    tfs_stat attributes;
+    char name[header->length1 + 1];
+    file_id file = { name, 0, 0, 0 };
+    int op = -1;
+    uint64_t serviceStart = now_ns();
+    lock_wait_ns = 0;
+    memcpy(name, paths, header->length1);
+    name[header->length1] = '\0';
+    if(header->length2 >= sizeof(args)) {      //a shorter request is refused below without reading its args
+        memcpy(&args, paths + header->length1, sizeof(args));
+        if(header->flags & TFS_FLAG_HANDLE) {      //an opened file, its path isn't looked up
+            file = (file_id) { NULL, args.inumber, args.generation, args.epoch };
+        }
+    }
+    if(header->length2 < sizeof(args) || header->length2 - sizeof(args) != (header->opcode == TFS_OP_WRITE ? args.length : 0)
+       || ((header->flags & TFS_FLAG_HANDLE) && header->length1)
+       || (header->opcode == TFS_OP_READ && (args.length > TFS_MAX_READ_SIZE || (!view && args.length > replySize - sizeof(reply))))) {
+        fprintf(stderr, "Error: invalid file request received\n");
+        reply.flags = TFS_REPLY_ERROR;
+    }
+    else if(header->opcode == TFS_OP_READ) {       //like lookups, reads and stats don't wait for a print
+        op = OP_READ;
+        if(view) {
+            reply.result = open_file_view(&file, args.offset, args.length, view);
+        }
+        else {
+            reply.result = read_file(&file, args.offset, replyBuffer + sizeof(reply), args.length);
+        }
+    }
+    else if(header->opcode == TFS_OP_STAT) {
+        type nType;
+        size_t size;
+        op = OP_STAT;
+        if(header->flags & TFS_FLAG_UNSHARE) {      //copying what a clone shares changes the tree
+            lockTree(0);
+            reply.result = stat_file(&file, &nType, &size, 1);
+            unlockTree();
+        }
+        else {
+            reply.result = stat_file(&file, &nType, &size, 0);
+        }
+        attributes = (tfs_stat) { size, nType, file.generation, file.epoch, 0 };
+        memcpy(replyBuffer + sizeof(reply), &attributes, sizeof(attributes));
+    }
+    else {
+        op = header->opcode == TFS_OP_WRITE ? OP_WRITE : OP_TRUNCATE;
+        lockTree(0);
+        if(op == OP_WRITE) {
+            reply.result = write_file(&file, args.offset, paths + header->length1 + sizeof(args), args.length, header->flags & TFS_FLAG_APPEND);
+            reply.result = reply.result < 0 ? reply.result : (int32_t) args.length;
+        }
+        else {
+            reply.result = truncate_file(&file, args.offset);
+        }
+        unlockTree();
+    }
+    if(reply.result == STALE) {     //opened before a clone, the client opens it again
+        reply.result = FAIL;
+        reply.flags = TFS_REPLY_STALE;
+    }
+    recordLatency(stats, op, reply.result, queueTime, now_ns() - serviceStart, lock_wait_ns);
+    memcpy(replyBuffer, &reply, sizeof(reply));
+    if(op == OP_STAT) {
+        return sizeof(reply) + (reply.result == FAIL ? 0 : sizeof(attributes));
+    }
+    return sizeof(reply) + (op == OP_READ && !view && reply.result > 0 ? reply.result : 0);
+}
+
+//reads the next bytes of a dump into the reply, after its tfs_dump_args, starting the dump first if the request has no cursor;
+//only starting it waits for prints and keeps changes out, the reading itself walks a copy of the tree no change touches
+size_t applyDumpRequest(tfs_request* header, const char* paths, char* replyBuffer, size_t replySize, threadStats_t* stats, uint64_t queueTime) {
+    tfs_reply reply = { TFS_PROTOCOL_BYTE, header->opcode, 0, header->id, FAIL };
+    tfs_dump_args args;
+    int end = 0;
+    uint64_t serviceStart = now_ns();
+    lock_wait_ns = 0;
+    memcpy(&args, paths + header->length1, header->length2 == sizeof(args) ? sizeof(args) : 0);
+    if(header->length1 || header->length2 != sizeof(args) || args.length > TFS_MAX_DUMP_SIZE
+       || sizeof(reply) + sizeof(args) + args.length > replySize) {
+        fprintf(stderr, "Error: invalid dump request received\n");
+        reply.flags = TFS_REPLY_ERROR;
+        memcpy(replyBuffer, &reply, sizeof(reply));
+        return sizeof(reply);
+    }
+    reply.result = SUCCESS;
+    if(args.cursor == 0) {
+        lockTree(1);
+        reply.result = dump_open(&args.cursor);
+        unlockTree();
+    }
+    if(reply.result != FAIL) {
+        lockTree(0);        //a print or checkpoint sees no dump half read or released
+        if(args.length == 0) {
+            reply.result = dump_close(args.cursor);
+            end = 1;
+        }
+        else {
+            reply.result = dump_read(args.cursor, replyBuffer + sizeof(reply) + sizeof(args), args.length, &end);
+        }
+        unlockTree();
+    }
+    recordLatency(stats, OP_DUMP, reply.result, queueTime, now_ns() - serviceStart, lock_wait_ns);
+    if(reply.result == FAIL) {
+        memcpy(replyBuffer, &reply, sizeof(reply));
+        return sizeof(reply);
+    }
+    reply.flags = end ? TFS_REPLY_END : 0;
+    args.length = reply.result;
+    memcpy(replyBuffer, &reply, sizeof(reply));
+    memcpy(replyBuffer + sizeof(reply), &args, sizeof(args));
+    return sizeof(reply) + sizeof(args) + reply.result;
+}
+
+//lists the next page of a directory into the reply, after its tfs_readdir_args; like a lookup it doesn't wait for prints
+size_t applyReaddirRequest(tfs_request* header, const char* paths, char* replyBuffer, size_t replySize, threadStats_t* stats, uint64_t queueTime) {
+    tfs_reply reply = { TFS_PROTOCOL_BYTE, header->opcode, 0, header->id, FAIL };
+    tfs_readdir_args args;
+    char name[header->length1 + 1];
+    uint64_t serviceStart = now_ns();
+    lock_wait_ns = 0;
+    memcpy(name, paths, header->length1);
+    name[header->length1] = '\0';
+    memcpy(&args, paths + header->length1, header->length2 == sizeof(args) ? sizeof(args) : 0);
+    if(header->length2 != sizeof(args) || args.count > TFS_MAX_READDIR
+       || sizeof(reply) + sizeof(args) + args.count * (sizeof(tfs_dirent) + MAX_FILE_NAME) > replySize) {
+        fprintf(stderr, "Error: invalid readdir request received\n");
+        reply.flags = TFS_REPLY_ERROR;
+        memcpy(replyBuffer, &reply, sizeof(reply));
+        return sizeof(reply);
+    }
+    DirEntry entries[args.count + 1];
+    type types[args.count + 1];
+    reply.result = read_dir(name, &args.cursor, entries, types, args.count);
+    recordLatency(stats, OP_READDIR, reply.result, queueTime, now_ns() - serviceStart, lock_wait_ns);
+    if(reply.result == FAIL) {
+        memcpy(replyBuffer, &reply, sizeof(reply));
+        return sizeof(reply);
+    }
+    size_t length = sizeof(reply) + sizeof(args);
+    for(int i = 0; i < reply.result; i++) {    //names are shorter than MAX_FILE_NAME, so the page fits
+        tfs_dirent entry = { types[i], strnlen(entries[i].name, MAX_FILE_NAME - 1) };
+        memcpy(replyBuffer + length, &entry, sizeof(entry));
+        memcpy(replyBuffer + length + sizeof(entry), entries[i].name, entry.length);
+        length += sizeof(entry) + entry.length;
+    }
+    reply.flags = args.cursor == MAX_DIR_ENTRIES ? TFS_REPLY_END : 0;
+    args.count = length - sizeof(reply) - sizeof(args);
+    memcpy(replyBuffer, &reply, sizeof(reply));
+    memcpy(replyBuffer + sizeof(reply), &args, sizeof(args));
+    return length;
+}
+
+size_t applyBinaryRequest(char* request, size_t length, char* replyBuffer, size_t replySize, file_view* view, threadStats_t* stats, uint64_t queueTime) {   //returns the size of the reply
+    tfs_request header;
+    tfs_reply reply = { TFS_PROTOCOL_BYTE, 0, 0, 0, 0 };
+    size_t size = decodeRequest(request, length, &header);
+    if(!size) {
+        reply.flags = ((uint8_t) request[0]) != TFS_PROTOCOL_BYTE ? TFS_REPLY_BAD_VERSION : TFS_REPLY_ERROR;
+        if(length >= sizeof(tfs_request)) {
+            reply.opcode = header.opcode;
+            reply.id = header.id;
+        }
+        fprintf(stderr, "Error: invalid binary request received\n");
+    }
+    else if(header.opcode == TFS_OP_STATS) {
+        reply.opcode = header.opcode;
+        reply.id = header.id;
+        reply.result = writeStats(replyBuffer + sizeof(reply), replySize - sizeof(reply));
+        memcpy(replyBuffer, &reply, sizeof(reply));
+        return sizeof(reply) + reply.result;
+    }
+    else if(header.opcode == TFS_OP_BATCH) {
+        return applyBinaryBatch(&header, request + sizeof(tfs_request), replyBuffer, replySize, stats, queueTime);
+    }
+    else if(header.opcode == TFS_OP_READ || header.opcode == TFS_OP_WRITE || header.opcode == TFS_OP_TRUNCATE
+            || header.opcode == TFS_OP_STAT) {
+        return applyFileRequest(&header, request + sizeof(tfs_request), replyBuffer, replySize, view, stats, queueTime);
+    }
+    else if(header.opcode == TFS_OP_DUMP) {
+        return applyDumpRequest(&header, request + sizeof(tfs_request), replyBuffer, replySize, stats, queueTime);
+    }
+    else if(header.opcode == TFS_OP_READDIR) {
+        return applyReaddirRequest(&header, request + sizeof(tfs_request), replyBuffer, replySize, stats, queueTime);
+    }
+    else {
+        int op;
+        uint64_t serviceStart = now_ns();
+        lock_wait_ns = 0;
+        reply.opcode = header.opcode;
+        reply.id = header.id;
+        reply.result = applyBinaryCommand(&header, request + sizeof(tfs_request), &op, 0);
+        reply.flags = op < 0 ? TFS_REPLY_ERROR : 0;
+        recordLatency(stats, op, reply.result, queueTime, now_ns() - serviceStart, lock_wait_ns);
+    }
+    memcpy(replyBuffer, &reply, sizeof(reply));
+    return sizeof(reply);
+}
+
+//applies a command or a batch of either protocol and records its latencies, returns the size of the reply; with a view,
+//the data of a read is left in the file (see applyFileRequest) and the view must be released once the reply is sent
+size_t dispatchRequest(char* request, size_t length, char* reply, size_t replySize, file_view* view, threadStats_t* stats, uint64_t queueTime) {
+    if(view) {
+        view->open = 0;
+    }
+    if((uint8_t) request[0] & TFS_PROTOCOL_MAGIC) {
+        return applyBinaryRequest(request, length, reply, replySize, view, stats, queueTime);
+    }
+    if(request[0] == 'b' && (request[1] == '\n' || request[1] == '\0')) {
+        applyBatch(request, reply, replySize, stats, queueTime);
+        return strlen(reply) + 1;
+    }
+    int op;
+    uint64_t serviceStart = now_ns();
+    lock_wait_ns = 0;
+    int result = applyCommand(request, reply, replySize, &op, 0);
+    recordLatency(stats, op, result, queueTime, now_ns() - serviceStart, lock_wait_ns);
+    return strlen(reply) + 1;
+}
+
+//describes a reply as iovecs: its header and results, then the data of a read left in the file, returns their number
+int replyVector(struct iovec* iov, char* reply, size_t length, file_view* view) {
+    iov[0] = (struct iovec) { reply, length };
+    if(!view || !view->open) {
+        return 1;
+    }
+    memcpy(iov + 1, view->iov, view->count * sizeof(struct iovec));
+    return 1 + view->count;
+}
+
+//copies what is left to send of a reply into its buffer, the data of a read left in the file included, and releases the
+//file, so a reply that can't leave right away doesn't keep the file's writers waiting; the buffer holds the longest reply
+void gatherReply(struct msghdr* message, char* reply, file_view* view) {
+    size_t length = 0;
+    for(size_t i = 0; i < message->msg_iovlen; i++) {     //the header may sit further into the buffer, it moves first
+        memmove(reply + length, message->msg_iov[i].iov_base, message->msg_iov[i].iov_len);
+        length += message->msg_iov[i].iov_len;
+    }
+    release_file_view(view);
+    message->msg_iov[0] = (struct iovec) { reply, length };
+    message->msg_iovlen = 1;
+}
+
+typedef struct datagramBatch {  //the buffers a worker receives a batch of datagrams into and answers them from
+    struct mmsghdr requests[MAX_RECV_BATCH];
+    struct mmsghdr replies[MAX_RECV_BATCH];
+    struct iovec requestData[MAX_RECV_BATCH];
+    struct iovec replyData[MAX_RECV_BATCH][1 + FILE_VIEW_EXTENTS];     //a reply's header, then the data of a read
+    struct sockaddr_un clients[MAX_RECV_BATCH];
+    char control[MAX_RECV_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+    char* commands;         //recvBatch requests of MAX_REQUEST_SIZE, only the pages long requests reach are ever touched
+    char* reply;            //recvBatch replies of MAX_REPLY_SIZE
+    file_view view;         //the file a read is sent from, locked until its reply leaves
+} datagramBatch_t;
+
+//receives up to recvBatch datagrams with one system call, waiting only for the first; with a busy-poll window the
+//worker keeps polling the socket without sleeping for that long, so a request arriving meanwhile costs no wakeup
+int receiveBatch(datagramBatch_t* batch, threadStats_t* stats) {
+    for(int i = 0; i < recvBatch; i++) {        //the kernel overwrites the lengths, they are reset for every receive
+        batch->requestData[i] = (struct iovec) { batch->commands + (size_t) i * MAX_REQUEST_SIZE, MAX_REQUEST_SIZE - 1 };
+        batch->requests[i].msg_hdr = (struct msghdr) { &batch->clients[i], sizeof(struct sockaddr_un), &batch->requestData[i], 1,
+                                                      batch->control[i], sizeof(batch->control[i]), 0 };
+    }
+    uint64_t deadline = busyPoll ? now_ns() + busyPoll : 0;
+    while(1) {
+        int flags = deadline && now_ns() < deadline ? MSG_DONTWAIT : MSG_WAITFORONE;
+        int received = recvmmsg(sockfd, batch->requests, recvBatch, flags, NULL);
+        __atomic_store_n(&stats->syscalls, stats->syscalls + 1, __ATOMIC_RELAXED);
+        if(received > 0) {
+            __atomic_store_n(&stats->datagrams, stats->datagrams + received, __ATOMIC_RELAXED);
+            return received;
+        }
+        if(received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+//holds a reply until the changes the worker made since its last reply are durable in the log, a worker that changed
+//nothing doesn't wait; the wait is recorded as the commit latency
+void commitChanges(threadStats_t* stats) {
+    uint64_t start = now_ns();
+    int committed = wal_commit();
+    if(committed < 0) {     //the log closed before the change reached it, the server is exiting and the reply must never be sent
+        pthread_exit(NULL);
+    }
+    if(committed) {
+        histogram_record(&stats->commit, now_ns() - start);
+    }
+}
+
+//sends the replies first to count-1 of a batch with as few system calls as the socket allows, skipping a client that is gone;
+//they wait together for the changes of the batch to be durable; when the last one reads a file, the file stays locked only
+//while its reply leaves without waiting, otherwise its data is copied out first
+void sendBatch(datagramBatch_t* batch, int first, int count, threadStats_t* stats) {
+    int sent = first;
+    if(batch->view.open && wal_pending) {
+        gatherReply(&batch->replies[count - 1].msg_hdr, batch->reply + (size_t) (count - 1) * MAX_REPLY_SIZE, &batch->view);
+    }
+    commitChanges(stats);
+    while(sent < count) {
+        int done = sendmmsg(sockfd, batch->replies + sent, count - sent, batch->view.open ? MSG_DONTWAIT : 0);
+        __atomic_store_n(&stats->syscalls, stats->syscalls + 1, __ATOMIC_RELAXED);
+        if(done < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {     //a client's queue is full, the rest wait without the file
+            gatherReply(&batch->replies[count - 1].msg_hdr, batch->reply + (size_t) (count - 1) * MAX_REPLY_SIZE, &batch->view);
+            continue;
+        }
+        if(done < 0) {      //the first reply left failed, the others still go
+            if(errno != EINTR) {
+                sent++;
+            }
+            continue;
+        }
+        sent += done;
+    }
+}
+
+void* applyCommands(void* arg) {     //this fuction receives commands from clients and executes the associated functions
+    threadStats_t* stats = &threadStats[(intptr_t) arg];
+    datagramBatch_t* batch = calloc(1, sizeof(datagramBatch_t));
+    if(!batch || !(batch->commands = malloc((size_t) recvBatch * MAX_REQUEST_SIZE)) || !(batch->reply = malloc((size_t) recvBatch * MAX_REPLY_SIZE))) {
+        fprintf(stderr, "Couldn't allocate request buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    while(1) {
+        int received = receiveBatch(batch, stats);
+        if(received < 0) {
             perror("Receive Error");
-            free(command);
-            return NULL;
+            break;
+        }
+        int first = 0;
+        for(int i = 0; i < received; i++) {     //the replies go out together once every request of the batch is applied
+            char* command = batch->commands + (size_t) i * MAX_REQUEST_SIZE;
+            char* reply = batch->reply + (size_t) i * MAX_REPLY_SIZE;
+            struct msghdr* request = &batch->requests[i].msg_hdr;
+            command[batch->requests[i].msg_len] = '\0';
+            size_t replyLength = dispatchRequest(command, batch->requests[i].msg_len, reply, MAX_REPLY_SIZE, &batch->view, stats, socketWait(request));
+            int pieces = replyVector(batch->replyData[i], reply, replyLength, &batch->view);
+            batch->replies[i].msg_hdr = (struct msghdr) { &batch->clients[i], request->msg_namelen, batch->replyData[i], pieces, NULL, 0, 0 };
+            if(batch->view.open) {      //a read's file stays locked only until its reply is sent, a later request may write it
+                sendBatch(batch, first, i + 1, stats);
+                release_file_view(&batch->view);
+                first = i + 1;
+            }
+        }
+        sendBatch(batch, first, received, stats);
+    }
+    free(batch->commands);
+    free(batch->reply);
+    free(batch);
+    return NULL;
+}
+
+void closePassed(connection_t* connection) {    //closes the descriptors the client passed and no request took
+    for(int i = 0; i < connection->passedCount; i++) {
+        close(connection->passed[i]);
+    }
+    connection->passedCount = 0;
+}
+
+void releaseConnection(connection_t* connection) {  //drops a reference, the last one closes the connection
+    if(__atomic_sub_fetch(&connection->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if(connection->ring) {
+            munmap(connection->ring, sizeof(tfs_shm_ring));
+            close(connection->doorbell);
+            close(connection->wakeup);
+        }
+        closePassed(connection);
+        close(connection->fd);
+        pthread_mutex_destroy(&connection->writeLock);
+        free(connection->buffer);
+        free(connection);
+    }
+}
+
+int classOf(request_t* request) {   //the queue a request waits in
+    if(!priorities || request->drain) {
+        return CLASS_LOOKUP;    //a ring is served as a whole, whatever its requests are
+    }
+    if((uint8_t) request->command[0] & TFS_PROTOCOL_MAGIC) {
+        uint8_t opcode = request->length < sizeof(tfs_request) ? 0 : request->command[1];    //a malformed request is a mutation
+        return opcode == TFS_OP_LOOKUP || opcode == TFS_OP_STATS || opcode == TFS_OP_READ || opcode == TFS_OP_STAT
+               || opcode == TFS_OP_READDIR ? CLASS_LOOKUP : opcode == TFS_OP_PRINT || opcode == TFS_OP_DUMP ? CLASS_DUMP : CLASS_MUTATION;
+    }
+    return request->command[0] == 'l' ? CLASS_LOOKUP : request->command[0] == 'p' ? CLASS_DUMP : CLASS_MUTATION;
+}
+
+request_t* newRequest(const char* command, size_t length) {     //copies a complete request, NUL-terminated
+    request_t* request = malloc(sizeof(request_t) + length + 1);
+    if(!request) {
+        fprintf(stderr, "Couldn't allocate request\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(request->command, command, length);
+    request->command[length] = '\0';
+    request->length = length;
+    request->drain = 0;
+    request->connection = NULL;
+    request->arrival = now_ns();
+    request->next = NULL;
+    return request;
+}
+
+void pushRequest(request_t* request) {      //queues a request in the queue of its class
+    requestQueue_t* queue = &queues[classOf(request)];
+    pthread_mutex_lock(&queueLock);
+    if(queue->tail) {
+        queue->tail->next = request;
+    }
+    else {
+        queue->head = request;
+    }
+    queue->tail = request;
+    __atomic_store_n(&queue->length, queue->length + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&queueLength, queueLength + 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&queueNotEmpty);
+    pthread_mutex_unlock(&queueLock);
+}
+
+void enqueueRequest(connection_t* connection, const char* command, size_t length, int drain) {    //hands a complete request, or a ring to serve, to the workers
+    request_t* request = newRequest(command, length);
+    request->drain = drain;
+    request->connection = connection;
+    __atomic_add_fetch(&connection->refs, 1, __ATOMIC_RELAXED);
+    pushRequest(request);
+}
+
+//waits for a request and takes it from the queue of a class, chosen by smooth weighted round robin: every class with
+//requests waiting earns its weight in credit, the richest one is served and pays what they all earned; under a
+//backlog each class gets its weight's share of the dispatches, evenly interleaved, and an idle class takes nothing
+request_t* dequeueRequest() {
+    pthread_mutex_lock(&queueLock);
+    while(queueLength == 0) {
+        pthread_cond_wait(&queueNotEmpty, &queueLock);
+    }
+    requestQueue_t* chosen = NULL;
+    int earned = 0;
+    for(int i = 0; i < NUM_CLASSES; i++) {
+        if(queues[i].head) {
+            queues[i].credit += queues[i].weight;
+            earned += queues[i].weight;
+            if(!chosen || queues[i].credit > chosen->credit) {
+                chosen = &queues[i];
+            }
+        }
+    }
+    chosen->credit -= earned;
+    request_t* request = chosen->head;
+    chosen->head = request->next;
+    if(!chosen->head) {
+        chosen->tail = NULL;
+    }
+    __atomic_store_n(&chosen->length, chosen->length - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&queueLength, queueLength - 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&queueLock);
+    return request;
+}
+
+//writes a reply and the data of a read left in the file, if any, replies of different workers are never interleaved
+void sendReply(connection_t* connection, char* reply, size_t length, file_view* view) {
+    struct iovec iov[1 + FILE_VIEW_EXTENTS];
+    struct msghdr message = { NULL, 0, iov, replyVector(iov, reply, length, view), NULL, 0, 0 };
+    pthread_mutex_lock(&connection->writeLock);
+    while(message.msg_iovlen > 0) {
+        ssize_t written = sendmsg(connection->fd, &message, MSG_NOSIGNAL);
+        if(written >= 0) {
+            while(message.msg_iovlen > 0 && (size_t) written >= message.msg_iov->iov_len) {     //a stream may take part of it
+                written -= message.msg_iov->iov_len;
+                message.msg_iov++;
+                message.msg_iovlen--;
+            }
+            if(message.msg_iovlen > 0) {
+                message.msg_iov->iov_base = (char*) message.msg_iov->iov_base + written;
+                message.msg_iov->iov_len -= written;
+            }
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK) {     //the client isn't reading, only this connection waits
+            struct pollfd writable = { connection->fd, POLLOUT, 0 };
+            if(view && view->open) {
+                gatherReply(&message, reply, view);
+            }
+            poll(&writable, 1, -1);
         }
-        else if(command[0] == 'm'){
-            numTokens = sscanf(command, "%c %s %s", &token, name, name2);
+        else if(errno != EINTR) {
+            break;      //the client is gone, the reactor closes the connection
         }
-        else if(command[0] == 'p') {
-            numTokens = sscanf(command, "%c %s", &token, name);
+    }
+    pthread_mutex_unlock(&connection->writeLock);
+}
+
+//applies the request in a slot of a ring and writes the reply over it, returns 0 unless the client broke the protocol
+int serveSlot(connection_t* connection, tfs_shm_slot* slot, char* reply, threadStats_t* stats) {
+    char request[sizeof(slot->data)];       //copied first, so the client can't change it while it is applied
+    uint32_t length = slot->length;
+    if(length < sizeof(tfs_request) || length > sizeof(slot->data)) {
+        return -1;
+    }
+    memcpy(request, slot->data, length);
+    if(!((uint8_t) request[0] & TFS_PROTOCOL_MAGIC)) {     //text replies may be longer than their requests, they never go through a ring
+        return -1;
+    }
+    size_t replyLength = dispatchRequest(request, length, reply, MAX_REPLY_SIZE, NULL, stats, 0);
+    commitChanges(stats);
+    if(replyLength > sizeof(slot->data)) {      //only the counters, reads, dumps and listings are longer than their request, they are asked for on the socket
+        tfs_reply error;
+        memcpy(&error, reply, sizeof(error));
+        error.flags = TFS_REPLY_ERROR;
+        error.result = 0;
+        memcpy(reply, &error, sizeof(error));
+        replyLength = sizeof(error);
+    }
+    memcpy(slot->data, reply, replyLength);
+    slot->length = replyLength;
+    return 0;
+}
+
+//serves a connection's ring until it stays empty for a while, then tells the client to ring the doorbell for more
+void drainRing(connection_t* connection, char* reply, threadStats_t* stats) {
+    tfs_shm_ring* ring = connection->ring;
+    uint32_t head = ring->sq_head;
+    uint64_t one = 1;
+    int polls = 0;
+    __atomic_store_n(&ring->server_idle, 0, __ATOMIC_SEQ_CST);
+    while(!__atomic_load_n(&connection->closed, __ATOMIC_RELAXED)) {
+        uint32_t tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+        if(tail != head) {
+            if(tail - head > TFS_SHM_SLOTS || serveSlot(connection, &ring->slots[head % TFS_SHM_SLOTS], reply, stats) < 0) {
+                fprintf(stderr, "Error: invalid ring request received\n");
+                shutdown(connection->fd, SHUT_RDWR);   //the reactor sees the connection end and closes it
+                break;
+            }
+            head++;
+            __atomic_store_n(&ring->sq_head, head, __ATOMIC_RELAXED);
+            __atomic_store_n(&ring->cq_tail, head, __ATOMIC_SEQ_CST);
+            if(__atomic_load_n(&ring->client_waiting, __ATOMIC_SEQ_CST)) {
+                write(connection->wakeup, &one, sizeof(one));
+            }
+            polls = 0;
+        }
+        else if(polls < ringSpin + TFS_SHM_YIELDS && !__atomic_load_n(&queueLength, __ATOMIC_RELAXED)) {     //lingers only if no other client waits for a worker
+            if(polls++ < ringSpin) {
+                tfs_cpu_relax();    //a busy client submits again before the server gives up, no system call on either side
+            }
+            else {
+                sched_yield();      //lets the client run when both share a processor
+            }
         }
         else {
-            numTokens = sscanf(command, "%c %s %c", &token, name, &type);
+            //the client must ring from now on; the ring is looked at again after saying so and after
+            //giving the ring up, a request submitted in between would otherwise wait for nobody
+            __atomic_store_n(&ring->server_idle, 1, __ATOMIC_SEQ_CST);
+            if(__atomic_load_n(&ring->sq_tail, __ATOMIC_SEQ_CST) == head) {
+                __atomic_store_n(&connection->draining, 0, __ATOMIC_SEQ_CST);
+                int expected = 0;
+                if(__atomic_load_n(&ring->sq_tail, __ATOMIC_SEQ_CST) == head ||
+                   !__atomic_compare_exchange_n(&connection->draining, &expected, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                    return;
+                }
+            }
+            __atomic_store_n(&ring->server_idle, 0, __ATOMIC_SEQ_CST);
+            polls = 0;
         }
-        free(command);
+    }
+    __atomic_store_n(&connection->draining, 0, __ATOMIC_SEQ_CST);
+}
 
-        if (numTokens < 2) {
-            fprintf(stderr, "Error: invalid command in Queue\n");
-            exit(EXIT_FAILURE);
+void* serveConnections(void* arg) {  //this function executes the requests read from every connection by the reactor
+    threadStats_t* stats = &threadStats[(intptr_t) arg];
+    file_view view;
+    char* reply = malloc(MAX_REPLY_SIZE);
+    if(!reply) {
+        fprintf(stderr, "Couldn't allocate reply buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    while(1) {
+        request_t* request = dequeueRequest();
+        if(request->drain) {
+            drainRing(request->connection, reply, stats);
         }
-        else if(token != 'l' && isPrinting == 1) {
-            pthread_mutex_lock(&opLock);
-            pthread_cond_wait(&opCond, &opLock);    //every thread with modifying behavior waits until the program finishes printing
-            pthread_mutex_unlock(&opLock);
-        }
-
-        int result = 0;        //this variable saves the output of the applied command an it is sent back to the client as a reply
-        switch (token) {      //there are 5 different types of commands: c (create), d (delete), l (lookup), m (move) and p (print)
-            case 'c':
-                switch (type) {
-                    case 'f':
-                        modThreads++;
-                        printf("Create file: %s\n", name);
-                        result = create(name, T_FILE);
-                        break;
-                    case 'd':
-                        modThreads++;
-                        printf("Create directory: %s\n", name);
-                        result = create(name, T_DIRECTORY);
-                        break;
-                    default:
-                        fprintf(stderr, "Error: invalid node type\n");
-                        sendto(sockfd, "error", sizeof(char) * 100, 0, (struct sockaddr *) &local, clilen);
-                        exit(EXIT_FAILURE);
+        else {
+            size_t replyLength = dispatchRequest(request->command, request->length, reply, MAX_REPLY_SIZE, &view, stats, now_ns() - request->arrival);
+            commitChanges(stats);
+            if(request->connection) {
+                sendReply(request->connection, reply, replyLength, &view);
+            }
+            else {
+                struct iovec iov[1 + FILE_VIEW_EXTENTS];
+                struct msghdr message = { &request->client, request->clientLength, iov, replyVector(iov, reply, replyLength, &view), NULL, 0, 0 };
+                if(sendmsg(sockfd, &message, view.open ? MSG_DONTWAIT : 0) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    gatherReply(&message, reply, &view);        //the client's queue is full, it waits without the file
+                    sendmsg(sockfd, &message, 0);
                 }
-                modThreads--;
-                break;
-            case 'l':       
-                result = lookup(name);
-                if (result >= 0)
-                    printf("Search: %s found\n", name);
-                else
-                    printf("Search: %s not found\n", name);
+            }
+            release_file_view(&view);
+        }
+        if(request->connection) {
+            releaseConnection(request->connection);
+        }
+        free(request);
+    }
+    free(reply);
+    return NULL;
+}
+
+//maps the ring passed with a TFS_OP_ATTACH request and starts watching its doorbell, returns the result of the request
+int attachRing(connection_t* connection, int epollfd) {
+    struct stat info;
+    int* fds = connection->passed;
+    if(connection->ring || connection->passedCount != 3 || fstat(fds[0], &info) < 0 || info.st_size != sizeof(tfs_shm_ring)
+       || (fcntl(fds[0], F_GET_SEALS) & F_SEAL_SHRINK) == 0 || fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0) {    //an unsealed ring could shrink and fault the server
+        return -1;
+    }
+    void* ring = mmap(NULL, sizeof(tfs_shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if(ring == MAP_FAILED) {
+        return -1;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &connection->doorbellWatch };
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, fds[1], &event) < 0) {
+        munmap(ring, sizeof(tfs_shm_ring));
+        return -1;
+    }
+    connection->ring = ring;
+    connection->ring->server_idle = 1;      //nothing serves the ring until the client rings
+    connection->doorbell = fds[1];
+    connection->wakeup = fds[2];
+    close(fds[0]);
+    connection->passedCount = 0;
+    return 0;
+}
+
+//keeps the descriptors that came with what was just read for a TFS_OP_ATTACH, at most one set at a time
+void receivePassed(connection_t* connection, struct msghdr* message) {
+    for(struct cmsghdr* control = CMSG_FIRSTHDR(message); control; control = CMSG_NXTHDR(message, control)) {
+        if(control->cmsg_level != SOL_SOCKET || control->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (control->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        closePassed(connection);
+        memcpy(connection->passed, CMSG_DATA(control), (count < 3 ? count : 3) * sizeof(int));
+        for(int i = 3; i < count; i++) {
+            int extra;
+            memcpy(&extra, CMSG_DATA(control) + i * sizeof(int), sizeof(int));
+            close(extra);
+        }
+        connection->passedCount = count < 3 ? count : 3;
+    }
+}
+
+//reads what a client sent and queues every complete request, returns -1 when the connection has to be closed
+int readRequests(connection_t* connection, int epollfd) {
+    size_t needed = connection->length + 1;
+    if(socketType == SOCK_SEQPACKET) {      //a packet is read whole or truncated, so the buffer must fit the next one
+        ssize_t packet = recv(connection->fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+        needed = connection->length + (packet > 0 ? packet : 1);
+    }
+    if(needed > connection->capacity) {     //a batch doesn't fit the buffer, it grows up to the largest request
+        size_t capacity = connection->capacity;
+        while(capacity < needed && capacity < MAX_REQUEST_SIZE)
+            capacity = capacity * 2 < MAX_REQUEST_SIZE ? capacity * 2 : MAX_REQUEST_SIZE;
+        char* buffer = capacity >= needed ? realloc(connection->buffer, capacity) : NULL;
+        if(!buffer) {
+            return -1;
+        }
+        connection->buffer = buffer;
+        connection->capacity = capacity;
+    }
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { connection->buffer + connection->length, connection->capacity - connection->length };
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t count = recvmsg(connection->fd, &message, MSG_CMSG_CLOEXEC);
+    if(count > 0 && message.msg_controllen > 0) {
+        receivePassed(connection, &message);
+    }
+    if(count == 0 || (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        return -1;
+    }
+    if(count < 0) {
+        return 0;
+    }
+    connection->length += count;
+
+    size_t start = 0;       //a stream can carry several requests or only part of one
+    while(start < connection->length) {
+        char* message = connection->buffer + start;
+        size_t available = connection->length - start, size;
+        if((uint8_t) message[0] & TFS_PROTOCOL_MAGIC) {    //binary requests have their size in the header
+            tfs_request header;
+            if(available < sizeof(tfs_request)) {
                 break;
-            case 'd':       
-                modThreads++;
-                printf("Delete: %s\n", name);
-                result = delete(name);
-                modThreads--;
+            }
+            memcpy(&header, message, sizeof(tfs_request));
+            size = binaryMessageSize(&header);
+            if(size > MAX_REQUEST_SIZE) {
+                return -1;
+            }
+            if(available < size) {
                 break;
-            case 'm':
-                modThreads++; 
-                result = lookup(name);
-                if (result >= 0){
-                    printf("Search: %s found\n", name);
-                    result = lookup(name2);
-                    if (result >= 0){
-                        printf("Search: %s found\n", name2);
-                        result = move(name, name2);
-                        modThreads--;
-                    }          
-                    else{
-                        printf("Search: %s not found\n", name2);
-                        modThreads--;
-                        break;
-                    }
+            }
+            if(header.opcode == TFS_OP_ATTACH) {    //answered right away, the ring must be known before the client uses it
+                tfs_reply reply = { TFS_PROTOCOL_BYTE, TFS_OP_ATTACH, 0, header.id, 0 };
+                if(attachRing(connection, epollfd) < 0) {
+                    reply.flags = TFS_REPLY_ERROR;
+                    reply.result = -1;
                 }
-                else {
-                    printf("Search: %s not found\n", name);
-                    modThreads--;
-                    break;
+                sendReply(connection, (char*) &reply, sizeof(reply), NULL);
+            }
+            else {
+                enqueueRequest(connection, message, size, 0);
+            }
+        }
+        else {      //text requests are NUL-terminated
+            char* end = memchr(message, '\0', available);
+            if(!end) {
+                break;
+            }
+            size = end - message + 1;
+            if(size > MAX_REQUEST_SIZE) {
+                return -1;
+            }
+            enqueueRequest(connection, message, size - 1, 0);
+        }
+        start += size;
+    }
+    if(connection->length - start >= MAX_REQUEST_SIZE) {
+        return -1;      //no request is that long, the client isn't speaking the protocol
+    }
+    memmove(connection->buffer, connection->buffer + start, connection->length - start);
+    connection->length -= start;
+    return 0;
+}
+
+void acceptConnections(int epollfd) {    //accepts every pending connection and starts watching it
+    int clientfd;
+    while((clientfd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        connection_t* connection = malloc(sizeof(connection_t));
+        char* buffer = malloc(CONNECTION_BUFFER);
+        if(!connection || !buffer) {
+            free(connection);
+            free(buffer);
+            close(clientfd);
+            continue;
+        }
+        connection->buffer = buffer;
+        connection->capacity = CONNECTION_BUFFER;
+        connection->fd = clientfd;
+        connection->refs = 1;       //the reactor's reference, dropped when the client disconnects
+        connection->length = 0;
+        connection->socketWatch = (watch_t) { connection, 0 };
+        connection->doorbellWatch = (watch_t) { connection, 1 };
+        connection->passedCount = 0;
+        connection->ring = NULL;
+        connection->draining = 0;
+        connection->closed = 0;
+        pthread_mutex_init(&connection->writeLock, NULL);
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = &connection->socketWatch };
+        if(epoll_ctl(epollfd, EPOLL_CTL_ADD, clientfd, &event) < 0) {
+            perror("Epoll Error");
+            releaseConnection(connection);
+        }
+        else {
+            __atomic_store_n(&connectionCount, connectionCount + 1, __ATOMIC_RELAXED);
+        }
+    }
+    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+        perror("Accept Error");
+    }
+}
+
+void runReactor() {     //this function accepts connections and reads their requests, the workers answer them
+    struct epoll_event events[MAX_EVENTS];
+    int epollfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listening = { .events = EPOLLIN, .data.ptr = NULL };
+    if(epollfd < 0 || epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &listening) < 0) {
+        perror("Epoll Error");
+        exit(EXIT_FAILURE);
+    }
+    while(1) {
+        connection_t* closing[MAX_EVENTS];      //released after the batch, a later event may be about the doorbell of one of them
+        int closingCount = 0;
+        int ready = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+        if(ready < 0 && errno != EINTR) {
+            perror("Epoll Error");
+            exit(EXIT_FAILURE);
+        }
+        for(int i = 0; i < ready; i++) {
+            watch_t* watch = events[i].data.ptr;
+            connection_t* connection = watch ? watch->connection : NULL;
+            int expected = 0;
+            uint64_t rings;
+            if(!watch) {
+                acceptConnections(epollfd);
+            }
+            else if(__atomic_load_n(&connection->closed, __ATOMIC_RELAXED)) {
+                continue;
+            }
+            else if(watch->doorbell) {      //one worker at a time serves a ring, one already serving it sees the new requests
+                read(connection->doorbell, &rings, sizeof(rings));
+                if(__atomic_compare_exchange_n(&connection->draining, &expected, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                    enqueueRequest(connection, "", 0, 1);
                 }
-            case 'p':
-                //waits for other tasks to finish and prevents more tasks from being started (only applies to create, delete and move)
-                isPrinting = 2;     //waiting state
-                if(modThreads > 0) {
-                    pthread_mutex_lock(&printLock);
-                    pthread_cond_wait(&printCond, &printLock);
-                    pthread_mutex_unlock(&printLock);
+            }
+            else if(readRequests(connection, epollfd) < 0) {     //pending requests keep their own references to the connection
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, connection->fd, NULL);
+                if(connection->ring) {
+                    epoll_ctl(epollfd, EPOLL_CTL_DEL, connection->doorbell, NULL);
                 }
-                isPrinting = 1;     //printing state
-                outputFile = openOutput(name);
-                print_tecnicofs_tree(outputFile);
-                fclose(outputFile);
-                isPrinting = 0;
-                pthread_cond_signal(&opCond);   //when the printing is done, the threads can freely apply all kinds of commands
-                break;
-            
-            default: { /* error */
-                fprintf(stderr, "Error: command to apply\n");
-                sendto(sockfd, "error", sizeof(char) * 100, 0, (struct sockaddr *) &local, clilen);
-                exit(EXIT_FAILURE);
+                __atomic_store_n(&connection->closed, 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&connectionCount, connectionCount - 1, __ATOMIC_RELAXED);
+                closing[closingCount++] = connection;
             }
         }
-        if(modThreads == 0 && isPrinting == 1) {
-            pthread_cond_signal(&printCond); //the program can print if there are no active modifying commands
+        for(int i = 0; i < closingCount; i++) {
+            releaseConnection(closing[i]);
         }
-        char* reply = malloc(sizeof(char) * 10);
-        sprintf(reply, "%d", result);
-        sendto(sockfd, reply, sizeof(char) * 100, 0, (struct sockaddr *) &local, clilen);
-        free(reply);
     }
-    return NULL;
+}
+
+void receiveDatagrams() {   //with priorities, this thread receives every datagram and queues it by class for the workers
+    char* command = malloc(MAX_REQUEST_SIZE);
+    if(!command) {
+        fprintf(stderr, "Couldn't allocate request buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    while(1) {
+        uint64_t queueTime;
+        struct sockaddr_un client;
+        socklen_t clientLength;
+        ssize_t received = receiveCommand(command, MAX_REQUEST_SIZE, &client, &clientLength, &queueTime);
+        if(received < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("Receive Error");
+            break;
+        }
+        request_t* request = newRequest(command, received);
+        request->client = client;
+        request->clientLength = clientLength;
+        request->arrival -= queueTime;      //the time spent in the socket counts as queueing too
+        pushRequest(request);
+    }
+    free(command);
 }
 
 void runThreads() {     //this function works as a thread creator and manager
     pthread_t* thread_list = malloc(maxThreads * sizeof(pthread_t));
+    void* (*worker)(void*) = socketType == SOCK_DGRAM && !priorities ? applyCommands : serveConnections;
+    if(sysconf(_SC_NPROCESSORS_ONLN) == 1) {
+        busyPoll = 0;       //a polling worker would only keep the clients it waits for from running
+    }
     for(int i = 0; i < maxThreads; i++) {
-        if(pthread_create(&thread_list[i], NULL, applyCommands, NULL) != 0) {
+        if(pthread_create(&thread_list[i], NULL, worker, (void*) (intptr_t) i) != 0) {
             printf("Couldn't create thread\n");
             exit(EXIT_FAILURE);
         }
     }
+    if(socketType == SOCK_DGRAM && priorities) {
+        receiveDatagrams();     //the workers only execute, so every request goes through the queues
+    }
+    else if(socketType != SOCK_DGRAM) {
+        ringSpin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? TFS_SHM_SPIN : 0;
+        runReactor();       //on connections, this thread reads the requests and the workers only execute them
+    }
     for(int i = 0; i < maxThreads; i++) {
         if(pthread_join(thread_list[i], NULL) != 0) {
             printf("Couldn't join thread\n");
@@ -198,28 +1629,47 @@ void runThreads() {     //this function works as a thread creator and manager
 }
 
 int setSocket(char* sockPath) {  //this function creates a socket to establish a connection between the server and a client
-    if((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    int enable = 1;
+    int flags = socketType == SOCK_DGRAM ? 0 : SOCK_NONBLOCK | SOCK_CLOEXEC;   //the reactor never blocks on the listening socket
+    if((sockfd = socket(AF_UNIX, socketType | flags, 0)) < 0) {
         perror("Sock Error");
         return -1;
     }
     printf("Socket created\n");
     remote.sun_family = AF_UNIX;
     strcpy(remote.sun_path, sockPath);
-    clilen = sizeof(struct sockaddr_un);
     servlen = sizeof(struct sockaddr_un);
     if(bind(sockfd, (struct sockaddr *) &remote, servlen) < 0) {
         perror("Bind Error");
         return -2;
     }
+    if(socketType != SOCK_DGRAM) {
+        if(listen(sockfd, SOMAXCONN) < 0) {
+            perror("Listen Error");
+            return -3;
+        }
+    }
+    else if(setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) < 0) {   //arrival times are used to measure queueing
+        perror("Timestamp Error");
+    }
     printf("Listening...\n");
     return 0;
 }
 
-int main(int argc, char* argv[]) {
-    double elapsedTime;     //number of seconds the program ran for
-    struct timeval startTime;
-    struct timeval stopTime;
+void startSignalHandler() {     //the signals are blocked in every thread and handled synchronously by a dedicated one
+    static sigset_t signals;
+    pthread_t signalThread;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    if(pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0 || pthread_create(&signalThread, NULL, handleSignals, &signals) != 0) {
+        fprintf(stderr, "Couldn't start signal handler\n");
+        exit(EXIT_FAILURE);
+    }
+}
 
+int main(int argc, char* argv[]) {
     arguments(argc, argv);
 
     if(setSocket(nomeSocket) < 0) {
@@ -227,22 +1677,45 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
     
-    init_fs();      // initializes filesystem
-    if(gettimeofday(&startTime, NULL) != 0) {   //the program obtains its starting time from the pc's clock
+    uint64_t loadStart = now_ns();
+    uint64_t imageLsn = init_fs(checkpointPath);      // initializes filesystem, from the image if there is one
+    if(walPath && wal_open(walPath, &walConfig, imageLsn) == FAIL) {     //the log is replayed before any request is served
+        fprintf(stderr, "Couldn't open the log\n");
+        exit(EXIT_FAILURE);
+    }
+    startupTime = now_ns() - loadStart;
+    threadStats = calloc(maxThreads, sizeof(threadStats_t));
+    if(!threadStats) {
+        fprintf(stderr, "Couldn't allocate latency histograms\n");
+        exit(EXIT_FAILURE);
+    }
+    if(clock_gettime(CLOCK_MONOTONIC, &startTime) != 0) {   //the program obtains its starting time from a monotonic clock
         fprintf(stderr, "Couldn't get time\n");
         exit(EXIT_FAILURE);
     }
+    startSignalHandler();
+    if(checkpointPath) {      //started once the signals are blocked, they are only taken by the handler
+        pthread_t checkpointer;
+        if(access(checkpointPath, F_OK) == 0) {
+            checkpointLsn = imageLsn;   //the image isn't written again until something changes
+        }
+        if(pthread_create(&checkpointer, NULL, checkpointPeriodically, NULL) != 0 || pthread_detach(checkpointer) != 0) {
+            fprintf(stderr, "Couldn't start the checkpoints\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
     runThreads();  //threads are created and begin receiving commands
 
-    if(gettimeofday(&stopTime, NULL) != 0) {    //the program obtains its stopping time from the pc's clock
-        fprintf(stderr, "Couldn't get time\n");
-        exit(EXIT_FAILURE);
-    }
-    elapsedTime = (double) (stopTime.tv_usec - startTime.tv_usec) / CLOCKS_PER_SEC;
-    printf("The program ended in %.4f seconds.\n", elapsedTime);
+    printElapsedTime();
+    printLatencyReport(stdout);
 
     /* release allocated memory */
+    free(threadStats);
+    if(checkpointPath) {
+        writeCheckpoint();
+    }
+    wal_close();
     destroy_fs();
     exit(EXIT_SUCCESS);
 }
@@ -1,19 +1,10 @@
 #arguments will be: runTests inputdir outputdir maxthreads
-#for each case, the script will be printing a string first
-#the string will show in the following format: InputFile=nomeDoFicheiro NumThreads=númeroDeTarefas
-#output will be filtered by the script to show the execution time of tecnicofs for every case
+#kept for compatibility, the measurements are now done by tools/benchmark.sh,
+#which sweeps builds, sync strategies and thread counts with repetitions and confidence intervals
+#the results of this run are written to outputdir/results.csv and outputdir/results.json
 
 inputdir=$1
 outputdir=$2
 maxthreads=$3
 mkdir -p $outputdir
-for file in $inputdir/*
-do 
-    inputFile=$file
-    outputFile=${file%.txt}
-    outputFile=$outputdir/${outputFile##*/}-$maxthreads.txt
-    echo InputFile=$inputFile NumThreads=$maxthreads
-    ./tecnicofs $inputFile $outputFile $maxthreads
-done
-
-#output filename = nomeFicheiroEntrada-númeroDeTarefas.txt
\ No newline at end of file
+exec "$(dirname "$0")/../tools/benchmark.sh" -b ex_3 -i "$inputdir" -t "$maxthreads" -o "$outputdir/results"
@@ -4,6 +4,10 @@
 
 #define MAX_FILE_NAME 100
 #define MAX_INPUT_SIZE 100
+#define MAX_BATCH_SIZE 256     /* commands sent together by tfsBatchSubmit */
+#define MAX_STATS_SIZE 16384   /* text of the server's counters returned by tfsStats */
+#define MAX_IN_FLIGHT 1024     /* requests of a client waiting for their replies, a power of two */
+#define MAX_OPEN_FILES 64      /* files a client can have open at once */
 
 
 typedef enum permission { NONE, WRITE, READ, RW } permission;
@@ -0,0 +1,195 @@
+/* tecnicofs-protocol.h */
+#ifndef TECNICOFS_PROTOCOL_H
+#define TECNICOFS_PROTOCOL_H
+
+#include <stdint.h>
+#include "tecnicofs-api-constants.h"
+
+/*
+ * Binary protocol spoken alongside the text one. Every message starts with a
+ * fixed header followed by the bytes of its paths, without terminators, so the
+ * header alone tells how long the message is. Text commands always start with
+ * an ASCII letter, binary messages with a byte whose high bit is set.
+ * Both ends run on the same machine, integers are in host byte order.
+ */
+#define TFS_PROTOCOL_MAGIC 0x80
+#define TFS_PROTOCOL_VERSION 1
+#define TFS_PROTOCOL_BYTE (TFS_PROTOCOL_MAGIC | TFS_PROTOCOL_VERSION)
+
+#define TFS_MAX_MESSAGE_SIZE 65536      /* longest request, batches included */
+#define TFS_MAX_READ_SIZE 65536         /* most bytes a read returns */
+#define TFS_MAX_WRITE_SIZE 32768        /* most bytes a write carries, so that it fits a request with its path */
+#define TFS_MAX_REPLY_SIZE (TFS_MAX_READ_SIZE + 12)    /* longest reply: the data of a read, longer than the results of a batch or the counters */
+#define TFS_MAX_DUMP_SIZE (TFS_MAX_READ_SIZE - 8)      /* most bytes of a dump a reply carries, after its tfs_dump_args */
+
+/* opcodes */
+#define TFS_OP_CREATE 1
+#define TFS_OP_LOOKUP 2
+#define TFS_OP_DELETE 3
+#define TFS_OP_MOVE 4
+#define TFS_OP_PRINT 5
+#define TFS_OP_BATCH 6      /* the paths are whole requests, length2 of them, none of them a batch */
+#define TFS_OP_ATTACH 7     /* carries the descriptors of a shared-memory ring, see below */
+#define TFS_OP_STATS 8      /* asks for the server's counters, see below */
+#define TFS_OP_READ 9       /* the path is followed by a tfs_file_args, see below */
+#define TFS_OP_WRITE 10     /* the path is followed by a tfs_file_args and the data */
+#define TFS_OP_TRUNCATE 11  /* the path is followed by a tfs_file_args */
+#define TFS_OP_STAT 12      /* the path is followed by a tfs_file_args, the reply by a tfs_stat */
+#define TFS_OP_CLONE 13     /* the first path is cloned to the second, sharing everything below until either side changes */
+#define TFS_OP_DUMP 14      /* no path, followed by a tfs_dump_args: reads the next bytes of the tree as a print writes it, see below */
+#define TFS_OP_READDIR 15   /* the path is followed by a tfs_readdir_args: lists the next entries of a directory, see below */
+
+/* request flags */
+#define TFS_FLAG_DIRECTORY 0x01     /* a create makes a directory instead of a file */
+#define TFS_FLAG_APPEND 0x02        /* a write goes to the end of the file, whatever its offset */
+#define TFS_FLAG_HANDLE 0x04        /* a file request names an opened file by its tfs_file_args, it has no path */
+#define TFS_FLAG_SNAPSHOT 0x08      /* a clone is a snapshot, nothing in it can be changed */
+#define TFS_FLAG_UNSHARE 0x10       /* a stat opens the file to be written, what a clone shares on its path is copied */
+#define TFS_FLAG_RECURSIVE 0x20     /* a delete removes a directory with everything below it, replying once it is detached */
+
+/* reply flags */
+#define TFS_REPLY_ERROR 0x01        /* the request was malformed, result is meaningless */
+#define TFS_REPLY_BAD_VERSION 0x02  /* the server doesn't speak the version of the request */
+#define TFS_REPLY_STALE 0x04        /* the opened file of a request must be opened again, see below */
+#define TFS_REPLY_END 0x08          /* a dump has no more bytes and was closed, or a listing has no more entries */
+
+typedef struct tfs_request {
+	uint8_t version;        /* TFS_PROTOCOL_BYTE */
+	uint8_t opcode;
+	uint8_t flags;
+	uint8_t reserved;
+	uint32_t id;            /* chosen by the client and echoed in the reply */
+	uint16_t length1;       /* bytes of the path, or of the requests of a batch */
+	uint16_t length2;       /* bytes of the destination of a move, or requests of a batch */
+} tfs_request;
+
+/*
+ * File requests carry their arguments after the path, in length2, followed
+ * by the data of a write: length2 is sizeof(tfs_file_args) plus its length.
+ * With TFS_FLAG_HANDLE the path is empty and the file is the i-node and
+ * generation a TFS_OP_STAT returned; the request fails if that i-node was
+ * deleted since, even if it was reused. It fails with TFS_REPLY_STALE if a
+ * clone was made since, as the i-node may be shared by the clone now, or if
+ * it writes and the stat didn't have TFS_FLAG_UNSHARE: the file must be
+ * opened again by its path.
+ */
+typedef struct tfs_file_args {
+	uint64_t offset;        /* where a read or write starts, or the new size of a truncate */
+	uint32_t length;        /* bytes to read, or bytes of data that follow a write */
+	int32_t inumber;        /* the opened file, with TFS_FLAG_HANDLE */
+	uint32_t generation;
+	uint32_t epoch;         /* the clone epoch of the tfs_stat */
+} tfs_file_args;
+
+/* follows the reply of a successful TFS_OP_STAT, whose result is the i-number */
+typedef struct tfs_stat {
+	uint64_t size;          /* bytes of a file, 0 for a directory */
+	int32_t type;           /* T_FILE or T_DIRECTORY */
+	uint32_t generation;    /* names the file along with the i-number */
+	uint32_t epoch;         /* until the next clone, or a copy of the file */
+	uint32_t reserved;
+} tfs_stat;
+
+/*
+ * A dump streams the tree to the client in the replies of as many
+ * TFS_OP_DUMP requests as it takes, each asking for the next length bytes of
+ * it (at most TFS_MAX_DUMP_SIZE), so the server never sends more than the
+ * client asked for and keeps no worker busy between requests. The first
+ * request has cursor 0 and starts a dump of the tree as it is then; the reply
+ * is followed by a tfs_dump_args naming the dump for the next requests, and
+ * then by result bytes of it, fewer than asked for only at its end, when the
+ * reply has TFS_REPLY_END. A request with length 0 closes the dump early, one
+ * with no request for DUMP_IDLE_S seconds (see fs/operations.h) is closed by
+ * the server. A dump shares the tree like a clone does.
+ */
+typedef struct tfs_dump_args {
+	uint32_t cursor;        /* the dump, 0 to start one */
+	uint32_t length;        /* bytes asked for, or returned */
+} tfs_dump_args;
+
+/*
+ * A directory is listed a page at a time: each TFS_OP_READDIR asks for at
+ * most count entries (no more than TFS_MAX_READDIR) from a cursor, 0 at
+ * first. The reply's result is the number of entries, followed by a
+ * tfs_readdir_args with the cursor the next request starts from and the
+ * bytes of the entries, then the entries, each a tfs_dirent and its name.
+ * A page may have no entries before the end of the directory, the reply that
+ * reaches the end has TFS_REPLY_END. The directory is only locked while a
+ * page is made, and an entry that is there through the whole listing is
+ * listed exactly once, whatever is created or deleted in the directory
+ * meanwhile.
+ */
+#define TFS_MAX_READDIR 512     /* entries of a page, their longest names fit a reply */
+
+typedef struct tfs_readdir_args {
+	uint32_t cursor;
+	uint32_t count;         /* entries asked for, or bytes of the entries returned */
+} tfs_readdir_args;
+
+typedef struct tfs_dirent {
+	uint8_t type;           /* T_FILE or T_DIRECTORY */
+	uint8_t length;         /* of the name that follows, without a terminator */
+} tfs_dirent;
+
+/*
+ * A reply is the header alone, except for batches: their result is the
+ * number of requests applied and the header is followed by one int32_t
+ * result per request, in order. The result of a TFS_OP_STATS request is the
+ * length of the text that follows, one "name value" line per counter. The
+ * result of a TFS_OP_READ is the number of bytes read, which follow the
+ * header; it is less than asked for only at the end of the file. A
+ * successful TFS_OP_STAT is followed by a tfs_stat, a successful TFS_OP_DUMP
+ * by a tfs_dump_args and the result bytes of the dump, and a successful
+ * TFS_OP_READDIR by a tfs_readdir_args and the entries it lists.
+ */
+typedef struct tfs_reply {
+	uint8_t version;
+	uint8_t opcode;
+	uint16_t flags;
+	uint32_t id;
+	int32_t result;
+} tfs_reply;
+
+/*
+ * Shared-memory transport. A client connected with a stream or seqpacket
+ * socket may send a TFS_OP_ATTACH request with three descriptors attached
+ * (SCM_RIGHTS): a memfd holding a tfs_shm_ring, an eventfd the client writes
+ * to wake the server and an eventfd the server writes to wake the client.
+ * From then on binary requests that fit a slot are written to the ring and
+ * their replies are written over them, in place. Each side only rings the
+ * other's doorbell when the other has announced it is about to sleep, so a
+ * busy session makes no system calls. The ring lives as long as the
+ * connection.
+ */
+#define TFS_SHM_SLOTS 64                /* a power of two */
+#define TFS_SHM_SLOT_SIZE 2048          /* a request or reply must fit, with its length */
+#define TFS_SHM_SPIN 256                /* busy polls before yielding the processor */
+#define TFS_SHM_YIELDS 16               /* yields before sleeping on the doorbell */
+
+typedef struct tfs_shm_slot {
+	uint32_t length;
+	char data[TFS_SHM_SLOT_SIZE - sizeof(uint32_t)];
+} tfs_shm_slot;
+
+/* counters only grow, slot i is slots[i % TFS_SHM_SLOTS]; every field written by one side has its own cache line */
+typedef struct tfs_shm_ring {
+	uint32_t sq_tail;               /* written by the client: requests submitted */
+	uint32_t client_waiting;        /* written by the client: it sleeps until the server rings */
+	char client_padding[56];
+	uint32_t sq_head;               /* written by the server: requests taken */
+	uint32_t cq_tail;               /* written by the server: replies written */
+	uint32_t server_idle;           /* written by the server: the client must ring to be served */
+	char server_padding[52];
+	tfs_shm_slot slots[TFS_SHM_SLOTS];
+} tfs_shm_ring;
+
+static inline void tfs_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+
+#endif /* TECNICOFS_PROTOCOL_H */
@@ -0,0 +1,142 @@
+#!/bin/bash
+#benchmark harness for the tecnicofs builds
+#arguments will be: benchmark.sh [-b builds] [-i inputdir] [-t threads] [-s strategies] [-m socketmodes] [-w warmup] [-r repetitions] [-T timeout] [-o prefix]
+#every combination of build, input file, sync strategy (socket type for ex_3) and number of threads is run warmup+repetitions times,
+#the warmup runs are discarded and the timings of the others are summarized with 95% confidence intervals
+#results are written to prefix.csv and prefix.json, the raw timings to prefix-raw.csv
+
+usage() {
+    echo "Usage: $0 [-b ex_1,ex_2,ex_3] [-i inputdir] [-t 1,2,4,8] [-s nosync,mutex,rwlock] [-m dgram,stream,seqpacket] [-w warmup] [-r repetitions] [-T timeout] [-o prefix]" >&2
+    exit 1
+}
+
+repodir=$(cd "$(dirname "$0")/.." && pwd)
+builds=ex_1,ex_2,ex_3
+inputdir=
+threads=1,2,4,8
+strategies=nosync,mutex,rwlock      #only ex_1 has sync strategies, the other builds ignore this option
+socketmodes=dgram                   #socket types the ex_3 server is run with, reported in the strategy column
+warmup=1
+repetitions=5
+timeout=60
+prefix=results
+
+while getopts "b:i:t:s:m:w:r:T:o:" opt; do
+    case $opt in
+        b) builds=$OPTARG ;;
+        i) inputdir=$(cd "$OPTARG" && pwd) || exit 1 ;;
+        t) threads=$OPTARG ;;
+        s) strategies=$OPTARG ;;
+        m) socketmodes=$OPTARG ;;
+        w) warmup=$OPTARG ;;
+        r) repetitions=$OPTARG ;;
+        T) timeout=$OPTARG ;;
+        o) prefix=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+[ $OPTIND -gt $# ] || usage
+[ "$repetitions" -ge 2 ] || { echo "At least 2 repetitions are needed for a confidence interval" >&2; exit 1; }
+
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+raw=$prefix-raw.csv
+echo "build,input,strategy,threads,ops,repetition,seconds,status" > "$raw"
+
+#number of operations in an input file, comments and blank lines don't count
+countOps() {
+    grep -cv '^[[:space:]]*\(#.*\)\?$' "$1"
+}
+
+#runs a build once and prints the seconds it took, or nothing if it failed
+runOnce() {
+    local build=$1 input=$2 strategy=$3 nthreads=$4
+    case $build in
+        ex_1)
+            timeout "$timeout" "$repodir/ex_1/tecnicofs" "$input" "$scratch/out.txt" "$nthreads" "$strategy" ;;
+        ex_2)
+            timeout "$timeout" "$repodir/ex_2/tecnicofs" "$input" "$scratch/out.txt" "$nthreads" ;;
+        ex_3)   #the server never ends, so the client's time is the one measured
+            local socket=$scratch/server.sock
+            rm -f "$socket"
+            (cd "$scratch" && exec "$repodir/ex_3/tecnicofs" "$nthreads" "$socket" "$strategy" > /dev/null 2>&1) &
+            local server=$!
+            for _ in $(seq 50); do [ -S "$socket" ] && break; sleep 0.1; done
+            (cd "$scratch" && timeout "$timeout" "$repodir/ex_3/client/tecnicofs-client" "$input" "$socket")
+            kill $server 2> /dev/null
+            wait $server 2> /dev/null
+            rm -f "$socket" ;;
+    esac | sed -n 's/^The \(program\|client\) ended in \([0-9.]*\) seconds\.$/\2/p'
+}
+
+for build in ${builds//,/ }; do
+    [ -x "$repodir/$build/tecnicofs" ] || make -s -C "$repodir/$build" > /dev/null || exit 1
+    [ "$build" != ex_3 ] || [ -x "$repodir/ex_3/client/tecnicofs-client" ] || make -s -C "$repodir/ex_3/client" > /dev/null || exit 1
+    buildstrategies=$strategies
+    [ "$build" = ex_3 ] && buildstrategies=$socketmodes
+    [ "$build" = ex_1 ] || [ "$build" = ex_3 ] || buildstrategies=default
+    for input in "${inputdir:-$repodir/$build/inputs}"/*; do
+        ops=$(countOps "$input")
+        for strategy in ${buildstrategies//,/ }; do
+            for nthreads in ${threads//,/ }; do
+                [ "$strategy" = nosync ] && [ "$nthreads" != 1 ] && continue    #nosync only runs with one thread
+                echo "Build=$build InputFile=${input##*/} Strategy=$strategy NumThreads=$nthreads" >&2
+                for rep in $(seq $((warmup + repetitions))); do
+                    seconds=$(runOnce "$build" "$input" "$strategy" "$nthreads")
+                    [ "$rep" -le "$warmup" ] && continue
+                    status=ok
+                    [ -n "$seconds" ] || status=failed
+                    echo "$build,${input##*/},$strategy,$nthreads,$ops,$((rep - warmup)),$seconds,$status" >> "$raw"
+                done
+            done
+        done
+    done
+done
+
+#the summary is computed per configuration, the speedup is relative to the smallest thread count of the same build, input and strategy
+awk -F, -v csv="$prefix.csv" -v json="$prefix.json" '
+function tcrit(df) {    #two-sided 95% quantiles of the t distribution
+    split("12.706 4.303 3.182 2.776 2.571 2.447 2.365 2.306 2.262 2.228 2.201 2.179 2.160 2.145 2.131 2.120 2.110 2.101 2.093 2.086 2.080 2.074 2.069 2.064 2.060 2.056 2.052 2.048 2.045 2.042", t, " ")
+    return df <= 30 ? t[df] : 1.960
+}
+NR > 1 {
+    key = $1 "," $2 "," $3 "," $4
+    if (!(key in n)) { order[++keys] = key; ops[key] = $5; n[key] = 0; failed[key] = 0 }
+    if ($8 != "ok") { failed[key]++; next }
+    n[key]++; sum[key] += $7; sumsq[key] += $7 * $7
+    tput = $5 / ($7 > 0 ? $7 : 1e-9); tsum[key] += tput; tsumsq[key] += tput * tput
+    group = $1 "," $2 "," $3
+    if (!(group in base) || $4 + 0 < basethreads[group]) { base[group] = key; basethreads[group] = $4 + 0 }
+}
+END {
+    print "build,input,strategy,threads,ops,runs,failed,mean_s,ci95_s,throughput_ops_s,ci95_throughput,speedup,ci95_speedup,efficiency" > csv
+    printf "[" > json
+    for (i = 1; i <= keys; i++) {
+        key = order[i]; split(key, f, ",")
+        mean = sd = ci = tmean = tci = speedup = sci = eff = ""
+        if (n[key] > 0) {
+            mean = sum[key] / n[key]; tmean = tsum[key] / n[key]
+            var = n[key] > 1 ? (sumsq[key] - n[key] * mean * mean) / (n[key] - 1) : 0
+            tvar = n[key] > 1 ? (tsumsq[key] - n[key] * tmean * tmean) / (n[key] - 1) : 0
+            ci = n[key] > 1 ? tcrit(n[key] - 1) * sqrt(var > 0 ? var : 0) / sqrt(n[key]) : 0
+            tci = n[key] > 1 ? tcrit(n[key] - 1) * sqrt(tvar > 0 ? tvar : 0) / sqrt(n[key]) : 0
+            b = base[f[1] "," f[2] "," f[3]]
+            if (n[b] > 0 && mean > 0) {
+                bmean = sum[b] / n[b]
+                bvar = n[b] > 1 ? (sumsq[b] - n[b] * bmean * bmean) / (n[b] - 1) : 0
+                bci = n[b] > 1 ? tcrit(n[b] - 1) * sqrt(bvar > 0 ? bvar : 0) / sqrt(n[b]) : 0
+                speedup = bmean / mean
+                sci = speedup * sqrt((bci / bmean) ^ 2 + (ci / mean) ^ 2)   #relative errors of the two means are combined
+                eff = speedup * basethreads[f[1] "," f[2] "," f[3]] / f[4]
+            }
+        }
+        printf "%s,%d,%d,%d,%s,%s,%s,%s,%s,%s,%s\n", key, ops[key], n[key], failed[key], fmt(mean), fmt(ci), fmt(tmean), fmt(tci), fmt(speedup), fmt(sci), fmt(eff) > csv
+        printf "%s\n  {\"build\": \"%s\", \"input\": \"%s\", \"strategy\": \"%s\", \"threads\": %d, \"ops\": %d, \"runs\": %d, \"failed\": %d, \"mean_s\": %s, \"ci95_s\": %s, \"throughput_ops_s\": %s, \"ci95_throughput\": %s, \"speedup\": %s, \"ci95_speedup\": %s, \"efficiency\": %s}", (i > 1 ? "," : ""), f[1], f[2], f[3], f[4], ops[key], n[key], failed[key], jfmt(mean), jfmt(ci), jfmt(tmean), jfmt(tci), jfmt(speedup), jfmt(sci), jfmt(eff) > json
+    }
+    printf "\n]\n" > json
+}
+function fmt(x) { return x == "" ? "" : sprintf("%.6g", x) }
+function jfmt(x) { return x == "" ? "null" : sprintf("%.6g", x) }
+' "$raw"
+
+if command -v column > /dev/null; then column -s, -t "$prefix.csv"; else cat "$prefix.csv"; fi
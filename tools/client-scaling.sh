@@ -0,0 +1,71 @@
+#!/bin/bash
+#client scaling benchmark for the ex_3 server
+#arguments will be: client-scaling.sh [-c clients] [-t serverthreads] [-m socketmodes] [-b batch] [-r repetitions] [-T timeout] [-o prefix] [inputfile]
+#for every socket type and number of clients the server is started afresh and the workload is replayed by that many
+#concurrent client processes (tecnicofs-driver -S), which share the operations of the input file between them
+#results are written to prefix.csv, one line per run
+
+usage() {
+    echo "Usage: $0 [-c 1,2,4,...,256] [-t serverthreads] [-m dgram,stream,seqpacket] [-b batch] [-r repetitions] [-T timeout] [-o prefix] [inputfile]" >&2
+    exit 1
+}
+
+repodir=$(cd "$(dirname "$0")/.." && pwd)
+clients=1,2,4,8,16,32,64,128,256
+serverthreads=$(nproc)
+socketmodes=dgram,stream
+batch=1
+repetitions=3
+timeout=120
+prefix=scaling
+
+while getopts "c:t:m:b:r:T:o:" opt; do
+    case $opt in
+        c) clients=$OPTARG ;;
+        t) serverthreads=$OPTARG ;;
+        m) socketmodes=$OPTARG ;;
+        b) batch=$OPTARG ;;
+        r) repetitions=$OPTARG ;;
+        T) timeout=$OPTARG ;;
+        o) prefix=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -le 1 ] || usage
+
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+
+[ -x "$repodir/ex_3/tecnicofs" ] && [ -x "$repodir/ex_3/tecnicofs-driver" ] || make -s -C "$repodir/ex_3" > /dev/null || exit 1
+input=$1
+if [ -z "$input" ]; then    #without an input file a default workload is generated
+    [ -x "$repodir/tools/workload-gen" ] || make -s -C "$repodir/tools" > /dev/null || exit 1
+    input=$scratch/workload.txt
+    "$repodir/tools/workload-gen" -n 20000 "$input" || exit 1
+fi
+
+csv=$prefix.csv
+echo "mode,clients,repetition,ops,seconds,throughput_ops_s,p50_us,p99_us,p999_us,max_us,status" > "$csv"
+for mode in ${socketmodes//,/ }; do
+    for nclients in ${clients//,/ }; do
+        echo "Mode=$mode Clients=$nclients ServerThreads=$serverthreads" >&2
+        for rep in $(seq "$repetitions"); do
+            socket=$scratch/server.sock
+            rm -f "$socket"
+            (cd "$scratch" && exec "$repodir/ex_3/tecnicofs" "$serverthreads" "$socket" "$mode" > /dev/null 2>&1) &
+            server=$!
+            for _ in $(seq 50); do [ -S "$socket" ] && break; sleep 0.1; done
+            line=$(timeout "$timeout" "$repodir/ex_3/tecnicofs-driver" -S -t "$nclients" -b "$batch" -s "$socket" "$input" | awk '$1 == "socket"')
+            kill $server 2> /dev/null
+            wait $server 2> /dev/null
+            if [ -n "$line" ]; then
+                echo "$line" | awk -v mode="$mode" -v rep="$rep" -v OFS=, '{ print mode, $2, rep, $3, $4, $5, $6, $7, $8, $9, "ok" }' >> "$csv"
+            else
+                echo "$mode,$nclients,$rep,,,,,,,,failed" >> "$csv"
+            fi
+        done
+    done
+done
+
+if command -v column > /dev/null; then column -s, -t "$csv"; else cat "$csv"; fi
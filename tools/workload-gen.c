@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+
+#define MAX_FILE_NAME 100       //same limit the file system uses for paths
+#define OP_CREATE 0
+#define OP_LOOKUP 1
+#define OP_DELETE 2
+#define OP_MOVE 3
+#define NUM_OPS 4
+
+/*
+ * Node of the model tree the generator keeps in memory.
+ * The children of a directory are kept in slots, the same way the file system
+ * keeps its directory entries: a new entry takes the first free slot, so the
+ * expected tree can be printed in exactly the order tecnicofs prints it.
+ */
+typedef struct node {
+    char name[MAX_FILE_NAME];
+    int parent;
+    int isDir;
+    int* slots;             //children of a directory, -1 for a free slot
+    int slotCount;
+    int* files;             //files inside a directory, in no particular order, to pick them in O(1)
+    int fileCount;
+    int fileCapacity;
+} node_t;
+
+/*global variables that are used when initializing the program:
+workload-gen [options] outputfile*/
+
+long totalOps = 1000;           //number of operations generated after the directory skeleton
+int mix[NUM_OPS] = {40, 40, 10, 10};   //weights of create, lookup, delete and move
+int depth = 2;                  //depth of the directory skeleton
+int fanout = 4;                 //number of sub-directories of every skeleton directory
+double skew = 0.99;             //zipf exponent used to choose hot directories, 0 means uniform
+uint64_t seed = 1;              //random seed, the same seed always produces the same workload
+char* printFilename = NULL;     //when set, the workload ends with a print command (client scripts)
+char* expectedFilename = NULL;  //when set, the expected final tree is written to this file
+char* outputFilename = NULL;
+
+node_t* nodes = NULL;
+int numberNodes = 0;
+int nodesCapacity = 0;
+int* hotDirs = NULL;            //skeleton directories, ordered by popularity
+double* hotCdf = NULL;          //cumulative zipf distribution over hotDirs
+int numberHotDirs = 0;
+long nextName = 0;              //counter used to give every new file a unique name
+long opCount[NUM_OPS];
+
+static void displayUsage(const char* appName) {
+    fprintf(stderr, "Usage: %s [options] outputfile\n"
+        "  -n ops        operations generated after the directory skeleton (default %ld)\n"
+        "  -m c:l:d:m    weights of create, lookup, delete and move (default %d:%d:%d:%d)\n"
+        "  -D depth      depth of the directory skeleton (default %d)\n"
+        "  -F fanout     sub-directories of each skeleton directory (default %d)\n"
+        "  -z skew       zipf exponent of the hot directories, 0 is uniform (default %.2f)\n"
+        "  -s seed       random seed (default %llu)\n"
+        "  -p file       end with 'p file', as the ex_3 client scripts do\n"
+        "  -e file       write the tree expected after a sequential run to file\n",
+        appName, totalOps, mix[0], mix[1], mix[2], mix[3], depth, fanout, skew, (unsigned long long) seed);
+    exit(EXIT_FAILURE);
+}
+
+static void arguments(int argc, char* const argv[]) {   //this function parses the program's variables
+    int opt;
+    while((opt = getopt(argc, argv, "n:m:D:F:z:s:p:e:")) != -1) {
+        switch(opt) {
+            case 'n':
+                totalOps = atol(optarg);
+                break;
+            case 'm':
+                if(sscanf(optarg, "%d:%d:%d:%d", &mix[0], &mix[1], &mix[2], &mix[3]) != NUM_OPS)
+                    displayUsage(argv[0]);
+                break;
+            case 'D':
+                depth = atoi(optarg);
+                break;
+            case 'F':
+                fanout = atoi(optarg);
+                break;
+            case 'z':
+                skew = atof(optarg);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'p':
+                printFilename = optarg;
+                break;
+            case 'e':
+                expectedFilename = optarg;
+                break;
+            default:
+                displayUsage(argv[0]);
+        }
+    }
+    if(optind != argc - 1)
+        displayUsage(argv[0]);
+    outputFilename = argv[optind];
+
+    if(totalOps < 0 || depth < 0 || fanout < 0 || skew < 0) {
+        fprintf(stderr, "Please use non negative values for the workload parameters\n");
+        exit(EXIT_FAILURE);
+    }
+    if(mix[0] < 0 || mix[1] < 0 || mix[2] < 0 || mix[3] < 0 || mix[0] + mix[1] + mix[2] + mix[3] == 0) {
+        fprintf(stderr, "Please use a valid operation mix\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+uint64_t nextRandom() {     //xorshift64*, so the workload only depends on the seed and not on the libc
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 2685821657736338717ULL;
+}
+
+double randomUniform() {    //uniform value in [0, 1)
+    return (nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+long randomBelow(long bound) {
+    return (long) (randomUniform() * bound);
+}
+
+void* allocate(void* pointer, size_t size) {    //realloc that exits the program when out of memory
+    void* result = realloc(pointer, size);
+    if(!result) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+int newNode(int parent, const char* name, int isDir) {  //adds a node to the model, taking the first free slot of its parent
+    if(numberNodes == nodesCapacity) {
+        nodesCapacity = nodesCapacity == 0 ? 64 : nodesCapacity * 2;
+        nodes = allocate(nodes, nodesCapacity * sizeof(node_t));
+    }
+    int inumber = numberNodes++;
+    node_t* node = &nodes[inumber];
+    memset(node, 0, sizeof(node_t));
+    strcpy(node->name, name);
+    node->parent = parent;
+    node->isDir = isDir;
+    if(parent < 0)
+        return inumber;
+
+    node_t* dir = &nodes[parent];
+    int slot = 0;
+    while(slot < dir->slotCount && dir->slots[slot] != -1)
+        slot++;
+    if(slot == dir->slotCount) {
+        dir->slots = allocate(dir->slots, (dir->slotCount + 1) * sizeof(int));
+        dir->slotCount++;
+    }
+    dir->slots[slot] = inumber;
+    if(!isDir) {
+        if(dir->fileCount == dir->fileCapacity) {
+            dir->fileCapacity = dir->fileCapacity == 0 ? 8 : dir->fileCapacity * 2;
+            dir->files = allocate(dir->files, dir->fileCapacity * sizeof(int));
+        }
+        dir->files[dir->fileCount++] = inumber;
+    }
+    return inumber;
+}
+
+void removeFile(int dirInumber, int fileIndex) {    //removes the fileIndex-th file of a directory from the model
+    node_t* dir = &nodes[dirInumber];
+    int inumber = dir->files[fileIndex];
+    dir->files[fileIndex] = dir->files[--dir->fileCount];
+    for(int i = 0; i < dir->slotCount; i++) {
+        if(dir->slots[i] == inumber) {
+            dir->slots[i] = -1;
+            break;
+        }
+    }
+}
+
+int buildPath(int inumber, char* path, size_t size) {  //writes the full path of a node, returns its length
+    if(inumber <= 0) {
+        path[0] = '\0';
+        return 0;
+    }
+    int length = buildPath(nodes[inumber].parent, path, size);
+    return length + snprintf(path + length, size > length ? size - length : 0, "/%s", nodes[inumber].name);
+}
+
+void writePath(FILE* fp, int inumber) {
+    char path[4 * MAX_FILE_NAME];
+    if(buildPath(inumber, path, sizeof(path)) >= MAX_FILE_NAME) {
+        fprintf(stderr, "Path longer than %d characters, use a smaller depth\n", MAX_FILE_NAME - 1);
+        exit(EXIT_FAILURE);
+    }
+    fputs(path, fp);
+}
+
+void buildSkeleton(FILE* fp) {  //creates the directories of the skeleton, level by level
+    char name[MAX_FILE_NAME];
+    int levelStart = 0, levelEnd = 1;
+    newNode(-1, "", 1);
+    for(int level = 0; level < depth; level++) {
+        for(int dir = levelStart; dir < levelEnd; dir++) {
+            for(int i = 0; i < fanout; i++) {
+                snprintf(name, sizeof(name), "d%d", i);
+                int inumber = newNode(dir, name, 1);
+                fputs("c ", fp);
+                writePath(fp, inumber);
+                fputs(" d\n", fp);
+                opCount[OP_CREATE]++;
+            }
+        }
+        levelStart = levelEnd;
+        levelEnd = numberNodes;
+    }
+}
+
+void buildHotDirs() {   //shuffles the skeleton directories and gives them zipf popularities
+    numberHotDirs = numberNodes;
+    hotDirs = allocate(NULL, numberHotDirs * sizeof(int));
+    hotCdf = allocate(NULL, numberHotDirs * sizeof(double));
+    for(int i = 0; i < numberHotDirs; i++)
+        hotDirs[i] = i;
+    for(int i = numberHotDirs - 1; i > 0; i--) {
+        int j = randomBelow(i + 1);
+        int temp = hotDirs[i];
+        hotDirs[i] = hotDirs[j];
+        hotDirs[j] = temp;
+    }
+    double total = 0;
+    for(int i = 0; i < numberHotDirs; i++) {
+        total += 1.0 / pow(i + 1, skew);
+        hotCdf[i] = total;
+    }
+    for(int i = 0; i < numberHotDirs; i++)
+        hotCdf[i] /= total;
+}
+
+int pickDir() {     //chooses a skeleton directory following the zipf distribution
+    double value = randomUniform();
+    int low = 0, high = numberHotDirs - 1;
+    while(low < high) {
+        int middle = (low + high) / 2;
+        if(hotCdf[middle] < value)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return hotDirs[low];
+}
+
+int pickOp() {
+    long value = randomBelow(mix[0] + mix[1] + mix[2] + mix[3]);
+    int op = 0;
+    while(value >= mix[op])
+        value -= mix[op++];
+    return op;
+}
+
+void generateCreate(FILE* fp, int dir) {
+    char name[MAX_FILE_NAME];
+    snprintf(name, sizeof(name), "f%ld", nextName++);
+    int inumber = newNode(dir, name, 0);
+    fputs("c ", fp);
+    writePath(fp, inumber);
+    fputs(" f\n", fp);
+    opCount[OP_CREATE]++;
+}
+
+void generateOp(FILE* fp) {     //writes one operation, falling back to a create when the chosen directory has no files
+    int op = pickOp();
+    int dir = pickDir();
+    if(op != OP_CREATE && op != OP_LOOKUP && nodes[dir].fileCount == 0)
+        op = OP_CREATE;
+
+    switch(op) {
+        case OP_CREATE:
+            generateCreate(fp, dir);
+            break;
+        case OP_LOOKUP:     //a lookup of a directory without files looks up the directory itself
+            fputs("l ", fp);
+            if(nodes[dir].fileCount == 0)
+                dir == 0 ? fputs("/", fp) : writePath(fp, dir);
+            else
+                writePath(fp, nodes[dir].files[randomBelow(nodes[dir].fileCount)]);
+            fputs("\n", fp);
+            opCount[OP_LOOKUP]++;
+            break;
+        case OP_DELETE: {
+            int index = randomBelow(nodes[dir].fileCount);
+            fputs("d ", fp);
+            writePath(fp, nodes[dir].files[index]);
+            fputs("\n", fp);
+            removeFile(dir, index);
+            opCount[OP_DELETE]++;
+            break;
+        }
+        case OP_MOVE: {     //moves a file of a hot directory to another hot directory, under a new name
+            int index = randomBelow(nodes[dir].fileCount);
+            int source = nodes[dir].files[index];
+            char name[MAX_FILE_NAME];
+            fputs("m ", fp);
+            writePath(fp, source);
+            removeFile(dir, index);
+            snprintf(name, sizeof(name), "f%ld", nextName++);
+            int target = newNode(pickDir(), name, 0);
+            fputs(" ", fp);
+            writePath(fp, target);
+            fputs("\n", fp);
+            opCount[OP_MOVE]++;
+            break;
+        }
+    }
+}
+
+void printTree(FILE* fp, int inumber, char* path, int length) {    //prints the model the same way inode_print_tree does
+    fprintf(fp, "%s\n", path);
+    for(int i = 0; i < nodes[inumber].slotCount; i++) {
+        int child = nodes[inumber].slots[i];
+        if(child != -1) {
+            int childLength = length + sprintf(path + length, "/%s", nodes[child].name);
+            printTree(fp, child, path, childLength);
+            path[length] = '\0';
+        }
+    }
+}
+
+FILE* openOutput(char* filename) {        //the output file is opened for writing only
+    FILE* outputFile = fopen(filename, "w");
+    if(!outputFile) {
+        fprintf(stderr, "Could not open/create requested output file\n");
+        exit(EXIT_FAILURE);
+    }
+    return outputFile;
+}
+
+int main(int argc, char* argv[]) {
+    char* commands = NULL;
+    size_t commandsSize = 0;
+    arguments(argc, argv);
+    if(seed == 0)   //xorshift can't leave the zero state
+        seed = 0x9E3779B97F4A7C15ULL;
+
+    /* the operations are generated first, so the header can tell how many of each there are */
+    FILE* commandsStream = open_memstream(&commands, &commandsSize);
+    if(!commandsStream) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    buildSkeleton(commandsStream);
+    buildHotDirs();
+    for(long i = 0; i < totalOps; i++)
+        generateOp(commandsStream);
+    if(printFilename)
+        fprintf(commandsStream, "p %s\n", printFilename);
+    fclose(commandsStream);
+
+    FILE* outputFile = openOutput(outputFilename);
+    fprintf(outputFile, "# %ld creates, %ld lookups, %ld deletes, %ld moves\n",
+        opCount[OP_CREATE], opCount[OP_LOOKUP], opCount[OP_DELETE], opCount[OP_MOVE]);
+    fwrite(commands, 1, commandsSize, outputFile);
+    fclose(outputFile);
+    free(commands);
+
+    if(expectedFilename) {
+        char path[4 * MAX_FILE_NAME] = "";
+        FILE* expectedFile = openOutput(expectedFilename);
+        printTree(expectedFile, 0, path, 0);
+        fclose(expectedFile);
+    }
+
+    for(int i = 0; i < numberNodes; i++) {
+        free(nodes[i].slots);
+        free(nodes[i].files);
+    }
+    free(nodes);
+    free(hotDirs);
+    free(hotCdf);
+    exit(EXIT_SUCCESS);
+}